@@ -0,0 +1,574 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "update-shared.h"
+#include "board-db.h"
+
+/* How long a bucket looks for a seed that puts its strings in empty slots */
+#define BOARD_DB_SEED_MAX (1 << 20)
+
+/* FNV-1a from a seeded basis, finished off so a few slots still get an even share */
+static uint32_t board_db_hash(const char *s, size_t len, uint32_t seed)
+{
+	uint32_t h = 0x811c9dc5 ^ seed;
+
+	while (len--) {
+		h ^= (uint8_t)*s++;
+		h *= 0x01000193;
+	}
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static const struct board_db_board *board_db_entry(const struct board_db *db, unsigned int i)
+{
+	return (const struct board_db_board *)&db->map[db->hdr->header_size + (size_t)i * db->hdr->board_size];
+}
+
+/* Check the header of the database at map and point db at its parts. Returns < 0 if it is not one. */
+static int board_db_load(struct board_db *db, const uint8_t *map, size_t len)
+{
+	const struct board_db_header *hdr = (const struct board_db_header *)map;
+	uint64_t seeds, slots, strings;
+
+	if (len < sizeof(*hdr) || hdr->magic != BOARD_DB_MAGIC || hdr->version != BOARD_DB_VERSION ||
+	    hdr->header_size < sizeof(*hdr) || hdr->board_size < sizeof(struct board_db_board) ||
+	    (hdr->header_size % 4) || (hdr->board_size % 4) || hdr->nboards > BOARD_DB_NONE ||
+	    (hdr->nboards && !hdr->nbuckets) || hdr->nslots < hdr->nboards || !hdr->strings_len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	seeds = hdr->header_size + (uint64_t)hdr->nboards * hdr->board_size;
+	slots = seeds + (uint64_t)hdr->nbuckets * sizeof(uint32_t);
+	strings = slots + (uint64_t)hdr->nslots * sizeof(uint16_t);
+	if (strings + hdr->strings_len > len || map[strings + hdr->strings_len - 1] != '\0') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	db->boards = calloc(hdr->nboards ? hdr->nboards : 1, sizeof(*db->boards));
+	if (!db->boards)
+		return -1;
+	pthread_mutex_init(&db->fill_lock, NULL);
+
+	db->map = map;
+	db->map_len = len;
+	db->hdr = hdr;
+	db->seeds = (const uint32_t *)&map[seeds];
+	db->slots = (const uint16_t *)&map[slots];
+	db->strings = (const char *)&map[strings];
+
+	return 0;
+}
+
+/*
+ * Map the database at path. Only the header is checked. Returns < 0 with
+ * errno set on failure, having said why unless there is no such file.
+ */
+int board_db_open(struct board_db *db, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	memset(db, 0, sizeof(*db));
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		fprintf(stderr, "%s is not a board database\n", path);
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Unable to map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (board_db_load(db, map, st.st_size) < 0) {
+		if (errno == EINVAL)
+			fprintf(stderr, "%s is not a board database\n", path);
+		else
+			perror("Unable to allocate boards");
+		munmap(map, st.st_size);
+		return -1;
+	}
+	db->mapped = 1;
+
+	return 0;
+}
+
+void board_db_close(struct board_db *db)
+{
+	if (db->mapped)
+		munmap((void *)db->map, db->map_len);
+	else
+		free((void *)db->map);
+	if (db->boards)
+		pthread_mutex_destroy(&db->fill_lock);
+	free(db->boards);
+	memset(db, 0, sizeof(*db));
+}
+
+unsigned int board_db_count(const struct board_db *db)
+{
+	return db->hdr ? db->hdr->nboards : 0;
+}
+
+/* The i-th board in the database, NULL past the last or if it is not valid */
+board_t *board_db_at(struct board_db *db, unsigned int i)
+{
+	const struct board_db_board *e;
+	board_t *b;
+
+	if (i >= board_db_count(db))
+		return NULL;
+
+	b = &db->boards[i];
+	if (__atomic_load_n(&b->compatible, __ATOMIC_ACQUIRE))
+		return b;
+
+	pthread_mutex_lock(&db->fill_lock);
+	if (b->compatible)
+		goto out;
+
+	e = board_db_entry(db, i);
+	if (e->compatible >= db->hdr->strings_len || e->method > UPDATE_V1) {
+		fprintf(stderr, "Board %u in the board database is not valid\n", i);
+		b = NULL;
+		goto out;
+	}
+
+	b->modelnum = e->modelnum;
+	b->compatible_id = e->compatible_id;
+	b->min_rev = e->min_rev;
+	b->method = e->method;
+	b->i2c_bus = e->i2c_bus;
+	b->i2c_chip = e->i2c_chip;
+	/* Everything above is seen by whoever sees this */
+	__atomic_store_n(&b->compatible, &db->strings[e->compatible], __ATOMIC_RELEASE);
+
+out:
+	pthread_mutex_unlock(&db->fill_lock);
+	return b;
+}
+
+/* The board with the compatible string of len bytes, NULL if there is none */
+board_t *board_db_find(struct board_db *db, const char *compatible, size_t len)
+{
+	const struct board_db_board *e;
+	uint32_t bucket, slot;
+	uint16_t i;
+
+	if (!board_db_count(db))
+		return NULL;
+
+	bucket = board_db_hash(compatible, len, 0) % db->hdr->nbuckets;
+	slot = board_db_hash(compatible, len, db->seeds[bucket]) % db->hdr->nslots;
+	i = db->slots[slot];
+	if (i >= db->hdr->nboards)
+		return NULL;
+
+	/* Any string hashes to some slot, only the one that was put there is a match */
+	e = board_db_entry(db, i);
+	if (e->compatible >= db->hdr->strings_len || strnlen(&db->strings[e->compatible], len + 1) != len ||
+	    memcmp(&db->strings[e->compatible], compatible, len))
+		return NULL;
+
+	return board_db_at(db, i);
+}
+
+/* A board and the bucket its string is in */
+struct board_db_key {
+	uint32_t bucket;
+	unsigned int board;
+};
+
+/* A bucket's strings, to place biggest bucket first */
+struct board_db_bucket {
+	uint32_t bucket;
+	unsigned int n;
+	unsigned int first; /* In the keys sorted by bucket */
+};
+
+static int board_db_cmp_bucket(const void *a, const void *b)
+{
+	const struct board_db_bucket *ba = a;
+	const struct board_db_bucket *bb = b;
+
+	return (ba->n < bb->n) - (ba->n > bb->n);
+}
+
+/*
+ * Find a seed for each bucket that puts all of its strings in empty slots,
+ * biggest buckets first while most slots are still empty. keys[] is sorted
+ * by bucket. Returns < 0 if some bucket has no such seed.
+ */
+static int board_db_place(const board_t *boards, const struct board_db_key *keys, struct board_db_bucket *buckets,
+			  uint32_t nbuckets, uint32_t *seeds, uint16_t *slots, uint32_t nslots)
+{
+	const struct board_db_key *k;
+	const struct board_db_bucket *bk;
+	uint32_t placed[64];
+	unsigned int i, j;
+	uint32_t seed;
+	const char *s;
+
+	for (i = 0; i < nslots; i++)
+		slots[i] = BOARD_DB_NONE;
+
+	qsort(buckets, nbuckets, sizeof(*buckets), board_db_cmp_bucket);
+	for (bk = buckets; bk < buckets + nbuckets && bk->n; bk++) {
+		if (bk->n > sizeof(placed) / sizeof(placed[0]))
+			return -1;
+
+		k = &keys[bk->first];
+		for (seed = 1; seed < BOARD_DB_SEED_MAX; seed++) {
+			for (j = 0; j < bk->n; j++) {
+				s = boards[k[j].board].compatible;
+				placed[j] = board_db_hash(s, strlen(s), seed) % nslots;
+				if (slots[placed[j]] != BOARD_DB_NONE)
+					break;
+				/* Taken now, so two of the bucket's own strings cannot share it */
+				slots[placed[j]] = k[j].board;
+			}
+			if (j == bk->n)
+				break;
+			while (j--)
+				slots[placed[j]] = BOARD_DB_NONE;
+		}
+		if (seed == BOARD_DB_SEED_MAX)
+			return -1;
+		seeds[bk->bucket] = seed;
+	}
+
+	return 0;
+}
+
+/* By bucket, keeping the order the boards were given in within one */
+static int board_db_cmp_key(const void *a, const void *b)
+{
+	const struct board_db_key *ka = a;
+	const struct board_db_key *kb = b;
+
+	if (ka->bucket != kb->bucket)
+		return (ka->bucket > kb->bucket) - (ka->bucket < kb->bucket);
+	return (ka->board > kb->board) - (ka->board < kb->board);
+}
+
+/*
+ * Lay out a database of nboards boards in a new buffer. Returns < 0, having
+ * said why, if a compatible string is listed twice or the boards do not fit.
+ */
+static int board_db_pack(const board_t *boards, unsigned int nboards, uint8_t **out, size_t *out_len)
+{
+	struct board_db_header hdr = { 0 };
+	struct board_db_bucket *buckets = NULL;
+	struct board_db_board *e;
+	struct board_db_key *keys = NULL;
+	uint32_t *seeds;
+	uint16_t *slots;
+	uint8_t *map = NULL;
+	char *strings;
+	size_t len, strings_off;
+	unsigned int i, j;
+	int ret = -1;
+
+	if (nboards >= BOARD_DB_NONE) {
+		fprintf(stderr, "Too many boards for one board database\n");
+		return -1;
+	}
+
+	hdr.magic = BOARD_DB_MAGIC;
+	hdr.version = BOARD_DB_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.nboards = nboards;
+	hdr.board_size = sizeof(*e);
+	/* About four strings a bucket, with a fifth of the slots left empty, finds seeds quickly */
+	hdr.nbuckets = nboards / 4 + 1;
+	hdr.nslots = (nboards + nboards / 4 + 2) & ~1u;
+	hdr.strings_len = 1;
+	for (i = 0; i < nboards; i++) {
+		if (boards[i].i2c_bus < 0 || boards[i].i2c_bus > UINT8_MAX || boards[i].i2c_chip < 0 ||
+		    boards[i].i2c_chip > UINT8_MAX) {
+			fprintf(stderr, "%s is on a bus or chip address out of range\n", boards[i].compatible);
+			return -1;
+		}
+		hdr.strings_len += strlen(boards[i].compatible) + 1;
+	}
+
+	strings_off = hdr.header_size + (size_t)nboards * hdr.board_size + hdr.nbuckets * sizeof(*seeds) +
+		      hdr.nslots * sizeof(*slots);
+	len = strings_off + hdr.strings_len;
+	map = calloc(1, len);
+	buckets = calloc(hdr.nbuckets, sizeof(*buckets));
+	keys = calloc(nboards + 1, sizeof(*keys));
+	if (!map || !buckets || !keys) {
+		perror("Unable to allocate board database");
+		goto out;
+	}
+	memcpy(map, &hdr, sizeof(hdr));
+	e = (struct board_db_board *)&map[hdr.header_size];
+	seeds = (uint32_t *)&map[hdr.header_size + (size_t)nboards * hdr.board_size];
+	slots = (uint16_t *)&seeds[hdr.nbuckets];
+	strings = (char *)&map[strings_off];
+
+	/* The empty string at 0 is never a board's */
+	strings_off = 1;
+	for (i = 0; i < nboards; i++) {
+		e[i].compatible = strings_off;
+		e[i].modelnum = boards[i].modelnum;
+		e[i].compatible_id = boards[i].compatible_id;
+		e[i].min_rev = boards[i].min_rev;
+		e[i].method = boards[i].method;
+		e[i].i2c_bus = boards[i].i2c_bus;
+		e[i].i2c_chip = boards[i].i2c_chip;
+		strcpy(&strings[strings_off], boards[i].compatible);
+		strings_off += strlen(boards[i].compatible) + 1;
+
+		keys[i].bucket = board_db_hash(boards[i].compatible, strlen(boards[i].compatible), 0) % hdr.nbuckets;
+		keys[i].board = i;
+		buckets[keys[i].bucket].n++;
+	}
+
+	qsort(keys, nboards, sizeof(*keys), board_db_cmp_key);
+	for (i = 0, j = 0; i < hdr.nbuckets; i++) {
+		buckets[i].bucket = i;
+		buckets[i].first = j;
+		j += buckets[i].n;
+	}
+
+	/* The same string always lands in the same bucket, and no seed can separate two */
+	for (i = 1; i < nboards; i++) {
+		for (j = i; j-- > 0 && keys[j].bucket == keys[i].bucket;) {
+			if (!strcmp(boards[keys[j].board].compatible, boards[keys[i].board].compatible)) {
+				fprintf(stderr, "%s is listed more than once\n", boards[keys[i].board].compatible);
+				goto out;
+			}
+		}
+	}
+
+	if (board_db_place(boards, keys, buckets, hdr.nbuckets, seeds, slots, hdr.nslots) < 0) {
+		fprintf(stderr, "Unable to hash the board list\n");
+		goto out;
+	}
+
+	*out = map;
+	*out_len = len;
+	map = NULL;
+	ret = 0;
+
+out:
+	free(map);
+	free(buckets);
+	free(keys);
+	return ret;
+}
+
+/* Make db from nboards boards in memory, as the built-in board table is. Returns < 0 on failure. */
+int board_db_build(struct board_db *db, const board_t *boards, unsigned int nboards)
+{
+	uint8_t *map;
+	size_t len;
+
+	memset(db, 0, sizeof(*db));
+
+	if (board_db_pack(boards, nboards, &map, &len) < 0)
+		return -1;
+	if (board_db_load(db, map, len) < 0) {
+		perror("Unable to allocate boards");
+		free(map);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Read a board list: one board per line, its compatible string and then a
+ * comma separated list of model=, id=, bus=, chip=, rev= and method= settings.
+ * Blank lines and those starting with # are skipped. Returns the number of
+ * boards, < 0 on failure.
+ */
+static int board_db_read_list(const char *path, board_t **out)
+{
+	enum { O_MODEL, O_ID, O_BUS, O_CHIP, O_REV, O_METHOD };
+	char *const tokens[] = {
+		[O_MODEL] = "model",
+		[O_ID] = "id",
+		[O_BUS] = "bus",
+		[O_CHIP] = "chip",
+		[O_REV] = "rev",
+		[O_METHOD] = "method",
+		NULL,
+	};
+	board_t *boards = NULL;
+	board_t *b;
+	char line[512];
+	char *comp, *opts, *value;
+	unsigned int lineno = 0;
+	int nboards = 0;
+	int tok;
+	FILE *file;
+
+	file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		lineno++;
+		comp = strtok(line, " \t\r\n");
+		if (!comp || *comp == '#')
+			continue;
+		opts = strtok(NULL, " \t\r\n");
+
+		b = realloc(boards, (nboards + 1) * sizeof(*boards));
+		if (!b) {
+			perror("Unable to allocate boards");
+			goto err_out;
+		}
+		boards = b;
+		b = &boards[nboards];
+		memset(b, 0, sizeof(*b));
+		b->method = UPDATE_V1;
+		b->compatible = strdup(comp);
+		if (!b->compatible) {
+			perror("Unable to allocate boards");
+			goto err_out;
+		}
+		nboards++;
+
+		while (opts && *opts != '\0') {
+			tok = getsubopt(&opts, tokens, &value);
+			if (tok < 0) {
+				fprintf(stderr, "%s:%u: Unknown board setting \"%s\"\n", path, lineno, value);
+				goto err_out;
+			}
+			if (!value) {
+				fprintf(stderr, "%s:%u: Board setting \"%s\" needs a value\n", path, lineno, tokens[tok]);
+				goto err_out;
+			}
+
+			switch (tok) {
+			case O_MODEL:
+				b->modelnum = strtoul(value, NULL, 0);
+				break;
+			case O_ID:
+				b->compatible_id = strtoul(value, NULL, 0);
+				break;
+			case O_BUS:
+				b->i2c_bus = strtoul(value, NULL, 0);
+				break;
+			case O_CHIP:
+				b->i2c_chip = strtoul(value, NULL, 0);
+				break;
+			case O_REV:
+				b->min_rev = strtoul(value, NULL, 0);
+				break;
+			case O_METHOD:
+				if (!strcmp(value, "v0")) {
+					b->method = UPDATE_V0;
+				} else if (!strcmp(value, "v1")) {
+					b->method = UPDATE_V1;
+				} else {
+					fprintf(stderr, "%s:%u: Unknown method \"%s\"\n", path, lineno, value);
+					goto err_out;
+				}
+				break;
+			}
+		}
+
+		if (!b->modelnum) {
+			fprintf(stderr, "%s:%u: %s needs a model=\n", path, lineno, b->compatible);
+			goto err_out;
+		}
+	}
+
+	if (ferror(file)) {
+		fprintf(stderr, "Unable to read %s\n", path);
+		goto err_out;
+	}
+	fclose(file);
+
+	*out = boards;
+	return nboards;
+
+err_out:
+	fclose(file);
+	while (nboards--)
+		free((char *)boards[nboards].compatible);
+	free(boards);
+	return -1;
+}
+
+/* Write a database of the boards in the board list at list to path, replacing it. Returns < 0 on failure. */
+int board_db_create(const char *path, const char *list)
+{
+	char tmp[PATH_MAX + 8];
+	board_t *boards = NULL;
+	uint8_t *map = NULL;
+	size_t len, done;
+	ssize_t n;
+	int nboards;
+	int ret = -1;
+	int fd;
+	int i;
+
+	nboards = board_db_read_list(list, &boards);
+	if (nboards < 0)
+		return -1;
+	if (board_db_pack(boards, nboards, &map, &len) < 0)
+		goto out;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to create %s: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+	for (done = 0; done < len; done += n) {
+		n = write(fd, map + done, len - done);
+		if (n <= 0)
+			break;
+	}
+	if (close(fd) < 0 || done < len || rename(tmp, path) < 0) {
+		fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+
+	printf("Wrote %d boards to %s\n", nboards, path);
+	ret = 0;
+
+out:
+	for (i = 0; i < nboards; i++)
+		free((char *)boards[i].compatible);
+	free(boards);
+	free(map);
+	return ret;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "update-shared.h"
+
+/*
+ * Board database
+ *
+ * The boards the updater knows, in a file instead of compiled in, so a new
+ * carrier board only needs a line in a board list and the database made from
+ * it. A fixed header, the boards, and a perfect hash of their compatible
+ * strings: a seed per bucket and a slot per string, then the strings
+ * themselves. Fields are in native byte order, read straight from the map, so
+ * a database only works on machines of the same endianness as the one that
+ * made it; every board this runs on is little-endian.
+ *
+ * A string is looked up by hashing it once to find its bucket and again with
+ * that bucket's seed to find its slot, which holds the only board it can be.
+ * Finding a board costs the same however many are in the database, and
+ * opening one only checks the header; each board is checked the first time
+ * it is looked at. Any thread may look one up: a board is filled in under
+ * fill_lock and published by a release store of its compatible string, so
+ * looking at one already filled in takes no lock.
+ */
+#define BOARD_DB_MAGIC 0x44425354 /* "TSBD" */
+#define BOARD_DB_VERSION 1
+#define BOARD_DB_NONE 0xffff /* An empty slot */
+#ifndef BOARD_DB_PATH
+#define BOARD_DB_PATH "/usr/share/tssupervisorupdate/boards.db"
+#endif
+
+struct board_db_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size; /* Where the boards start */
+	uint32_t nboards;
+	uint32_t board_size; /* Boards only ever grow */
+	uint32_t nbuckets; /* Of 32-bit seeds, after the boards */
+	uint32_t nslots; /* Of 16-bit board numbers, after the seeds */
+	uint32_t strings_len; /* Of the compatible strings, after the slots */
+	uint32_t reserved[3];
+};
+
+struct board_db_board {
+	uint32_t compatible; /* Offset of its string from the start of the strings */
+	uint16_t modelnum;
+	uint16_t compatible_id;
+	uint16_t min_rev;
+	uint8_t method; /* update_meth_t */
+	uint8_t i2c_bus;
+	uint8_t i2c_chip;
+	uint8_t reserved[3];
+};
+
+struct board_db {
+	const uint8_t *map;
+	size_t map_len;
+	int mapped; /* Or allocated, by board_db_build() */
+	const struct board_db_header *hdr;
+	const uint32_t *seeds;
+	const uint16_t *slots;
+	const char *strings;
+	board_t *boards; /* Filled in as they are looked at */
+	pthread_mutex_t fill_lock;
+};
+
+int board_db_open(struct board_db *db, const char *path);
+int board_db_build(struct board_db *db, const board_t *boards, unsigned int nboards);
+void board_db_close(struct board_db *db);
+board_t *board_db_find(struct board_db *db, const char *compatible, size_t len);
+board_t *board_db_at(struct board_db *db, unsigned int i);
+unsigned int board_db_count(const struct board_db *db);
+int board_db_create(const char *path, const char *list);
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "update-shared.h"
+#include "board-db.h"
+#include "boards.h"
+
+/* Only used when there is no board database, see board-db.h */
+static const board_t builtin_boards[] = {
+	{
+		.compatible = "technologic,imx6q-ts7970",
+		.i2c_bus = 0,
+		.i2c_chip = 0x10,
+		.modelnum = 0x7970,
+		.min_rev = 7,
+		.method = UPDATE_V0,
+	},
+	{
+		.compatible = "technologic,imx6dl-ts7970",
+		.i2c_bus = 0,
+		.i2c_chip = 0x10,
+		.modelnum = 0x7970,
+		.min_rev = 7,
+		.method = UPDATE_V0,
+	},
+	{
+		.compatible = "fsl,imx6q-ts7970", /* Legacy < 4.9.x kernels */
+		.i2c_bus = 0,
+		.i2c_chip = 0x10,
+		.modelnum = 0x7970,
+		.min_rev = 7,
+		.method = UPDATE_V0,
+	},
+	{
+		.compatible = "fsl,imx6dl-ts7970", /* Legacy < 4.9.x kernels */
+		.i2c_bus = 0,
+		.i2c_chip = 0x10,
+		.modelnum = 0x7970,
+		.min_rev = 7,
+		.method = UPDATE_V0,
+	},
+	{
+		.compatible = "technologic,ts7250v3",
+		.i2c_bus = 0,
+		.i2c_chip = 0x10,
+		.modelnum = 0x7250,
+		.method = UPDATE_V1,
+	},
+	{
+		.compatible = "technologic,ts4300",
+		.modelnum = 0x4300,
+		.compatible_id = 0x9370,
+		.i2c_bus = 3,
+		.i2c_chip = 0x54,
+		.method = UPDATE_V1,
+	},
+	{
+		.compatible = "technologic,ts9370",
+		.modelnum = 0x9370,
+		.compatible_id = 0x9370,
+		.i2c_bus = 3,
+		.i2c_chip = 0x54,
+		.method = UPDATE_V1,
+	},
+	{
+		.compatible = "technologic,ts9390",
+		.modelnum = 0x9390,
+		.compatible_id = 0x9370,
+		.i2c_bus = 3,
+		.i2c_chip = 0x54,
+		.method = UPDATE_V1,
+	},
+};
+
+static struct board_db db;
+static const char *db_path = BOARD_DB_PATH;
+static int db_given;
+static int db_loaded;
+static pthread_once_t db_once = PTHREAD_ONCE_INIT;
+
+static void boards_init(void)
+{
+	int err;
+
+	db_loaded = (board_db_open(&db, db_path) == 0);
+	if (db_loaded)
+		return;
+	/* No database where there is usually none is not worth a word */
+	err = errno;
+	if (err == ENOENT && db_given)
+		fprintf(stderr, "Unable to open %s: %s\n", db_path, strerror(err));
+	else if (err != ENOENT && !db_given)
+		fprintf(stderr, "Using the built-in boards\n");
+
+	if (board_db_build(&db, builtin_boards, sizeof(builtin_boards) / sizeof(builtin_boards[0])) < 0)
+		fprintf(stderr, "Unable to set up the built-in boards\n");
+}
+
+static struct board_db *boards_db(void)
+{
+	pthread_once(&db_once, boards_init);
+
+	return &db;
+}
+
+/*
+ * Take the boards from the database at path instead of the default one.
+ * Must be called before any board is looked up. Returns < 0 if it could not
+ * be loaded, the built-in boards are used then.
+ */
+int boards_use_db(const char *path)
+{
+	db_path = path;
+	db_given = 1;
+	boards_db();
+
+	return db_loaded ? 0 : -1;
+}
+
+/*
+ * The first board we know in the devicetree's compatible list, which runs
+ * from most to least specific.
+ */
+board_t *get_board(void)
+{
+	struct board_db *bdb = boards_db();
+	char comp[4096];
+	board_t *b;
+	size_t len;
+	size_t n;
+	FILE *file;
+
+	file = fopen("/sys/firmware/devicetree/base/compatible", "r");
+	if (!file) {
+		perror("Unable to open /sys/firmware/devicetree/base/compatible");
+		return NULL;
+	}
+
+	len = fread(comp, 1, sizeof(comp) - 1, file);
+	if (ferror(file) || !len) {
+		perror("Failed to read compatible string");
+		fclose(file);
+		return NULL;
+	}
+	fclose(file);
+	comp[len] = '\0';
+
+	/* NUL-separated, and each one is a single lookup however many boards there are */
+	for (n = 0; n < len; n += strlen(&comp[n]) + 1) {
+		b = board_db_find(bdb, &comp[n], strlen(&comp[n]));
+		if (b)
+			return b;
+	}
+	return NULL;
+}
+
+board_t *get_board_by_model(uint16_t modelnum)
+{
+	struct board_db *bdb = boards_db();
+	board_t *b;
+
+	for (unsigned int i = 0; (b = board_db_at(bdb, i)) != NULL; i++) {
+		if (b->modelnum == modelnum)
+			return b;
+	}
+	return NULL;
+}
+
+/* The i-th board we know of, NULL past the last */
+board_t *get_board_at(unsigned int i)
+{
+	return board_db_at(boards_db(), i);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "update-shared.h"
+
+/* Look up a board with a supervisor we know how to update, NULL if there is none */
+board_t *get_board(void);
+board_t *get_board_by_model(uint16_t modelnum);
+board_t *get_board_at(unsigned int i);
+int boards_use_db(const char *path);
@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "update-shared.h"
+#include "update-lz.h"
+#include "crc32.h"
+#include "boards.h"
+#include "targets.h"
+#include "bundle.h"
+
+/* Largest update file either method takes, with room for its footer */
+#define BUNDLE_IMAGE_MAX (128 * 1024 + 64)
+
+int bundle_is_bundle(const uint8_t *map, size_t len)
+{
+	uint32_t magic;
+
+	if (len < sizeof(magic))
+		return 0;
+	memcpy(&magic, map, sizeof(magic));
+
+	return magic == BUNDLE_MAGIC;
+}
+
+static const struct bundle_entry *bundle_entry_at(const uint8_t *map, const struct bundle_header *hdr, uint32_t i)
+{
+	return (const struct bundle_entry *)&map[hdr->header_size + (size_t)i * hdr->entry_size];
+}
+
+/* The entry for model with the highest revision, NULL if there is none */
+static const struct bundle_entry *bundle_search(const uint8_t *map, const struct bundle_header *hdr, uint16_t model)
+{
+	const struct bundle_entry *e;
+	uint32_t lo = 0;
+	uint32_t hi = hdr->nentries;
+	uint32_t mid;
+
+	/* Find the first entry for a later model, the one before it is the newest for model */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (bundle_entry_at(map, hdr, mid)->model <= model)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return NULL;
+
+	e = bundle_entry_at(map, hdr, lo - 1);
+	return (e->model == model) ? e : NULL;
+}
+
+/*
+ * Find the newest image for board in the bundle at map. The board's
+ * compatible_id is only searched for when there is nothing under its own
+ * model, which bundles made before the board was known do. The image's CRC is
+ * left for update_image_set_bin(), which reads it anyway. Returns NULL, having
+ * said why, if there is no image for board.
+ */
+const struct bundle_entry *bundle_find(const uint8_t *map, size_t len, const board_t *board)
+{
+	const struct bundle_header *hdr = (const struct bundle_header *)map;
+	const struct bundle_entry *e;
+
+	if (len < sizeof(*hdr) || hdr->magic != BUNDLE_MAGIC || hdr->version != BUNDLE_VERSION ||
+	    hdr->header_size < sizeof(*hdr) || hdr->entry_size < sizeof(*e) || (hdr->header_size % 4) ||
+	    (hdr->entry_size % 4) || hdr->header_size + (uint64_t)hdr->nentries * hdr->entry_size > len) {
+		fprintf(stderr, "Invalid update bundle\n");
+		return NULL;
+	}
+
+	e = bundle_search(map, hdr, board->modelnum);
+	if (!e && board->compatible_id && board->compatible_id != board->modelnum)
+		e = bundle_search(map, hdr, board->compatible_id);
+	if (!e) {
+		fprintf(stderr, "This bundle has no update for a %04X.\n", board->modelnum);
+		return NULL;
+	}
+
+	if (e->method != board->method) {
+		fprintf(stderr, "This bundle's update for a %04X is for another update method.\n", board->modelnum);
+		return NULL;
+	}
+
+	if ((uint64_t)e->offset + e->length > len) {
+		fprintf(stderr, "Update bundle is truncated\n");
+		return NULL;
+	}
+
+	return e;
+}
+
+/* One update file going into a bundle */
+struct bundle_file {
+	const char *path;
+	uint8_t *data;
+	size_t len;
+	uint32_t offset;
+	uint32_t crc;
+	update_meth_t method;
+	struct update_footer_info info;
+};
+
+/* One index entry, and the file it came from for complaining about duplicates */
+struct bundle_build_entry {
+	struct bundle_entry e;
+	int file;
+};
+
+static int bundle_cmp_entry(const void *a, const void *b)
+{
+	const struct bundle_build_entry *ea = a;
+	const struct bundle_build_entry *eb = b;
+
+	if (ea->e.model != eb->e.model)
+		return (ea->e.model > eb->e.model) - (ea->e.model < eb->e.model);
+	return (ea->e.revision > eb->e.revision) - (ea->e.revision < eb->e.revision);
+}
+
+/* Read the update file at f->path and work out what it is. Returns < 0 on failure. */
+static int bundle_read_file(struct bundle_file *f)
+{
+	static const update_meth_t methods[] = { UPDATE_V1, UPDATE_V0 };
+	struct stat st;
+	unsigned int i;
+	ssize_t ret;
+	size_t done = 0;
+	int fd;
+
+	fd = open(f->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", f->path, strerror(errno));
+		goto err_out;
+	}
+	if (st.st_size <= 0 || st.st_size > BUNDLE_IMAGE_MAX) {
+		fprintf(stderr, "%s is not an update file\n", f->path);
+		goto err_out;
+	}
+
+	f->len = st.st_size;
+	f->data = malloc(f->len);
+	if (!f->data) {
+		perror("Unable to allocate update file");
+		goto err_out;
+	}
+	while (done < f->len) {
+		ret = read(fd, f->data + done, f->len - done);
+		if (ret <= 0) {
+			fprintf(stderr, "Unable to read %s: %s\n", f->path, ret ? strerror(errno) : "truncated");
+			goto err_out;
+		}
+		done += ret;
+	}
+	close(fd);
+
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		if (update_ops_get(methods[i])->probe_footer(f->data, f->len, lz_full_size(f->data, f->len, f->len),
+							     &f->info) == 0) {
+			f->method = methods[i];
+			f->crc = crc32_update(0, f->data, f->len);
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "%s is not an update file\n", f->path);
+	return -1;
+
+err_out:
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+/*
+ * Index f under every model it is an update for, from the footer for V1 and
+ * the board table for both. Returns the number of entries added.
+ */
+static int bundle_index_file(struct bundle_file *f, int file, struct bundle_build_entry *out)
+{
+	uint16_t models[64];
+	unsigned int nmodels = 0;
+	unsigned int i, j;
+	board_t *b;
+
+	if (f->method == UPDATE_V1)
+		models[nmodels++] = f->info.model;
+
+	for (i = 0; (b = get_board_at(i)) != NULL; i++) {
+		if (b->method != f->method)
+			continue;
+		if (f->method == UPDATE_V1 && b->modelnum != f->info.model && b->compatible_id != f->info.model)
+			continue;
+
+		/* The board table lists some models more than once */
+		for (j = 0; j < nmodels && models[j] != b->modelnum; j++)
+			;
+		if (j == nmodels && nmodels < sizeof(models) / sizeof(models[0]))
+			models[nmodels++] = b->modelnum;
+	}
+
+	for (i = 0; i < nmodels; i++) {
+		memset(&out[i], 0, sizeof(out[i]));
+		out[i].e.model = models[i];
+		out[i].e.compatible_id = f->info.model;
+		out[i].e.revision = f->info.revision;
+		out[i].e.footer_version = f->info.footer_version;
+		out[i].e.method = f->method;
+		out[i].e.length = f->len;
+		out[i].e.crc = f->crc;
+		out[i].file = file;
+	}
+
+	return nmodels;
+}
+
+static int bundle_write(int fd, const void *data, size_t len, off_t offset)
+{
+	return (pwrite(fd, data, len, offset) == (ssize_t)len) ? 0 : -1;
+}
+
+/*
+ * Write a bundle of the update files in files to path, replacing it. Each
+ * model may only have one file per revision. Returns < 0 on failure.
+ */
+int bundle_create(const char *path, char *const *files, int nfiles)
+{
+	struct bundle_header hdr = { 0 };
+	struct bundle_build_entry *entries = NULL;
+	struct bundle_file *f = NULL;
+	char tmp[PATH_MAX + 8];
+	unsigned int nentries = 0;
+	unsigned int nboards;
+	unsigned int i;
+	uint64_t offset;
+	int fd = -1;
+	int ret = -1;
+
+	if (nfiles <= 0) {
+		fprintf(stderr, "No update files to bundle\n");
+		return -1;
+	}
+
+	for (nboards = 0; get_board_at(nboards); nboards++)
+		;
+
+	f = calloc(nfiles, sizeof(*f));
+	/* An image is indexed under its own model and, at most, every board's */
+	entries = calloc((size_t)nfiles * (nboards + 1), sizeof(*entries));
+	if (!f || !entries) {
+		perror("Unable to allocate bundle");
+		goto out;
+	}
+
+	for (i = 0; i < (unsigned int)nfiles; i++) {
+		f[i].path = files[i];
+		if (bundle_read_file(&f[i]) < 0)
+			goto out;
+	}
+
+	hdr.magic = BUNDLE_MAGIC;
+	hdr.version = BUNDLE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.entry_size = sizeof(struct bundle_entry);
+
+	/* The images go after the index, so it has to be sized before they can be placed */
+	for (i = 0; i < (unsigned int)nfiles; i++)
+		nentries += bundle_index_file(&f[i], i, &entries[nentries]);
+	offset = hdr.header_size + (uint64_t)nentries * hdr.entry_size;
+	for (i = 0; i < (unsigned int)nfiles; i++) {
+		offset = (offset + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+		if (offset + f[i].len > UINT32_MAX) {
+			fprintf(stderr, "Too many update files for one bundle\n");
+			goto out;
+		}
+		f[i].offset = offset;
+		offset += f[i].len;
+	}
+	for (i = 0; i < nentries; i++)
+		entries[i].e.offset = f[entries[i].file].offset;
+	hdr.nentries = nentries;
+
+	qsort(entries, nentries, sizeof(*entries), bundle_cmp_entry);
+	for (i = 1; i < nentries; i++) {
+		if (!bundle_cmp_entry(&entries[i - 1], &entries[i])) {
+			fprintf(stderr, "%s and %s are both revision %d for a %04X\n", f[entries[i - 1].file].path,
+				f[entries[i].file].path, entries[i].e.revision, entries[i].e.model);
+			goto out;
+		}
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to create %s: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+
+	if (bundle_write(fd, &hdr, sizeof(hdr), 0) < 0)
+		goto err_write;
+	for (i = 0; i < nentries; i++) {
+		if (bundle_write(fd, &entries[i].e, sizeof(entries[i].e), hdr.header_size + i * hdr.entry_size) < 0)
+			goto err_write;
+	}
+	for (i = 0; i < (unsigned int)nfiles; i++) {
+		if (bundle_write(fd, f[i].data, f[i].len, f[i].offset) < 0)
+			goto err_write;
+	}
+	if (close(fd) < 0) {
+		fd = -1;
+		goto err_write;
+	}
+	fd = -1;
+
+	if (rename(tmp, path) < 0) {
+		fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+
+	for (i = 0; i < nentries; i++)
+		printf("%04X revision %d from %s\n", entries[i].e.model, entries[i].e.revision,
+		       f[entries[i].file].path);
+	ret = 0;
+	goto out;
+
+err_write:
+	fprintf(stderr, "Unable to write %s: %s\n", tmp, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+out:
+	if (f) {
+		for (i = 0; i < (unsigned int)nfiles; i++)
+			free(f[i].data);
+	}
+	free(f);
+	free(entries);
+	return ret;
+}
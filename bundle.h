@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "update-shared.h"
+
+/*
+ * Update bundle
+ *
+ * Update files for several boards in one file: a fixed header, an index
+ * sorted by model and then revision, and the update files themselves,
+ * unchanged, each at the offset its index entry gives. An image that more
+ * than one model takes, by compatible_id, is stored once and indexed once per
+ * model. The header and index are in native byte order, used straight from
+ * the mapping, so a bundle is only read right on machines of the endianness
+ * that built it; every board this runs on is little-endian.
+ *
+ * The updater maps the bundle like any other update file and binary searches
+ * the index for its board, so finding an image costs the same however many
+ * are in the bundle, and the image is streamed to the micro straight from the
+ * mapping. Only the chosen entry and image are checked, the image's CRC-32 in
+ * the same pass as its block CRCs.
+ */
+#define BUNDLE_MAGIC 0x42555354 /* "TSUB" */
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 64 /* Of each image in the bundle */
+
+struct bundle_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size; /* Where the index starts */
+	uint32_t nentries;
+	uint32_t entry_size; /* Entries only ever grow */
+	uint64_t reserved[2];
+};
+
+struct bundle_entry {
+	uint16_t model; /* Of the board, the index is sorted on this */
+	uint16_t compatible_id; /* Model in the image's footer, 0 if it does not carry one */
+	uint16_t revision;
+	uint8_t footer_version;
+	uint8_t method; /* update_meth_t */
+	uint32_t offset; /* Of the update file, from the start of the bundle */
+	uint32_t length; /* Of the update file, footer included */
+	uint32_t crc; /* CRC-32 of those bytes */
+};
+
+int bundle_is_bundle(const uint8_t *map, size_t len);
+const struct bundle_entry *bundle_find(const uint8_t *map, size_t len, const board_t *board);
+int bundle_create(const char *path, char *const *files, int nfiles);
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "update-shared.h"
+#include "update-lz.h"
+#include "targets.h"
+#include "catalog.h"
+
+/* Footers are tiny, the threads are there to keep the storage busy */
+#define CATALOG_THREADS 8
+
+/* Where the index for dir lives in index_dir, named for dir's real path */
+static void catalog_index_path(const char *dir, const char *index_dir, char *path, size_t len, uint64_t *hash)
+{
+	char real[PATH_MAX];
+	const char *p;
+
+	if (!realpath(dir, real))
+		snprintf(real, sizeof(real), "%s", dir);
+
+	/* 64-bit FNV-1a */
+	*hash = 0xcbf29ce484222325ULL;
+	for (p = real; *p; p++) {
+		*hash ^= (uint8_t)*p;
+		*hash *= 0x100000001b3ULL;
+	}
+
+	snprintf(path, len, "%s/catalog-%016llx.idx", index_dir, (unsigned long long)*hash);
+}
+
+static int catalog_cmp_ino(const void *a, const void *b)
+{
+	const struct catalog_entry *ea = a;
+	const struct catalog_entry *eb = b;
+
+	return (ea->ino > eb->ino) - (ea->ino < eb->ino);
+}
+
+/*
+ * Read the index at path, sorted by inode, into *entries. Returns how many
+ * entries it has, 0 if there is no usable index.
+ */
+static unsigned int catalog_index_load(const char *path, uint64_t hash, struct catalog_entry **entries)
+{
+	struct catalog_header hdr;
+	size_t len;
+	int fd;
+
+	*entries = NULL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != CATALOG_MAGIC ||
+	    hdr.version != CATALOG_VERSION || hdr.dir_hash != hash || !hdr.nentries)
+		goto err_out;
+
+	len = (size_t)hdr.nentries * sizeof(**entries);
+	*entries = malloc(len);
+	if (!*entries || read(fd, *entries, len) != (ssize_t)len)
+		goto err_out;
+
+	close(fd);
+	return hdr.nentries;
+
+err_out:
+	free(*entries);
+	*entries = NULL;
+	close(fd);
+	return 0;
+}
+
+/* Replace the index at path with the catalog's entries. Returns < 0 on failure. */
+static int catalog_index_save(struct catalog *cat, const char *index_dir, const char *path, uint64_t hash)
+{
+	struct catalog_header hdr = { 0 };
+	char tmp[PATH_MAX + 8];
+	size_t len;
+	int fd;
+
+	mkdir(index_dir, 0755);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+
+	hdr.magic = CATALOG_MAGIC;
+	hdr.version = CATALOG_VERSION;
+	hdr.dir_hash = hash;
+	hdr.nentries = cat->nentries;
+	len = (size_t)cat->nentries * sizeof(*cat->entries);
+
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    (len && write(fd, cat->entries, len) != (ssize_t)len)) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	return rename(tmp, path);
+}
+
+/*
+ * Fill in e from the end of its file, and the start if it is compressed,
+ * which are only read, never mapped
+ */
+static void catalog_read_footer(int dirfd, struct catalog_entry *e)
+{
+	static const update_meth_t methods[] = { UPDATE_V1, UPDATE_V0 };
+	struct update_footer_info info;
+	uint8_t tail[UPDATE_FOOTER_MAX];
+	uint8_t head[sizeof(struct lz_header)];
+	size_t len = (e->size < sizeof(tail)) ? e->size : sizeof(tail);
+	size_t full_size = e->size;
+	unsigned int i;
+	int fd;
+
+	e->valid = 0;
+
+	fd = openat(dirfd, e->name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (pread(fd, tail, len, e->size - len) != (ssize_t)len) {
+		close(fd);
+		return;
+	}
+	if (e->size >= sizeof(head) && pread(fd, head, sizeof(head), 0) == sizeof(head))
+		full_size = lz_full_size(head, sizeof(head), e->size);
+	close(fd);
+
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		if (update_ops_get(methods[i])->probe_footer(tail, len, full_size, &info) == 0) {
+			e->valid = 1;
+			e->method = methods[i];
+			e->model = info.model;
+			e->revision = info.revision;
+			e->bin_size = info.bin_size;
+			return;
+		}
+	}
+}
+
+struct catalog_work {
+	struct catalog *cat;
+	int dirfd;
+	unsigned int *pending; /* Indexes of entries whose footers need reading */
+	unsigned int npending;
+	unsigned int next;
+};
+
+static void *catalog_worker_fn(void *arg)
+{
+	struct catalog_work *w = arg;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->npending)
+		catalog_read_footer(w->dirfd, &w->cat->entries[w->pending[i]]);
+
+	return NULL;
+}
+
+static void catalog_read_footers(struct catalog_work *w)
+{
+	pthread_t threads[CATALOG_THREADS];
+	unsigned int started = 0;
+	unsigned int i;
+
+	for (i = 0; i < CATALOG_THREADS && i < w->npending; i++) {
+		if (pthread_create(&threads[started], NULL, catalog_worker_fn, w) == 0)
+			started++;
+	}
+
+	/* Whatever no thread was had for gets done here */
+	catalog_worker_fn(w);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * Catalog the update files in dir, keeping the index in index_dir, or
+ * nowhere if it is NULL. Returns < 0 on failure.
+ */
+int catalog_scan(struct catalog *cat, const char *dir, const char *index_dir)
+{
+	struct catalog_entry *cached = NULL;
+	struct catalog_entry *e, *hit;
+	struct catalog_work work = { 0 };
+	char index_path[PATH_MAX];
+	unsigned int ncached = 0;
+	unsigned int alloced = 0;
+	unsigned int *pending;
+	struct dirent *de;
+	struct stat st;
+	uint64_t hash = 0;
+	DIR *d;
+
+	memset(cat, 0, sizeof(*cat));
+
+	d = opendir(dir);
+	if (!d) {
+		perror("Unable to open catalog directory");
+		return -1;
+	}
+
+	cat->dir = strdup(dir);
+	if (!cat->dir)
+		goto err_out;
+
+	if (index_dir) {
+		catalog_index_path(dir, index_dir, index_path, sizeof(index_path), &hash);
+		ncached = catalog_index_load(index_path, hash, &cached);
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (strlen(de->d_name) >= CATALOG_NAME_MAX || fnmatch("*.bin", de->d_name, 0) != 0)
+			continue;
+		if (fstatat(dirfd(d), de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (cat->nentries == alloced) {
+			alloced = alloced ? alloced * 2 : 64;
+			e = realloc(cat->entries, alloced * sizeof(*e));
+			if (!e)
+				goto err_out;
+			cat->entries = e;
+			pending = realloc(work.pending, alloced * sizeof(*pending));
+			if (!pending)
+				goto err_out;
+			work.pending = pending;
+		}
+
+		e = &cat->entries[cat->nentries++];
+		memset(e, 0, sizeof(*e));
+		strcpy(e->name, de->d_name);
+		e->ino = st.st_ino;
+		e->size = st.st_size;
+		e->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+		/* Unchanged since it was indexed, nothing to read */
+		hit = ncached ? bsearch(e, cached, ncached, sizeof(*e), catalog_cmp_ino) : NULL;
+		if (hit && hit->size == e->size && hit->mtime_ns == e->mtime_ns && !strcmp(hit->name, e->name)) {
+			*e = *hit;
+			continue;
+		}
+		work.pending[work.npending++] = cat->nentries - 1;
+	}
+
+	cat->paths = calloc(cat->nentries ? cat->nentries : 1, sizeof(*cat->paths));
+	if (!cat->paths)
+		goto err_out;
+
+	work.cat = cat;
+	work.dirfd = dirfd(d);
+	catalog_read_footers(&work);
+	cat->read = work.npending;
+
+	if (index_dir && (cat->read || cat->nentries != ncached)) {
+		qsort(cat->entries, cat->nentries, sizeof(*cat->entries), catalog_cmp_ino);
+		if (catalog_index_save(cat, index_dir, index_path, hash) < 0)
+			fprintf(stderr, "Unable to write catalog index %s: %s\n", index_path, strerror(errno));
+	}
+
+	free(work.pending);
+	free(cached);
+	closedir(d);
+	return 0;
+
+err_out:
+	perror("Unable to catalog update files");
+	free(work.pending);
+	free(cached);
+	closedir(d);
+	catalog_close(cat);
+	return -1;
+}
+
+/*
+ * Find the newest update for board, by revision and then by modification
+ * time. Returns its path, or NULL if there is none. *entry, if not NULL, is
+ * set to what the catalog knows about it.
+ */
+const char *catalog_pick(struct catalog *cat, const board_t *board, const struct catalog_entry **entry)
+{
+	const struct catalog_entry *e, *best = NULL;
+	unsigned int i, best_idx = 0;
+	size_t len;
+
+	for (i = 0; i < cat->nentries; i++) {
+		e = &cat->entries[i];
+
+		if (!e->valid || e->method != board->method)
+			continue;
+		/* V0 footers carry no model, there is only the one V0 board */
+		if (e->method == UPDATE_V1 && e->model != board->modelnum &&
+		    !(board->compatible_id && e->model == board->compatible_id))
+			continue;
+
+		if (!best || e->revision > best->revision ||
+		    (e->revision == best->revision && e->mtime_ns > best->mtime_ns)) {
+			best = e;
+			best_idx = i;
+		}
+	}
+
+	if (!best)
+		return NULL;
+
+	if (!cat->paths[best_idx]) {
+		len = strlen(cat->dir) + 1 + strlen(best->name) + 1;
+		cat->paths[best_idx] = malloc(len);
+		if (!cat->paths[best_idx])
+			return NULL;
+		snprintf(cat->paths[best_idx], len, "%s/%s", cat->dir, best->name);
+	}
+
+	if (entry)
+		*entry = best;
+
+	return cat->paths[best_idx];
+}
+
+void catalog_close(struct catalog *cat)
+{
+	unsigned int i;
+
+	if (cat->paths) {
+		for (i = 0; i < cat->nentries; i++)
+			free(cat->paths[i]);
+	}
+	free(cat->paths);
+	free(cat->entries);
+	free(cat->dir);
+	memset(cat, 0, sizeof(*cat));
+}
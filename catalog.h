@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "update-shared.h"
+
+/*
+ * Update file catalog
+ *
+ * Finds the newest update for a board in a directory of update files. Only
+ * the footer at the end of each *.bin is read, by several threads at once,
+ * and what it says is kept in an index file keyed on each file's inode,
+ * size, and modification time. Later scans of the same directory stat every
+ * file but only read the footers of files that are new or changed.
+ *
+ * The index is rewritten whole, and renamed into place, whenever the
+ * directory changed.
+ */
+#define CATALOG_MAGIC 0x49435354 /* "TSCI" */
+#define CATALOG_VERSION 1
+#define CATALOG_NAME_MAX 256
+
+/* As kept in the index file */
+struct catalog_entry {
+	char name[CATALOG_NAME_MAX];
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	uint32_t bin_size;
+	uint16_t model; /* From a V1 footer, 0 for V0 */
+	uint16_t revision;
+	uint8_t valid; /* Ends in a footer of either method */
+	uint8_t method; /* update_meth_t, if valid */
+	uint8_t pad[6];
+};
+
+struct catalog_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t dir_hash; /* Of the directory's path, see catalog_index_path() */
+	uint32_t nentries;
+	uint32_t pad;
+};
+
+struct catalog {
+	char *dir;
+	struct catalog_entry *entries;
+	unsigned int nentries;
+	char **paths; /* Full path of each entry, once asked for */
+	unsigned int read; /* Footers read by the last scan, the rest came from the index */
+};
+
+int catalog_scan(struct catalog *cat, const char *dir, const char *index_dir);
+const char *catalog_pick(struct catalog *cat, const board_t *board, const struct catalog_entry **entry);
+void catalog_close(struct catalog *cat);
@@ -0,0 +1,195 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "crc8.h"
+#include "crc32.h"
+#include "micro.h"
+
+/*
+ * CRC kernel benchmark
+ *
+ * Checks every CRC-8 kernel this CPU can run against the original table
+ * kernel, then reports the throughput of each over the 128-byte blocks an
+ * update is sent in and over whole images, as catalog and bundle builds
+ * checksum them.
+ */
+
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *data, size_t len)
+{
+	unsigned int i;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+	}
+
+	return ~crc;
+}
+
+/* Every kernel must agree with the table on every length and starting CRC */
+static int check_kernels(const uint8_t *data, size_t len)
+{
+	crc8_fn table = crc8_kernel_get(CRC8_TABLE);
+	crc8_fn fn;
+	enum crc8_kernel k;
+	size_t n, split;
+	uint8_t want;
+	int failed = 0;
+	int i;
+
+	for (k = 0; k < CRC8_KERNEL_MAX; k++) {
+		fn = crc8_kernel_get(k);
+		if (!fn)
+			continue;
+		/* Unaligned starts too, and every length up to well past a fold */
+		for (n = 0; n <= 1024 && n + 8 <= len; n++) {
+			for (i = 0; i < 256; i += 85) {
+				want = table(i, data + (n & 7), n);
+				if (fn(i, data + (n & 7), n) != want) {
+					fprintf(stderr, "%s: wrong CRC for %zu bytes from 0x%02X\n", crc8_kernel_name(k), n,
+						i);
+					failed = 1;
+					break;
+				}
+			}
+		}
+		if (fn(0, data, len) != table(0, data, len)) {
+			fprintf(stderr, "%s: wrong CRC for %zu bytes\n", crc8_kernel_name(k), len);
+			failed = 1;
+		}
+	}
+
+	for (split = 0; split <= 1024 && split <= len; split += 37) {
+		if (crc8_combine(crc8(data, split), crc8(data + split, len - split), len - split) != crc8(data, len)) {
+			fprintf(stderr, "crc8_combine: wrong CRC split at %zu\n", split);
+			failed = 1;
+		}
+	}
+
+	if (crc32_update(crc32_update(0, data, len / 3), data + len / 3, len - len / 3) !=
+	    crc32_bytewise(0, data, len)) {
+		fprintf(stderr, "crc32: wrong CRC for %zu bytes\n", len);
+		failed = 1;
+	}
+
+	return failed ? -1 : 0;
+}
+
+/* MB/s running fn over len bytes in pieces of chunk, repeated until total bytes are done */
+static double time_crc8(crc8_fn fn, const uint8_t *data, size_t len, size_t chunk, size_t total)
+{
+	volatile uint8_t sink = 0;
+	uint64_t start;
+	size_t done, off;
+
+	start = micro_now_ns();
+	for (done = 0; done < total; done += len) {
+		for (off = 0; off < len; off += chunk)
+			sink ^= fn(0, data + off, chunk < len - off ? chunk : len - off);
+	}
+	(void)sink;
+
+	return total / ((micro_now_ns() - start) / 1e3);
+}
+
+static double time_crc32(uint32_t (*fn)(uint32_t, const uint8_t *, size_t), const uint8_t *data, size_t len,
+			 size_t total)
+{
+	volatile uint32_t sink = 0;
+	uint64_t start;
+	size_t done;
+
+	start = micro_now_ns();
+	for (done = 0; done < total; done += len)
+		sink ^= fn(0, data, len);
+	(void)sink;
+
+	return total / ((micro_now_ns() - start) / 1e3);
+}
+
+static void usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTION] ...\n"
+		"Check and benchmark the CRC kernels\n"
+		"\n"
+		"  -n, --blocks <n>       Size of an image in 128-byte blocks (default 1024)\n"
+		"  -m, --megabytes <n>    Data to run each kernel over (default 256)\n"
+		"  -h, --help             This message\n"
+		"\n",
+		argv[0]);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = { { "blocks", required_argument, NULL, 'n' },
+						{ "megabytes", required_argument, NULL, 'm' },
+						{ "help", no_argument, NULL, 'h' },
+						{ 0, 0, 0, 0 } };
+	unsigned int blocks = 1024;
+	size_t total = 256;
+	enum crc8_kernel k;
+	crc8_fn fn;
+	uint8_t *data;
+	size_t len;
+	size_t i;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "n:m:h", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'n':
+			blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			total = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(argv);
+			return 0;
+		default:
+			usage(argv);
+			return 1;
+		}
+	}
+
+	if (!blocks || blocks > 65536 || !total) {
+		fprintf(stderr, "Invalid block count or amount of data\n");
+		return 1;
+	}
+
+	len = blocks * 128;
+	total *= 1024 * 1024;
+	data = malloc(len);
+	if (!data) {
+		perror("Unable to allocate image");
+		return 1;
+	}
+	srand(blocks);
+	for (i = 0; i < len; i++)
+		data[i] = rand();
+
+	if (check_kernels(data, len) < 0) {
+		free(data);
+		return 1;
+	}
+
+	for (k = 0; k < CRC8_KERNEL_MAX; k++) {
+		fn = crc8_kernel_get(k);
+		if (!fn)
+			continue;
+		printf("crc8 %-6s%s: 128-byte blocks %8.1f MB/s, %zu-byte images %8.1f MB/s\n", crc8_kernel_name(k),
+		       k == crc8_kernel_best() ? "*" : " ", time_crc8(fn, data, len, 128, total), len,
+		       time_crc8(fn, data, len, len, total));
+	}
+	printf("crc32 bytewise: %zu-byte images %8.1f MB/s\n", len, time_crc32(crc32_bytewise, data, len, total / 8));
+	printf("crc32 slice8  : %zu-byte images %8.1f MB/s\n", len, time_crc32(crc32_update, data, len, total));
+
+	free(data);
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32.h"
+
+/* crc32_tables[k][x] is the CRC of byte x followed by k zero bytes */
+static uint32_t crc32_tables[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+	uint32_t c;
+	unsigned int i, j, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+		crc32_tables[0][i] = c;
+	}
+
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			c = crc32_tables[k - 1][i];
+			crc32_tables[k][i] = (c >> 8) ^ crc32_tables[0][c & 0xff];
+		}
+	}
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+	uint32_t lo, hi;
+	uint32_t c = ~crc;
+
+	pthread_once(&crc32_once, crc32_init);
+
+	while (len >= 8) {
+		memcpy(&lo, data, 4);
+		memcpy(&hi, data + 4, 4);
+		lo ^= c;
+		c = crc32_tables[7][lo & 0xff] ^ crc32_tables[6][(lo >> 8) & 0xff] ^
+		    crc32_tables[5][(lo >> 16) & 0xff] ^ crc32_tables[4][lo >> 24] ^
+		    crc32_tables[3][hi & 0xff] ^ crc32_tables[2][(hi >> 8) & 0xff] ^
+		    crc32_tables[1][(hi >> 16) & 0xff] ^ crc32_tables[0][hi >> 24];
+		data += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		c = crc32_tables[0][(c ^ *data++) & 0xff] ^ (c >> 8);
+
+	return ~c;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC-32 as in zlib, sliced by 8. Start with 0 and pass the result back in
+ * to continue over more data.
+ */
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len);
@@ -1,5 +1,13 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "crc8.h"
+#include "crc32.h"
 
 static unsigned char const crc8x_table[] = {
 	0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D, 0x70, 0x77,
@@ -19,15 +27,223 @@ static unsigned char const crc8x_table[] = {
 	0xFA, 0xFD, 0xF4, 0xF3
 };
 
-uint8_t crc8(uint8_t *input_str, size_t num_bytes)
+/* crc8_slices[k][x] is the CRC of byte x followed by k zero bytes, crc8x_table for k = 0 */
+static uint8_t crc8_slices[8][256];
+/* The CRC of byte x followed by 127 zero bytes, to combine block CRCs */
+static uint8_t crc8_shift128[256];
+static crc8_fn crc8_best;
+static enum crc8_kernel crc8_best_kernel;
+static pthread_once_t crc8_once = PTHREAD_ONCE_INIT;
+
+static uint8_t crc8_table(uint8_t crc, const uint8_t *data, size_t len)
 {
 	size_t a;
-	uint8_t crc = 0;
-	uint8_t *ptr = input_str;
 
-	if (ptr != NULL)
-		for (a = 0; a < num_bytes; a++)
-			crc = crc8x_table[(*ptr++) ^ crc];
+	for (a = 0; a < len; a++)
+		crc = crc8x_table[data[a] ^ crc];
 
 	return crc;
 }
+
+static uint8_t crc8_slice8(uint8_t crc, const uint8_t *data, size_t len)
+{
+	while (len >= 8) {
+		crc = crc8_slices[7][data[0] ^ crc] ^ crc8_slices[6][data[1]] ^ crc8_slices[5][data[2]] ^
+		      crc8_slices[4][data[3]] ^ crc8_slices[3][data[4]] ^ crc8_slices[2][data[5]] ^
+		      crc8_slices[1][data[6]] ^ crc8_slices[0][data[7]];
+		data += 8;
+		len -= 8;
+	}
+
+	return crc8_table(crc, data, len);
+}
+
+#if defined(__x86_64__)
+/*
+ * Folding: the message so far is kept as a 128-bit polynomial with the same
+ * remainder, and moved past the next 128 bits by multiplying its halves by
+ * x^192 and x^128 mod P, which for an 8-bit CRC are only 8 bits long. Four
+ * of them run 512 bits apart to keep the multiplier busy, and are folded
+ * into one at the end. What is left has the same CRC as the message.
+ */
+static uint64_t crc8_k128, crc8_k192, crc8_k512, crc8_k576;
+
+__attribute__((target("pclmul,ssse3"))) static __m128i crc8_fold(__m128i r, __m128i k, __m128i next)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(r, k, 0x11), _mm_clmulepi64_si128(r, k, 0x00)), next);
+}
+
+__attribute__((target("pclmul,ssse3"))) static uint8_t crc8_clmul(uint8_t crc, const uint8_t *data, size_t len)
+{
+	/* The first byte of the message is the highest order */
+	const __m128i bswap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	const __m128i k128 = _mm_set_epi64x(crc8_k192, crc8_k128);
+	const __m128i k512 = _mm_set_epi64x(crc8_k576, crc8_k512);
+	__m128i r0, r1, r2, r3;
+	uint8_t rest[16];
+
+	if (len < 128)
+		return crc8_slice8(crc, data, len);
+
+	r0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap);
+	r1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap);
+	r2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap);
+	r3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap);
+	/* A CRC to continue from acts as if xored into the first byte */
+	r0 = _mm_xor_si128(r0, _mm_set_epi64x((uint64_t)crc << 56, 0));
+	data += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		r0 = crc8_fold(r0, k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap));
+		r1 = crc8_fold(r1, k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap));
+		r2 = crc8_fold(r2, k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap));
+		r3 = crc8_fold(r3, k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap));
+		data += 64;
+		len -= 64;
+	}
+
+	r0 = crc8_fold(r0, k128, r1);
+	r0 = crc8_fold(r0, k128, r2);
+	r0 = crc8_fold(r0, k128, r3);
+	while (len >= 16) {
+		r0 = crc8_fold(r0, k128, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap));
+		data += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)rest, _mm_shuffle_epi8(r0, bswap));
+	crc = crc8_slice8(0, rest, sizeof(rest));
+
+	return crc8_slice8(crc, data, len);
+}
+
+/* x^n mod P */
+static uint64_t crc8_xpow(unsigned int n)
+{
+	unsigned int r = 1;
+
+	while (n--) {
+		r <<= 1;
+		if (r & 0x100)
+			r ^= 0x107;
+	}
+
+	return r;
+}
+#endif
+
+static void crc8_init(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < 256; i++)
+		crc8_slices[0][i] = crc8x_table[i];
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++)
+			crc8_slices[k][i] = crc8x_table[crc8_slices[k - 1][i]];
+	}
+
+	for (i = 0; i < 256; i++) {
+		crc8_shift128[i] = i;
+		for (k = 0; k < 128; k++)
+			crc8_shift128[i] = crc8x_table[crc8_shift128[i]];
+	}
+
+	crc8_best = crc8_slice8;
+	crc8_best_kernel = CRC8_SLICE8;
+
+#if defined(__x86_64__)
+	crc8_k128 = crc8_xpow(128);
+	crc8_k192 = crc8_xpow(192);
+	crc8_k512 = crc8_xpow(512);
+	crc8_k576 = crc8_xpow(576);
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) {
+		crc8_best = crc8_clmul;
+		crc8_best_kernel = CRC8_CLMUL;
+	}
+#endif
+}
+
+/* A kernel by name, for comparing them, or NULL if the CPU does not have it */
+crc8_fn crc8_kernel_get(enum crc8_kernel kernel)
+{
+	pthread_once(&crc8_once, crc8_init);
+
+	switch (kernel) {
+	case CRC8_TABLE:
+		return crc8_table;
+	case CRC8_SLICE8:
+		return crc8_slice8;
+	case CRC8_CLMUL:
+		return (crc8_best_kernel == CRC8_CLMUL) ? crc8_best : NULL;
+	default:
+		return NULL;
+	}
+}
+
+enum crc8_kernel crc8_kernel_best(void)
+{
+	pthread_once(&crc8_once, crc8_init);
+
+	return crc8_best_kernel;
+}
+
+const char *crc8_kernel_name(enum crc8_kernel kernel)
+{
+	static const char *const names[CRC8_KERNEL_MAX] = {
+		[CRC8_TABLE] = "table",
+		[CRC8_SLICE8] = "slice8",
+		[CRC8_CLMUL] = "clmul",
+	};
+
+	return (kernel < CRC8_KERNEL_MAX) ? names[kernel] : "unknown";
+}
+
+uint8_t crc8_update(uint8_t crc, const uint8_t *data, size_t len)
+{
+	pthread_once(&crc8_once, crc8_init);
+
+	return crc8_best(crc, data, len);
+}
+
+uint8_t crc8(const uint8_t *data, size_t len)
+{
+	if (data == NULL)
+		return 0;
+
+	return crc8_update(0, data, len);
+}
+
+/* The CRC of a followed by b, from their CRCs, b being len_b bytes long */
+uint8_t crc8_combine(uint8_t crc_a, uint8_t crc_b, size_t len_b)
+{
+	pthread_once(&crc8_once, crc8_init);
+
+	/* Run crc_a past len_b zero bytes */
+	for (; len_b >= 128; len_b -= 128)
+		crc_a = crc8_shift128[crc_a];
+	for (; len_b; len_b--)
+		crc_a = crc8x_table[crc_a];
+
+	return crc_a ^ crc_b;
+}
+
+/*
+ * Take the CRC of each block_sz block of data, the last maybe short, and if
+ * crc32 is not NULL continue it over all of data, in one pass while each
+ * block is in cache.
+ */
+void crc8_blocks(const uint8_t *data, size_t len, unsigned int block_sz, uint8_t *block_crc, uint32_t *crc32)
+{
+	size_t n;
+
+	pthread_once(&crc8_once, crc8_init);
+
+	for (; len; data += n, len -= n) {
+		n = (len < block_sz) ? len : block_sz;
+		*block_crc++ = crc8_best(0, data, n);
+		if (crc32)
+			*crc32 = crc32_update(*crc32, data, n);
+	}
+}
@@ -1,3 +1,31 @@
 #pragma once
 
-uint8_t crc8(uint8_t *input_str, size_t num_bytes);
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC-8, polynomial 0x07, as the supervisor checks it
+ *
+ * crc8() runs the fastest kernel the CPU has, chosen on first use: folding
+ * with carry-less multiplies on x86 with PCLMULQDQ, otherwise slicing by 8.
+ * The table kernel is the original byte at a time loop the others are
+ * checked against, see crc-bench.
+ */
+enum crc8_kernel {
+	CRC8_TABLE,
+	CRC8_SLICE8,
+	CRC8_CLMUL,
+	CRC8_KERNEL_MAX,
+};
+
+/* Continue crc over len bytes of data */
+typedef uint8_t (*crc8_fn)(uint8_t crc, const uint8_t *data, size_t len);
+
+uint8_t crc8(const uint8_t *data, size_t len);
+uint8_t crc8_update(uint8_t crc, const uint8_t *data, size_t len);
+uint8_t crc8_combine(uint8_t crc_a, uint8_t crc_b, size_t len_b);
+void crc8_blocks(const uint8_t *data, size_t len, unsigned int block_sz, uint8_t *block_crc, uint32_t *crc32);
+
+crc8_fn crc8_kernel_get(enum crc8_kernel kernel);
+enum crc8_kernel crc8_kernel_best(void);
+const char *crc8_kernel_name(enum crc8_kernel kernel);
@@ -0,0 +1,676 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "micro.h"
+#include "crc8.h"
+#include "update-shared.h"
+#include "update-v1.h"
+#include "micro-sim.h"
+
+/* Largest update the supervisor can hold */
+#define SIM_FLASH_SZ (128 * 1024)
+/* The V0 micro exposes a 32-byte register file, revision in the last two */
+#define SIM_V0_REGS_SZ 32
+/* How long a V0 micro is gone for after being told to reset */
+#define SIM_RESET_US 100000
+/* ADC channels the V1 micro advertises */
+#define SIM_ADC_CHAN_ADV 0x00FF
+/* Size of the large block window, in bytes */
+#define SIM_XBLOCK_SZ 4096
+/* How long checking what an interrupted update left behind takes */
+#define SIM_RESUME_US 20000
+
+struct sim {
+	struct sim_cfg cfg;
+
+	/* Register pointer, V1 only. Set by the address bytes of a write */
+	uint16_t ptr;
+	uint16_t low_regs[256];
+	uint16_t magic[2];
+	uint16_t size[2];
+	uint16_t block[SIM_XBLOCK_SZ / 2];
+	uint16_t block_crc;
+	uint16_t xblock_len;
+
+	/* The second block buffer, SUPER_FEAT_DBLBUF only */
+	int pending;
+	uint16_t pending_block[SIM_XBLOCK_SZ / 2];
+	unsigned int pending_len;
+	uint8_t pending_crc;
+	uint16_t flash_flags;
+
+	/* Flash state machine, shared by both methods */
+	uint8_t status;
+	uint8_t next_status;
+	uint64_t wait_until; /* status reads STATUS_WAIT until this time */
+	uint64_t nak_from;
+	uint64_t nak_until; /* Every transaction NAKs in [nak_from, nak_until) */
+	uint32_t fl_size;
+	uint32_t fl_written;
+	uint8_t *flash;
+	int in_block; /* The current STATUS_WAIT is a block being written */
+	unsigned int blocks_done; /* Since flash was opened */
+	uint32_t kept; /* Left by an interrupted update, for SUPER_RESUME_FLASH */
+
+	unsigned int blocks;
+	unsigned int resets;
+	unsigned int arrivals; /* Blocks received, for corrupt= */
+	unsigned int block_xfers; /* Transfers carrying a block, for drop= */
+};
+
+static void sim_sleep_until(uint64_t t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Time on the wire for the given number of bytes, each with its ACK bit */
+static uint64_t sim_bus_ns(struct sim *sim, unsigned int bytes)
+{
+	return ((uint64_t)bytes * 9 * 1000000ULL) / sim->cfg.bus_khz;
+}
+
+static void sim_busy(struct sim *sim, uint64_t t, unsigned int wait_us, unsigned int nak_us)
+{
+	sim->wait_until = t + ((uint64_t)(wait_us + nak_us) * 1000);
+	sim->nak_from = t + ((uint64_t)wait_us * 1000);
+	sim->nak_until = sim->wait_until;
+}
+
+static void sim_write_block(struct sim *sim, const uint8_t *data, unsigned int len, uint8_t crc, uint64_t t);
+
+/*
+ * Firmware that takes a block in separate writes, and has only the one block
+ * buffer, stalls the bus from the moment a block is written until it is
+ * programmed, where newer firmware still answers with STATUS_WAIT while it
+ * decrypts.
+ */
+static int sim_stalls(const struct sim *sim)
+{
+	return sim->cfg.method == UPDATE_V0 ||
+	       !(sim->cfg.features & (SUPER_FEAT_BLKCMT | SUPER_FEAT_XBLOCK | SUPER_FEAT_DBLBUF));
+}
+
+static uint8_t sim_status(struct sim *sim, uint64_t t)
+{
+	while (sim->status == STATUS_WAIT && t >= sim->wait_until) {
+		sim->status = sim->next_status;
+		if (sim->in_block) {
+			sim->in_block = 0;
+			sim->blocks_done++;
+		}
+
+		/* A queued block is started as soon as the one before it is done */
+		if (sim->pending) {
+			sim->pending = 0;
+			sim_write_block(sim, (uint8_t *)sim->pending_block, sim->pending_len, sim->pending_crc,
+					sim->wait_until);
+		}
+	}
+
+	return sim->status;
+}
+
+static void sim_open_flash(struct sim *sim, uint32_t key, uint32_t size, uint64_t t)
+{
+	if (key != magic_key || !size || size > SIM_FLASH_SZ || (size & 0x7F))
+		return;
+
+	if (sim_status(sim, t) != STATUS_CLOSED) {
+		sim->status = STATUS_OPEN_ERR;
+		return;
+	}
+
+	sim->fl_size = size;
+	sim->fl_written = 0;
+	sim->kept = 0;
+	sim->blocks_done = 0;
+	sim->in_block = 0;
+	sim->pending = 0;
+	memset(sim->flash, 0xff, SIM_FLASH_SZ);
+
+	/* The erase finishes with the micro ready for data */
+	sim->status = STATUS_WAIT;
+	sim->next_status = STATUS_READY;
+	sim_busy(sim, t, 0, sim->cfg.erase_us);
+}
+
+/* Like opening flash, but carries on from whatever an interrupted update left */
+static void sim_resume_flash(struct sim *sim, uint32_t key, uint32_t size, uint64_t t)
+{
+	uint8_t status;
+
+	if (key != magic_key || !size || size > SIM_FLASH_SZ || (size & 0x7F))
+		return;
+
+	status = sim_status(sim, t);
+	if (status == STATUS_WAIT) {
+		sim->status = STATUS_OPEN_ERR;
+		return;
+	}
+
+	/* Still open from a host that went away */
+	if (status == STATUS_IN_PROC && size == sim->fl_size)
+		sim->kept = sim->fl_written;
+
+	if (!sim->kept || sim->kept > size) {
+		sim->status = STATUS_CLOSED;
+		sim_open_flash(sim, key, size, t);
+		return;
+	}
+
+	sim->fl_size = size;
+	sim->fl_written = sim->kept;
+	sim->blocks_done = 0;
+	sim->in_block = 0;
+	sim->pending = 0;
+
+	sim->status = STATUS_WAIT;
+	sim->next_status = (sim->fl_written == size) ? STATUS_DONE : STATUS_IN_PROC;
+	sim_busy(sim, t, 0, SIM_RESUME_US);
+}
+
+static void sim_write_block(struct sim *sim, const uint8_t *data, unsigned int len, uint8_t crc, uint64_t t)
+{
+	uint8_t status = sim_status(sim, t);
+
+	if (status == STATUS_WAIT && sim->in_block && (sim->cfg.features & SUPER_FEAT_DBLBUF) && !sim->pending) {
+		memcpy(sim->pending_block, data, len);
+		sim->pending_len = len;
+		sim->pending_crc = crc;
+		sim->pending = 1;
+		return;
+	}
+
+	/* A block rejected for its CRC is simply not taken, the next one may be */
+	if (status != STATUS_READY && status != STATUS_IN_PROC && status != STATUS_CRC_ERR) {
+		if (status != STATUS_CLOSED)
+			sim->status = STATUS_WRITE_ERR;
+		return;
+	}
+
+	sim->arrivals++;
+	if (crc8((uint8_t *)data, len) != crc || (sim->cfg.corrupt && !(sim->arrivals % sim->cfg.corrupt))) {
+		/* Anything queued behind it goes too, the host starts over from BLOCKS_DONE */
+		sim->status = STATUS_CRC_ERR;
+		sim->pending = 0;
+		return;
+	}
+
+	if (sim->fl_written + len > sim->fl_size) {
+		sim->status = STATUS_WRITE_ERR;
+		return;
+	}
+
+	memcpy(&sim->flash[sim->fl_written], data, len);
+	sim->fl_written += len;
+	sim->blocks++;
+
+	sim->status = STATUS_WAIT;
+	sim->next_status = (sim->fl_written == sim->fl_size) ? STATUS_DONE : STATUS_IN_PROC;
+	sim->in_block = 1;
+	if (sim_stalls(sim))
+		sim_busy(sim, t, 0, (sim->cfg.decrypt_us + sim->cfg.program_us) * (len / 128));
+	else
+		sim_busy(sim, t, sim->cfg.decrypt_us * (len / 128), sim->cfg.program_us * (len / 128));
+}
+
+/* len is the block length the command applies to, it differs for the large block window */
+static void sim_v1_flash_cmd(struct sim *sim, uint16_t cmd, unsigned int len, uint64_t t)
+{
+	if (cmd & SUPER_WRITE_BLOCK)
+		sim_write_block(sim, (uint8_t *)sim->block, len, sim->block_crc & 0xff, t);
+
+	if (cmd & SUPER_OPEN_FLASH)
+		sim_open_flash(sim, sim->magic[0] | ((uint32_t)sim->magic[1] << 16),
+			       sim->size[0] | ((uint32_t)sim->size[1] << 16), t);
+
+	if ((cmd & SUPER_RESUME_FLASH) && (sim->cfg.features & SUPER_FEAT_RESUME))
+		sim_resume_flash(sim, sim->magic[0] | ((uint32_t)sim->magic[1] << 16),
+				 sim->size[0] | ((uint32_t)sim->size[1] << 16), t);
+
+	if (cmd & SUPER_CLOSE_FLASH) {
+		sim_status(sim, t);
+		if (sim->status == STATUS_IN_PROC)
+			sim->kept = sim->fl_written;
+		if (sim->status != STATUS_WAIT)
+			sim->status = STATUS_CLOSED;
+	}
+
+	if (cmd & SUPER_APPLY_REBOOT)
+		sim->flash_flags |= SUPER_UPDATE_ON_REBOOT;
+}
+
+/*
+ * The large block window: xblock_len / 2 data registers, then the CRC, then
+ * the flash command. Returns 0 if reg is not in it.
+ */
+static int sim_v1_write_xblock(struct sim *sim, uint16_t reg, uint16_t val, uint64_t t)
+{
+	unsigned int words = sim->xblock_len / 2;
+
+	if (!(sim->cfg.features & SUPER_FEAT_XBLOCK) || reg < SUPER_FL_XBLOCK_DATA ||
+	    reg > SUPER_FL_XBLOCK_DATA + words + 1)
+		return 0;
+
+	reg -= SUPER_FL_XBLOCK_DATA;
+	if (reg < words)
+		sim->block[reg] = val;
+	else if (reg == words)
+		sim->block_crc = val;
+	else
+		sim_v1_flash_cmd(sim, val, sim->xblock_len, t);
+
+	return 1;
+}
+
+static void sim_v1_write_reg(struct sim *sim, uint16_t reg, uint16_t val, uint64_t t)
+{
+	if (reg >= SUPER_FL_BLOCK_DATA && reg < SUPER_FL_BLOCK_DATA + SUPER_FL_BLOCK_DATA_LEN) {
+		sim->block[reg - SUPER_FL_BLOCK_DATA] = val;
+		return;
+	}
+
+	if (sim_v1_write_xblock(sim, reg, val, t))
+		return;
+
+	switch (reg) {
+	case SUPER_FL_MAGIC_KEY0:
+	case SUPER_FL_MAGIC_KEY1:
+		sim->magic[reg - SUPER_FL_MAGIC_KEY0] = val;
+		break;
+	case SUPER_FL_SZ0:
+	case SUPER_FL_SZ1:
+		sim->size[reg - SUPER_FL_SZ0] = val;
+		break;
+	case SUPER_FL_BLOCK_CRC:
+		sim->block_crc = val;
+		break;
+	case SUPER_FL_FLASH_CMD:
+		sim_v1_flash_cmd(sim, val, SUPER_FL_BLOCK_DATA_LEN * 2, t);
+		break;
+	case SUPER_FL_XBLOCK_LEN:
+		/* Firmware ignores lengths it cannot do */
+		if (val && !(val & 0x7F) && val <= sim->cfg.xblock_max && val <= SIM_XBLOCK_SZ)
+			sim->xblock_len = val;
+		break;
+	default:
+		if (reg < 256)
+			sim->low_regs[reg] = val;
+		break;
+	}
+}
+
+static uint16_t sim_v1_read_reg(struct sim *sim, uint16_t reg, uint64_t t)
+{
+	switch (reg) {
+	case SUPER_MODEL:
+		return sim->cfg.modelnum;
+	case SUPER_REV_INFO:
+		return sim->cfg.revision;
+	case SUPER_FEATURES0:
+		return sim->cfg.features;
+	case SUPER_ADC_CHAN_ADV:
+		return SIM_ADC_CHAN_ADV;
+	case SUPER_TEMPERATURE:
+		/* Drifts around 25 C, in hundredths */
+		return 2500 + (t / 1000000000ULL) % 16;
+	case SUPER_FL_FLASH_STS:
+		return sim_status(sim, t) | sim->flash_flags | (sim->pending ? SUPER_BLOCK_PENDING : 0);
+	case SUPER_FL_BLOCKS_DONE:
+		sim_status(sim, t);
+		return sim->blocks_done;
+	case SUPER_FL_XBLOCK_MAX:
+		return (sim->cfg.features & SUPER_FEAT_XBLOCK) ? sim->cfg.xblock_max : 0;
+	case SUPER_FL_XBLOCK_LEN:
+		return sim->xblock_len;
+	case SUPER_FL_WRITE_OFS:
+		if (!(sim->cfg.features & SUPER_FEAT_RESUME))
+			return 0;
+		return ((sim_status(sim, t) == STATUS_CLOSED) ? sim->kept : sim->fl_written) / 128;
+	default:
+		/* Each channel ripples a little around its own level */
+		if (reg >= SUPER_ADC_BASE && reg < SUPER_ADC_BASE + 16 && (SIM_ADC_CHAN_ADV & (1 << (reg - SUPER_ADC_BASE))))
+			return ((reg - SUPER_ADC_BASE + 1) * 1000) + (t / 1000000) % 32;
+		if (reg < 256)
+			return sim->low_regs[reg];
+		return 0;
+	}
+}
+
+static void sim_v1_write(struct sim *sim, const uint8_t *buf, unsigned int len, uint64_t t)
+{
+	uint16_t val;
+	unsigned int i;
+
+	if (len < 2)
+		return;
+
+	memcpy(&sim->ptr, buf, 2);
+	for (i = 2; i + 1 < len; i += 2) {
+		memcpy(&val, &buf[i], 2);
+		sim_v1_write_reg(sim, sim->ptr++, val, t);
+	}
+}
+
+static void sim_v1_read(struct sim *sim, uint8_t *buf, unsigned int len, uint64_t t)
+{
+	uint16_t val;
+	unsigned int i;
+
+	for (i = 0; i < len; i += 2) {
+		val = sim_v1_read_reg(sim, sim->ptr++, t);
+		memcpy(&buf[i], &val, (len - i) < 2 ? 1 : 2);
+	}
+}
+
+static void sim_v0_write(struct sim *sim, const uint8_t *buf, unsigned int len, uint64_t t)
+{
+	uint32_t key, loc, size;
+
+	switch (len) {
+	case 13: /* Open header, magic key, location, length, CRC */
+		if (crc8((uint8_t *)buf, 12) != buf[12])
+			return;
+		memcpy(&key, &buf[0], 4);
+		memcpy(&loc, &buf[4], 4);
+		memcpy(&size, &buf[8], 4);
+		(void)loc;
+		sim_open_flash(sim, key, size, t);
+		break;
+	case 129: /* Block plus CRC */
+		sim_write_block(sim, buf, 128, buf[128], t);
+		break;
+	case 1:
+		if (buf[0] == STATUS_RESET) {
+			sim->resets++;
+			sim->status = STATUS_CLOSED;
+			sim_busy(sim, t, 0, SIM_RESET_US);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void sim_v0_read(struct sim *sim, uint8_t *buf, unsigned int len, uint64_t t)
+{
+	uint8_t regs[SIM_V0_REGS_SZ] = { 0 };
+
+	regs[0] = sim_status(sim, t);
+	regs[30] = sim->cfg.revision >> 8;
+	regs[31] = sim->cfg.revision & 0xff;
+
+	memset(buf, 0, len);
+	memcpy(buf, regs, len < sizeof(regs) ? len : sizeof(regs));
+}
+
+static int sim_transfer(micro_t *micro, struct i2c_msg *msgs, int nmsgs)
+{
+	struct sim *sim = micro->priv;
+	uint64_t start = micro_now_ns();
+	uint64_t t, now, end;
+	unsigned int bytes = 0;
+	int i;
+
+	/* Power to the micro went away partway through */
+	if (sim->cfg.cut && sim->blocks >= sim->cfg.cut) {
+		sim_sleep_until(start + ((uint64_t)sim->cfg.xfer_us * 1000));
+		errno = EIO;
+		return -1;
+	}
+
+	/*
+	 * A busy micro NAKs its address, which ends the transfer after the
+	 * first byte. So does anything not addressed to us.
+	 */
+	if ((start >= sim->nak_from && start < sim->nak_until) || msgs[0].addr != micro->i2caddr) {
+		sim_sleep_until(start + ((uint64_t)sim->cfg.xfer_us * 1000) + sim_bus_ns(sim, 1));
+		errno = ENXIO;
+		return -1;
+	}
+
+	/* Noise on the bus spoils a transfer carrying a block before it is taken */
+	if (sim->cfg.drop && msgs[0].len >= UPDATE_BLOCK_SZ && !(msgs[0].flags & I2C_M_RD) &&
+	    !(++sim->block_xfers % sim->cfg.drop)) {
+		sim_sleep_until(start + ((uint64_t)sim->cfg.xfer_us * 1000) + sim_bus_ns(sim, 1 + msgs[0].len));
+		errno = EREMOTEIO;
+		return -1;
+	}
+
+	/*
+	 * Messages are joined by repeated starts. A read samples the micro as
+	 * it starts, anything a write kicks off starts once it is received. A
+	 * micro that went busy partway through NAKs the next message's address.
+	 */
+	t = start + ((uint64_t)sim->cfg.xfer_us * 1000);
+	for (i = 0; i < nmsgs; i++) {
+		now = t + sim_bus_ns(sim, bytes);
+		if (i && now >= sim->nak_from && now < sim->nak_until) {
+			sim_sleep_until(now + sim_bus_ns(sim, 1));
+			errno = ENXIO;
+			return -1;
+		}
+
+		if (sim->cfg.method == UPDATE_V0) {
+			if (msgs[i].flags & I2C_M_RD)
+				sim_v0_read(sim, msgs[i].buf, msgs[i].len, t + sim_bus_ns(sim, bytes));
+			else
+				sim_v0_write(sim, msgs[i].buf, msgs[i].len, t + sim_bus_ns(sim, bytes + 1 + msgs[i].len));
+		} else {
+			if (msgs[i].flags & I2C_M_RD)
+				sim_v1_read(sim, msgs[i].buf, msgs[i].len, t + sim_bus_ns(sim, bytes));
+			else
+				sim_v1_write(sim, msgs[i].buf, msgs[i].len, t + sim_bus_ns(sim, bytes + 1 + msgs[i].len));
+		}
+		bytes += 1 + msgs[i].len;
+	}
+	end = t + sim_bus_ns(sim, bytes);
+
+	sim_sleep_until(end);
+
+	return 0;
+}
+
+static int sim_read(micro_t *micro, uint8_t *data, uint16_t bytes)
+{
+	struct i2c_msg msg;
+
+	msg.addr = micro->i2caddr;
+	msg.flags = I2C_M_RD;
+	msg.len = bytes;
+	msg.buf = data;
+
+	return sim_transfer(micro, &msg, 1);
+}
+
+static int sim_write(micro_t *micro, const uint8_t *data, uint16_t bytes)
+{
+	struct i2c_msg msg;
+
+	msg.addr = micro->i2caddr;
+	msg.flags = 0;
+	msg.len = bytes;
+	msg.buf = (uint8_t *)data;
+
+	return sim_transfer(micro, &msg, 1);
+}
+
+static int sim_open(micro_t *micro, int i2cbus, void *arg)
+{
+	struct sim *sim;
+
+	/* Unused */
+	(void)i2cbus;
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return -1;
+
+	sim->flash = malloc(SIM_FLASH_SZ);
+	if (!sim->flash) {
+		free(sim);
+		return -1;
+	}
+
+	memcpy(&sim->cfg, arg, sizeof(sim->cfg));
+	if (!sim->cfg.bus_khz)
+		sim->cfg.bus_khz = 100;
+	sim->status = STATUS_CLOSED;
+	sim->xblock_len = SUPER_FL_BLOCK_DATA_LEN * 2;
+	sim->kept = sim->cfg.kept;
+	micro->priv = sim;
+
+	return 0;
+}
+
+static void sim_close(micro_t *micro)
+{
+	struct sim *sim = micro->priv;
+
+	free(sim->flash);
+	free(sim);
+	micro->priv = NULL;
+}
+
+const struct micro_transport sim_transport = {
+	.name = "sim",
+	.open = sim_open,
+	.close = sim_close,
+	.read = sim_read,
+	.write = sim_write,
+	.transfer = sim_transfer,
+};
+
+/*
+ * Snapshot what the simulated micro has been through, so a caller can check
+ * that an update really landed.
+ */
+void sim_get_state(micro_t *micro, struct sim_state *state)
+{
+	struct sim *sim = micro->priv;
+
+	state->status = sim_status(sim, micro_now_ns());
+	state->flash_flags = sim->flash_flags;
+	state->fl_size = sim->fl_size;
+	state->fl_written = sim->fl_written;
+	state->blocks = sim->blocks;
+	state->resets = sim->resets;
+	state->flash = sim->flash;
+}
+
+void sim_default_cfg(struct sim_cfg *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->method = UPDATE_V1;
+	cfg->modelnum = 0x7250;
+	cfg->features = SUPER_FEAT_FWUPD;
+	cfg->xblock_max = 2048;
+	cfg->bus_khz = 100;
+	cfg->xfer_us = 50;
+	cfg->erase_us = 800000;
+	cfg->decrypt_us = 1500;
+	cfg->program_us = 300;
+}
+
+/*
+ * Parse a comma separated list of key=value settings, e.g.
+ * "model=0x7970,khz=400,erase=500000". The model selects which board is
+ * simulated and is handed back in *board_model. Times are in microseconds.
+ * A revision left at 0 is up to the caller to fill in for the board.
+ *
+ * Returns < 0 on an unknown key, 0 on success.
+ */
+int sim_parse_opts(char *opts, struct sim_cfg *cfg, uint16_t *board_model)
+{
+	enum {
+		O_MODEL,
+		O_REV,
+		O_FEATURES,
+		O_XBLOCK,
+		O_KHZ,
+		O_XFER,
+		O_ERASE,
+		O_DECRYPT,
+		O_PROGRAM,
+		O_KEPT,
+		O_CUT,
+		O_CORRUPT,
+		O_DROP,
+	};
+	char *const tokens[] = {
+		[O_MODEL] = "model",	 [O_REV] = "rev",	  [O_FEATURES] = "features", [O_XBLOCK] = "xblock",
+		[O_KHZ] = "khz",	 [O_XFER] = "xfer",	  [O_ERASE] = "erase",	     [O_DECRYPT] = "decrypt",
+		[O_PROGRAM] = "program", [O_KEPT] = "kept",	  [O_CUT] = "cut",	     [O_CORRUPT] = "corrupt",
+		[O_DROP] = "drop",	 NULL,
+	};
+	char *value;
+	unsigned long v;
+
+	while (*opts != '\0') {
+		int tok = getsubopt(&opts, tokens, &value);
+
+		if (tok < 0) {
+			fprintf(stderr, "Unknown simulator option \"%s\"\n", value);
+			return -1;
+		}
+		if (!value) {
+			fprintf(stderr, "Simulator option \"%s\" needs a value\n", tokens[tok]);
+			return -1;
+		}
+
+		v = strtoul(value, NULL, 0);
+		switch (tok) {
+		case O_MODEL:
+			*board_model = v;
+			break;
+		case O_REV:
+			cfg->revision = v;
+			break;
+		case O_FEATURES:
+			cfg->features = v;
+			break;
+		case O_XBLOCK:
+			cfg->xblock_max = v;
+			break;
+		case O_KHZ:
+			cfg->bus_khz = v ? v : 1;
+			break;
+		case O_XFER:
+			cfg->xfer_us = v;
+			break;
+		case O_ERASE:
+			cfg->erase_us = v;
+			break;
+		case O_DECRYPT:
+			cfg->decrypt_us = v;
+			break;
+		case O_PROGRAM:
+			cfg->program_us = v;
+			break;
+		case O_KEPT:
+			cfg->kept = v;
+			break;
+		case O_CUT:
+			cfg->cut = v;
+			break;
+		case O_CORRUPT:
+			cfg->corrupt = v;
+			break;
+		case O_DROP:
+			cfg->drop = v;
+			break;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "micro.h"
+#include "update-shared.h"
+
+/*
+ * Simulated supervisor
+ *
+ * Answers the same transactions as a real supervisor on i2c-dev, for either
+ * update method, and takes roughly as long to do so. Bus time is derived from
+ * the configured clock and the number of bytes on the wire; flash erase and
+ * block writes keep the micro busy (STATUS_WAIT) or NAKing for the configured
+ * times, just like the real thing with interrupts disabled.
+ */
+struct sim_cfg {
+	update_meth_t method;
+	uint16_t modelnum; /* Model the micro reports */
+	uint16_t revision;
+	uint16_t features; /* SUPER_FEATURES0, V1 only */
+	uint16_t xblock_max; /* Largest block in bytes with SUPER_FEAT_XBLOCK */
+	unsigned int bus_khz;
+	unsigned int xfer_us; /* Fixed cost of each transaction, driver and syscall */
+	unsigned int erase_us; /* Open, erase, and blank check; NAKs throughout */
+	unsigned int decrypt_us; /* Per 128 bytes; status reads STATUS_WAIT, or NAKs on older firmware */
+	unsigned int program_us; /* Per 128 bytes after decrypt; NAKs throughout */
+	uint32_t kept; /* Bytes of an interrupted update in flash, SUPER_FEAT_RESUME only */
+	unsigned int cut; /* The bus dies after this many blocks, 0 never */
+	unsigned int corrupt; /* Every corrupt'th block arrives with a bad CRC, 0 never */
+	unsigned int drop; /* Every drop'th transfer carrying a block fails, 0 never */
+};
+
+struct sim_state {
+	uint8_t status;
+	uint16_t flash_flags; /* SUPER_UPDATE_ON_REBOOT, V1 only */
+	uint32_t fl_size; /* Length given when flash was last opened */
+	uint32_t fl_written;
+	unsigned int blocks; /* Blocks accepted since the sim was opened */
+	unsigned int resets; /* V0 resets requested */
+	const uint8_t *flash; /* fl_written bytes of received image */
+};
+
+extern const struct micro_transport sim_transport;
+
+void sim_get_state(micro_t *micro, struct sim_state *state);
+void sim_default_cfg(struct sim_cfg *cfg);
+int sim_parse_opts(char *opts, struct sim_cfg *cfg, uint16_t *board_model);
@@ -4,121 +4,350 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 
-int micro_init(int i2cbus, int i2caddr)
+#include "micro.h"
+
+static int i2cdev_open(micro_t *micro, int i2cbus, void *arg)
 {
-	static int fd = -1;
 	char i2c_bus_path[20];
 
-	if (fd != -1)
-		return fd;
+	/* Unused */
+	(void)arg;
 
 	snprintf(i2c_bus_path, sizeof(i2c_bus_path), "/dev/i2c-%d", i2cbus);
-	fd = open(i2c_bus_path, O_RDWR);
-	if (fd < 0) {
+	micro->fd = open(i2c_bus_path, O_RDWR);
+	if (micro->fd < 0) {
 		perror("Couldn't open i2c device");
-		goto out;
+		return -1;
 	}
 
 	/*
 	 * We use force because there is typically a driver attached. This is
 	 * safe because we are using only i2c_msgs and not read()/write() calls
 	 */
-	if (ioctl(fd, I2C_SLAVE_FORCE, i2caddr) < 0) {
+	if (ioctl(micro->fd, I2C_SLAVE_FORCE, micro->i2caddr) < 0) {
 		perror("Supervisor did not ACK");
-		close(fd);
-		fd = -1;
+		close(micro->fd);
+		micro->fd = -1;
+		return -1;
 	}
 
-out:
-	return fd;
+	return 0;
+}
+
+static void i2cdev_close(micro_t *micro)
+{
+	close(micro->fd);
+	micro->fd = -1;
+}
+
+static int i2cdev_transfer(micro_t *micro, struct i2c_msg *msgs, int nmsgs)
+{
+	struct i2c_rdwr_ioctl_data packets;
+	int ret;
+
+	packets.msgs = msgs;
+	packets.nmsgs = nmsgs;
+
+	/* I2C_RDWR will return < 0 on error, or the number of messages that
+	 * were transferred. Anything short of all of them is a failure.
+	 */
+	ret = ioctl(micro->fd, I2C_RDWR, &packets);
+	if (ret < 0)
+		return ret;
+
+	if (ret != nmsgs) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int i2cdev_read(micro_t *micro, uint8_t *data, uint16_t bytes)
+{
+	struct i2c_msg msg;
+
+	msg.addr = micro->i2caddr;
+	msg.flags = I2C_M_RD;
+	msg.len = bytes;
+	msg.buf = data;
+
+	return i2cdev_transfer(micro, &msg, 1);
+}
+
+static int i2cdev_write(micro_t *micro, const uint8_t *data, uint16_t bytes)
+{
+	struct i2c_msg msg;
+
+	msg.addr = micro->i2caddr;
+	msg.flags = 0;
+	msg.len = bytes;
+	msg.buf = (uint8_t *)data;
+
+	return i2cdev_transfer(micro, &msg, 1);
+}
+
+const struct micro_transport i2cdev_transport = {
+	.name = "i2c-dev",
+	.open = i2cdev_open,
+	.close = i2cdev_close,
+	.read = i2cdev_read,
+	.write = i2cdev_write,
+	.transfer = i2cdev_transfer,
+};
+
+/*
+ * Returns NULL on failure, or a handle to talk to the supervisor at i2caddr
+ * on i2cbus using the given transport. arg is passed through to the
+ * transport's open().
+ */
+micro_t *micro_open(const struct micro_transport *ops, int i2cbus, uint16_t i2caddr, void *arg)
+{
+	micro_t *micro;
+
+	micro = calloc(1, sizeof(*micro));
+	if (!micro)
+		return NULL;
+
+	micro->ops = ops;
+	micro->i2caddr = i2caddr;
+	micro->fd = -1;
+
+	micro->xfer_buf = aligned_alloc(64, MICRO_XFER_MAX);
+	if (!micro->xfer_buf) {
+		free(micro);
+		return NULL;
+	}
+	micro->counters.allocs++;
+
+	if (ops->open(micro, i2cbus, arg) < 0) {
+		free(micro->xfer_buf);
+		free(micro);
+		return NULL;
+	}
+
+	return micro;
+}
+
+micro_t *micro_init(int i2cbus, uint16_t i2caddr)
+{
+	return micro_open(&i2cdev_transport, i2cbus, i2caddr, NULL);
+}
+
+void micro_close(micro_t *micro)
+{
+	if (!micro)
+		return;
+
+	micro->ops->close(micro);
+	free(micro->xfer_buf);
+	free(micro);
+}
+
+uint64_t micro_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+ * Sleep on behalf of a supervisor, e.g. while it is busy with flash. The time
+ * asked for and the time actually slept are added to the handle's counters.
+ *
+ * A realtime handle does not trust the scheduler to wake it on time. It
+ * sleeps to an absolute deadline, so time lost before the sleep starts comes
+ * off it, wakes spin_us early, and spins out the rest.
+ */
+void micro_sleep_us(micro_t *micro, unsigned int us)
+{
+	uint64_t start = micro_now_ns();
+	uint64_t deadline = start + ((uint64_t)us * 1000);
+	struct timespec ts;
+
+	if (!micro->realtime) {
+		usleep(us);
+	} else {
+		if (us > micro->spin_us) {
+			ts.tv_sec = (deadline - (uint64_t)micro->spin_us * 1000) / 1000000000ULL;
+			ts.tv_nsec = (deadline - (uint64_t)micro->spin_us * 1000) % 1000000000ULL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
+		}
+	}
+
+	micro_wait_finish(micro, start, deadline);
+}
+
+/*
+ * Finish a wait that started at start and is due at deadline, once something
+ * else, e.g. a timerfd, has slept through all of it or, for a realtime
+ * handle, all but the last spin_us. A realtime handle spins out the rest. The
+ * wait is counted the same as micro_sleep_us() counts its own.
+ */
+void micro_wait_finish(micro_t *micro, uint64_t start, uint64_t deadline)
+{
+	uint64_t end;
+
+	if (micro->realtime) {
+		while (micro_now_ns() < deadline)
+			;
+	}
+
+	end = micro_now_ns();
+	micro->counters.sleeps++;
+	micro->counters.sleep_ns += end - start;
+	micro->counters.sleep_req_ns += deadline - start;
+	if (end > deadline && end - deadline > micro->counters.sleep_over_max_ns)
+		micro->counters.sleep_over_max_ns = end - deadline;
+}
+
+static void micro_account(micro_t *micro, uint64_t start, unsigned int bytes, int ret)
+{
+	micro->counters.transfers++;
+	micro->counters.bytes += bytes;
+	micro->counters.xfer_ns += micro_now_ns() - start;
+	if (ret < 0)
+		micro->counters.errors++;
+}
+
+/* Report a failed transfer, leaving errno for the caller to decide what it means */
+static void micro_perror(const char *msg)
+{
+	int err = errno;
+
+	perror(msg);
+	errno = err;
+}
+
+/* Counted wrappers around the transport, everything below goes through these */
+static int micro_transfer(micro_t *micro, struct i2c_msg *msgs, int nmsgs)
+{
+	uint64_t start = micro_now_ns();
+	unsigned int bytes = 0;
+	int ret;
+	int i;
+
+	ret = micro->ops->transfer(micro, msgs, nmsgs);
+	for (i = 0; i < nmsgs; i++)
+		bytes += msgs[i].len;
+	micro_account(micro, start, bytes, ret);
+
+	return ret;
+}
+
+static int micro_read(micro_t *micro, uint8_t *data, uint16_t bytes)
+{
+	uint64_t start = micro_now_ns();
+	int ret;
+
+	ret = micro->ops->read(micro, data, bytes);
+	micro_account(micro, start, bytes, ret);
+
+	return ret;
+}
+
+static int micro_write(micro_t *micro, const uint8_t *data, uint16_t bytes)
+{
+	uint64_t start = micro_now_ns();
+	int ret;
+
+	ret = micro->ops->write(micro, data, bytes);
+	micro_account(micro, start, bytes, ret);
+
+	return ret;
 }
 
 /*
  * Returns < 0 on failure, 0 on success
  * Data read is inserted in to *data
+ *
+ * When quiet is set, failures are not printed. This is used while polling a
+ * micro that is expected to NAK while it has interrupts disabled.
  */
-int speekstream16(int i2cfd, uint16_t i2caddr, uint16_t addr, uint16_t *data, uint16_t size)
+static int __speekstream16(micro_t *micro, uint16_t addr, uint16_t *data, uint16_t size, int quiet)
 {
-	struct i2c_rdwr_ioctl_data packets;
 	struct i2c_msg msgs[2];
 	int ret;
 
-	msgs[0].addr = i2caddr;
+	msgs[0].addr = micro->i2caddr;
 	msgs[0].flags = 0;
 	msgs[0].len = 2;
 	msgs[0].buf = (uint8_t *)&addr;
 
-	msgs[1].addr = i2caddr;
+	msgs[1].addr = micro->i2caddr;
 	msgs[1].flags = I2C_M_RD;
 	msgs[1].len = size;
 	msgs[1].buf = (uint8_t *)data;
 
-	packets.msgs = msgs;
-	packets.nmsgs = 2;
-
-	/* I2C_RDWR will return < 0 on error, or the number of messages that
-	 * were transferred. We should always have two since we are only ever
-	 * sending a write followed by a read.
-	 */
-	ret = ioctl(i2cfd, I2C_RDWR, &packets);
-	if (ret < 0)
-		perror("Unable to read data");
-	else if (ret == 2)
-		ret = 0;
-	else
-		ret = -1;
+	/* Always a write of the address followed by a read */
+	ret = micro_transfer(micro, msgs, 2);
+	if (ret < 0 && !quiet)
+		micro_perror("Unable to read data");
 
 	return ret;
 }
 
+int speekstream16(micro_t *micro, uint16_t addr, uint16_t *data, uint16_t size)
+{
+	return __speekstream16(micro, addr, data, size, 0);
+}
+
+/*
+ * Where to build the data for spokebuf16(), MICRO_XFER_MAX - MICRO_XFER_HDR
+ * bytes. Anything written through the handle may overwrite it.
+ */
+uint16_t *micro_xfer_payload(micro_t *micro)
+{
+	return (uint16_t *)&micro->xfer_buf[MICRO_XFER_HDR];
+}
+
 /*
+ * Write size bytes already placed at micro_xfer_payload() to the registers
+ * starting at addr. Nothing is allocated or copied.
+ *
  * Returns < 0 on failure, 0 on success
  */
-int spokestream16(int i2cfd, uint16_t i2caddr, uint16_t addr, uint16_t *data, uint16_t size)
+int spokebuf16(micro_t *micro, uint16_t addr, uint16_t size)
 {
-	struct i2c_rdwr_ioctl_data packets;
-	struct i2c_msg msg;
-	uint8_t *outdata;
 	int ret;
 
-	/*
-	 * Linux only supports 4k transactions at a time, and we need
-	 * two bytes for the address
-	 */
-	assert(size <= 4094);
-	outdata = malloc(size + 2);
-
-	memcpy(outdata, &addr, 2);
-	memcpy(&outdata[2], data, size);
+	assert(size <= MICRO_XFER_MAX - MICRO_XFER_HDR);
+	memcpy(micro->xfer_buf, &addr, MICRO_XFER_HDR);
 
-	msg.addr = i2caddr;
-	msg.flags = 0;
-	msg.len = 2 + size;
-	msg.buf = outdata;
+	ret = micro_write(micro, micro->xfer_buf, MICRO_XFER_HDR + size);
+	if (ret < 0)
+		micro_perror("Unable to send data");
 
-	packets.msgs = &msg;
-	packets.nmsgs = 1;
+	return ret;
+}
 
-	ret = ioctl(i2cfd, I2C_RDWR, &packets);
-	free(outdata);
+/*
+ * Returns < 0 on failure, 0 on success
+ */
+int spokestream16(micro_t *micro, uint16_t addr, uint16_t *data, uint16_t size)
+{
+	uint16_t *payload = micro_xfer_payload(micro);
 
-	/* I2C_RDWR will return < 0 on error, or the number of messages that
-	 * were transferred. We should always have one since we are only ever
-	 * sending a single transfer.
+	/*
+	 * Linux only supports 4k transactions at a time, and we need
+	 * two bytes for the address
 	 */
-	if (ret < 0)
-		perror("Unable to send data");
-	else if (ret == 1)
-		ret = 0;
-	else
-		ret = -1;
+	assert(size <= MICRO_XFER_MAX - MICRO_XFER_HDR);
+	if (data != payload) {
+		memcpy(payload, data, size);
+		micro->counters.copied += size;
+	}
 
-	return ret;
+	return spokebuf16(micro, addr, size);
 }
 
 /*
@@ -127,57 +356,141 @@ int spokestream16(int i2cfd, uint16_t i2caddr, uint16_t addr, uint16_t *data, ui
  *
  * < 0 on failure, 0 on success
  */
-int spoke16(int i2cfd, uint16_t i2caddr, uint16_t addr, uint16_t data)
+int spoke16(micro_t *micro, uint16_t addr, uint16_t data)
 {
-	return spokestream16(i2cfd, i2caddr, addr, &data, 2);
+	*micro_xfer_payload(micro) = data;
+
+	return spokebuf16(micro, addr, 2);
 }
 
 /*
  * Returns < 0 on failure
  */
-int speek16(int i2cfd, uint16_t i2caddr, uint16_t addr, uint16_t *data)
+int speek16(micro_t *micro, uint16_t addr, uint16_t *data)
 {
-	return speekstream16(i2cfd, i2caddr, addr, data, 2);
+	return speekstream16(micro, addr, data, 2);
 }
 
 /*
- * Returns 0 on success, < 0 on all other failures.
+ * Same as speek16(), but does not print on failure
  */
-static int __v0_stream(int twifd, uint16_t i2caddr, uint8_t *data, uint16_t bytes, uint16_t flags)
+int speek16_quiet(micro_t *micro, uint16_t addr, uint16_t *data)
 {
-	struct i2c_rdwr_ioctl_data packets;
-	struct i2c_msg msg;
-	int ret = 0;
+	return __speekstream16(micro, addr, data, 2, 1);
+}
 
-	msg.addr = i2caddr;
-	msg.flags = flags;
-	msg.len = bytes;
-	msg.buf = data;
+int v0_stream_read(micro_t *micro, uint8_t *data, uint16_t bytes)
+{
+	int ret;
+
+	ret = micro_read(micro, data, bytes);
+	if (ret < 0)
+		micro_perror("Unable to transfer data");
 
-	packets.msgs = &msg;
-	packets.nmsgs = 1;
+	return ret;
+}
 
-	/* I2C_RDWR will return < 0 on error, or the number of messages that
-	 * were transferred. We should always have one since we are only ever
-	 * sending a single transfer.
-	 */
-	ret = ioctl(twifd, I2C_RDWR, &packets);
+/*
+ * Same as v0_stream_read(), but does not print on failure
+ */
+int v0_stream_read_quiet(micro_t *micro, uint8_t *data, uint16_t bytes)
+{
+	return micro_read(micro, data, bytes);
+}
+
+int v0_stream_write(micro_t *micro, uint8_t *data, uint16_t bytes)
+{
+	int ret;
+
+	ret = micro_write(micro, data, bytes);
 	if (ret < 0)
-		perror("Unable to transfer data");
-	else if (ret == 1)
-		ret = 0;
-	else
-		ret = -1;
+		micro_perror("Unable to transfer data");
 
 	return ret;
 }
 
-int v0_stream_read(int twifd, uint16_t i2caddr, uint8_t *data, uint16_t bytes)
+/*
+ * Batches
+ *
+ * Several messages sent as one transaction, joined by repeated starts. On
+ * i2c-dev that is a single I2C_RDWR ioctl, so e.g. a command and a read of
+ * the status it produces cost one syscall and the micro sees no stop between
+ * them. Buffers handed to a batch must stay valid until it has been run.
+ */
+void micro_batch_init(struct micro_batch *batch, micro_t *micro)
+{
+	batch->micro = micro;
+	batch->nmsgs = 0;
+	batch->nregs = 0;
+}
+
+void micro_batch_write(struct micro_batch *batch, const uint8_t *data, uint16_t bytes)
+{
+	struct i2c_msg *msg;
+
+	assert(batch->nmsgs < MICRO_BATCH_MAX);
+	msg = &batch->msgs[batch->nmsgs++];
+	msg->addr = batch->micro->i2caddr;
+	msg->flags = 0;
+	msg->len = bytes;
+	msg->buf = (uint8_t *)data;
+}
+
+void micro_batch_read(struct micro_batch *batch, uint8_t *data, uint16_t bytes)
+{
+	struct i2c_msg *msg;
+
+	assert(batch->nmsgs < MICRO_BATCH_MAX);
+	msg = &batch->msgs[batch->nmsgs++];
+	msg->addr = batch->micro->i2caddr;
+	msg->flags = I2C_M_RD;
+	msg->len = bytes;
+	msg->buf = data;
+}
+
+/* Like spokebuf16(), only one of these fits in a batch */
+void micro_batch_pokebuf16(struct micro_batch *batch, uint16_t addr, uint16_t size)
+{
+	assert(size <= MICRO_XFER_MAX - MICRO_XFER_HDR);
+	memcpy(batch->micro->xfer_buf, &addr, MICRO_XFER_HDR);
+	micro_batch_write(batch, batch->micro->xfer_buf, MICRO_XFER_HDR + size);
+}
+
+void micro_batch_poke16(struct micro_batch *batch, uint16_t addr, uint16_t data)
 {
-	return __v0_stream(twifd, i2caddr, data, bytes, I2C_M_RD);
+	uint16_t *reg;
+
+	assert(batch->nregs < MICRO_BATCH_MAX);
+	reg = batch->regs[batch->nregs++];
+	reg[0] = addr;
+	reg[1] = data;
+	micro_batch_write(batch, (uint8_t *)reg, 4);
+}
+
+void micro_batch_peek16(struct micro_batch *batch, uint16_t addr, uint16_t *data, uint16_t size)
+{
+	uint16_t *reg;
+
+	assert(batch->nregs < MICRO_BATCH_MAX);
+	reg = batch->regs[batch->nregs++];
+	reg[0] = addr;
+	micro_batch_write(batch, (uint8_t *)reg, 2);
+	micro_batch_read(batch, (uint8_t *)data, size);
 }
 
-int v0_stream_write(int twifd, uint16_t i2caddr, uint8_t *data, uint16_t bytes)
+/*
+ * Send everything added to the batch. If the transaction fails there is no
+ * telling how much of it the micro saw.
+ *
+ * Returns < 0 on failure, 0 on success. Failures are printed unless quiet.
+ */
+int micro_batch_run(struct micro_batch *batch, int quiet)
 {
-	return __v0_stream(twifd, i2caddr, data, bytes, 0);
+	int ret;
+
+	ret = micro_transfer(batch->micro, batch->msgs, batch->nmsgs);
+	if (ret < 0 && !quiet)
+		micro_perror("Unable to transfer data");
+
+	return ret;
 }
@@ -1,9 +1,121 @@
 #pragma once
 
-int speekstream16(int i2cfd, uint16_t i2caddr, uint16_t addr, uint16_t *data, uint16_t size);
-int spokestream16(int i2cfd, uint16_t i2caddr, uint16_t addr, uint16_t *data, uint16_t size);
-int micro_init(int i2cbus, uint16_t i2caddr);
-int spoke16(int i2cfd, uint16_t i2caddr, uint16_t addr, uint16_t data);
-int speek16(int i2cfd, uint16_t i2caddr, uint16_t addr, uint16_t *data);
-int v0_stream_write(int i2cfd, uint16_t i2caddr, uint8_t *data, uint16_t bytes);
-int v0_stream_read(int i2cfd, uint16_t i2caddr, uint8_t *data, uint16_t bytes);
+#include <stdint.h>
+#include <linux/i2c.h>
+
+typedef struct micro micro_t;
+struct update_stats;
+
+/*
+ * A transport moves bytes between us and a supervisor. The real one is
+ * i2c-dev, but anything that can answer the same transactions will do.
+ *
+ * All transport calls return < 0 with errno set on failure, 0 on success,
+ * and do not print anything. Reporting errors is left to the callers.
+ */
+struct micro_transport {
+	const char *name;
+	int (*open)(micro_t *micro, int i2cbus, void *arg);
+	void (*close)(micro_t *micro);
+	int (*read)(micro_t *micro, uint8_t *data, uint16_t bytes);
+	int (*write)(micro_t *micro, const uint8_t *data, uint16_t bytes);
+	/* Multiple messages joined by repeated starts */
+	int (*transfer)(micro_t *micro, struct i2c_msg *msgs, int nmsgs);
+};
+
+/*
+ * Linux handles at most 4k in one message. Register writes are built in a
+ * buffer of this size owned by the handle, behind room for the address.
+ */
+#define MICRO_XFER_MAX 4096
+#define MICRO_XFER_HDR 2
+
+/* Running totals for everything done through a handle */
+struct micro_counters {
+	unsigned long transfers; /* Bus transactions, one ioctl each on i2c-dev */
+	unsigned long errors; /* Transactions that failed, including NAKs */
+	unsigned long bytes; /* Payload bytes, not counting the chip address */
+	unsigned long copied; /* Bytes copied into the transfer buffer by spokestream16() */
+	unsigned long allocs; /* Heap allocations made by the handle, only ever at open */
+	uint64_t xfer_ns; /* Time spent in transactions */
+	uint64_t sleep_ns; /* Time spent in micro_sleep_us(), or timed waits as micro_wait_finish() */
+	uint64_t sleep_req_ns; /* Time asked for, sleep_ns less oversleeping */
+	uint64_t sleep_over_max_ns; /* Worst oversleep of a single wait */
+	unsigned long sleeps;
+};
+
+/*
+ * The supervisor's identity and low registers, read in one burst by the
+ * update method and kept until invalidated. Model, revision, and feature
+ * checks all come from here, so between them they cost one transaction.
+ */
+struct micro_snapshot {
+	int valid;
+	uint16_t model; /* 0 where the micro does not report one */
+	uint16_t revision; /* As read, V1 keeps a dirty flag in bit 15 */
+	uint16_t adc_chan_adv;
+	uint16_t features;
+	uint16_t cmds;
+	uint16_t gen_flags;
+	uint16_t gen_inputs;
+};
+
+struct micro {
+	const struct micro_transport *ops;
+	uint16_t i2caddr;
+	int fd;
+	void *priv;
+	uint8_t *xfer_buf; /* MICRO_XFER_MAX bytes, cache line aligned */
+	struct micro_counters counters;
+	struct micro_snapshot snap;
+	struct update_stats *stats; /* Optional, see update-stats.h */
+	const char *journal_dir; /* Optional, see update-journal.h */
+	/*
+	 * Optional, with realtime set waits sleep to an absolute deadline
+	 * spin_us short of it, and spin the rest. See realtime.h.
+	 */
+	int realtime;
+	unsigned int spin_us;
+	/* Optional, replaces the default progress output during an update */
+	void (*progress)(micro_t *micro, unsigned int done, unsigned int total);
+	void *progress_arg;
+};
+
+/* Messages in one transaction, see micro_batch_init() */
+#define MICRO_BATCH_MAX 6
+
+struct micro_batch {
+	micro_t *micro;
+	int nmsgs;
+	struct i2c_msg msgs[MICRO_BATCH_MAX];
+	int nregs;
+	uint16_t regs[MICRO_BATCH_MAX][2]; /* Address, and data, of small register accesses */
+};
+
+extern const struct micro_transport i2cdev_transport;
+
+micro_t *micro_open(const struct micro_transport *ops, int i2cbus, uint16_t i2caddr, void *arg);
+micro_t *micro_init(int i2cbus, uint16_t i2caddr);
+void micro_close(micro_t *micro);
+void micro_sleep_us(micro_t *micro, unsigned int us);
+void micro_wait_finish(micro_t *micro, uint64_t start, uint64_t deadline);
+uint64_t micro_now_ns(void);
+
+int speekstream16(micro_t *micro, uint16_t addr, uint16_t *data, uint16_t size);
+int spokestream16(micro_t *micro, uint16_t addr, uint16_t *data, uint16_t size);
+uint16_t *micro_xfer_payload(micro_t *micro);
+int spokebuf16(micro_t *micro, uint16_t addr, uint16_t size);
+int spoke16(micro_t *micro, uint16_t addr, uint16_t data);
+int speek16(micro_t *micro, uint16_t addr, uint16_t *data);
+int speek16_quiet(micro_t *micro, uint16_t addr, uint16_t *data);
+int v0_stream_write(micro_t *micro, uint8_t *data, uint16_t bytes);
+int v0_stream_read(micro_t *micro, uint8_t *data, uint16_t bytes);
+int v0_stream_read_quiet(micro_t *micro, uint8_t *data, uint16_t bytes);
+
+void micro_batch_init(struct micro_batch *batch, micro_t *micro);
+void micro_batch_write(struct micro_batch *batch, const uint8_t *data, uint16_t bytes);
+void micro_batch_read(struct micro_batch *batch, uint8_t *data, uint16_t bytes);
+void micro_batch_pokebuf16(struct micro_batch *batch, uint16_t addr, uint16_t size);
+void micro_batch_poke16(struct micro_batch *batch, uint16_t addr, uint16_t data);
+void micro_batch_peek16(struct micro_batch *batch, uint16_t addr, uint16_t *data, uint16_t size);
+int micro_batch_run(struct micro_batch *batch, int quiet);
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include "micro.h"
+#include "update-shared.h"
+#include "update-v1.h"
+#include "monitor.h"
+#include "telemetry.h"
+
+/* ADC channels that can be advertised, one bit each in SUPER_ADC_CHAN_ADV */
+#define MONITOR_MAX_CHAN 16
+
+static volatile sig_atomic_t monitor_stop;
+
+static void monitor_signal(int sig)
+{
+	/* Unused */
+	(void)sig;
+
+	monitor_stop = 1;
+}
+
+void monitor_default_cfg(struct monitor_cfg *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->rate_hz = 10;
+	cfg->format = MONITOR_CSV;
+}
+
+/*
+ * Parse a comma separated list of settings, e.g. "rate=100,format=bin,
+ * out=/tmp/log". Returns < 0 on an unknown or bad setting, 0 on success.
+ */
+int monitor_parse_opts(char *opts, struct monitor_cfg *cfg)
+{
+	enum { O_RATE, O_FORMAT, O_OUT, O_COUNT };
+	char *const tokens[] = {
+		[O_RATE] = "rate", [O_FORMAT] = "format", [O_OUT] = "out", [O_COUNT] = "count", NULL,
+	};
+	char *value;
+
+	while (*opts != '\0') {
+		int tok = getsubopt(&opts, tokens, &value);
+
+		if (tok < 0) {
+			fprintf(stderr, "Unknown monitor option \"%s\"\n", value);
+			return -1;
+		}
+		if (!value) {
+			fprintf(stderr, "Monitor option \"%s\" needs a value\n", tokens[tok]);
+			return -1;
+		}
+
+		switch (tok) {
+		case O_RATE:
+			cfg->rate_hz = strtoul(value, NULL, 0);
+			if (!cfg->rate_hz || cfg->rate_hz > 1000) {
+				fprintf(stderr, "Monitor rate must be 1 to 1000 Hz\n");
+				return -1;
+			}
+			break;
+		case O_FORMAT:
+			if (!strcmp(value, "csv")) {
+				cfg->format = MONITOR_CSV;
+			} else if (!strcmp(value, "bin")) {
+				cfg->format = MONITOR_BINARY;
+			} else if (!strcmp(value, "shm")) {
+				cfg->format = MONITOR_SHM;
+			} else {
+				fprintf(stderr, "Unknown monitor format \"%s\"\n", value);
+				return -1;
+			}
+			break;
+		case O_OUT:
+			cfg->path = value;
+			break;
+		case O_COUNT:
+			cfg->count = strtoul(value, NULL, 0);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static uint64_t monitor_clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int monitor_write_header(FILE *out, const struct monitor_cfg *cfg, uint16_t model, uint16_t mask)
+{
+	struct monitor_header hdr;
+	int i;
+
+	if (cfg->format == MONITOR_BINARY) {
+		memcpy(hdr.magic, MONITOR_MAGIC, sizeof(hdr.magic));
+		hdr.version = MONITOR_VERSION;
+		hdr.model = model;
+		hdr.chan_mask = mask;
+		hdr.nchan = __builtin_popcount(mask);
+		hdr.rate_hz = cfg->rate_hz;
+		return fwrite(&hdr, sizeof(hdr), 1, out) == 1 ? 0 : -1;
+	}
+
+	fprintf(out, "time,seq,temperature");
+	for (i = 0; i < MONITOR_MAX_CHAN; i++) {
+		if (mask & (1 << i))
+			fprintf(out, ",adc%d", i);
+	}
+	fprintf(out, "\n");
+
+	return ferror(out) ? -1 : 0;
+}
+
+/* regs holds every register from SUPER_ADC_BASE up to the highest channel */
+static int monitor_write_record(FILE *out, const struct monitor_cfg *cfg, uint16_t mask,
+				const struct monitor_record *rec, const uint16_t *regs)
+{
+	uint16_t vals[MONITOR_MAX_CHAN];
+	int n = 0;
+	int i;
+
+	for (i = 0; i < MONITOR_MAX_CHAN; i++) {
+		if (mask & (1 << i))
+			vals[n++] = regs[i];
+	}
+
+	if (cfg->format == MONITOR_BINARY) {
+		if (fwrite(rec, sizeof(*rec), 1, out) != 1)
+			return -1;
+		if (n && fwrite(vals, sizeof(vals[0]), n, out) != (size_t)n)
+			return -1;
+		return 0;
+	}
+
+	fprintf(out, "%" PRIu64 ".%09" PRIu64 ",%u,%u", rec->time_ns / 1000000000, rec->time_ns % 1000000000, rec->seq,
+		rec->temperature);
+	for (i = 0; i < n; i++)
+		fprintf(out, ",%u", vals[i]);
+	fprintf(out, "\n");
+
+	return ferror(out) ? -1 : 0;
+}
+
+/* low holds every register from SUPER_MODEL to SUPER_GEN_INPUTS */
+static void monitor_publish(struct telemetry *pub, const struct monitor_cfg *cfg, uint16_t mask,
+			    const struct monitor_record *rec, const uint16_t *low, const uint16_t *regs,
+			    unsigned long samples, unsigned long errors)
+{
+	struct telemetry_sample sample = { 0 };
+	int i;
+
+	sample.time_ns = rec->time_ns;
+	sample.count = samples;
+	sample.errors = errors;
+	sample.period_us = 1000000 / cfg->rate_hz;
+	sample.model = low[SUPER_MODEL];
+	sample.revision = low[SUPER_REV_INFO];
+	sample.features = low[SUPER_FEATURES0];
+	sample.gen_flags = low[SUPER_GEN_FLAGS];
+	sample.gen_inputs = low[SUPER_GEN_INPUTS];
+	sample.adc_chan_adv = mask;
+	sample.temperature = rec->temperature;
+	for (i = 0; i < TELEMETRY_ADC_CHANS; i++) {
+		if (mask & (1 << i))
+			sample.adc[i] = regs[i];
+	}
+
+	telemetry_publish(pub, &sample);
+}
+
+/*
+ * Sample until cfg->count samples have been taken or SIGINT/SIGTERM arrives.
+ * Returns < 0 if the supervisor could not be monitored or the output failed.
+ */
+int monitor_run(board_t *board, micro_t *micro, const struct monitor_cfg *cfg)
+{
+	uint16_t regs[MONITOR_MAX_CHAN] = { 0 };
+	uint16_t low[SUPER_GEN_INPUTS + 1];
+	struct telemetry *pub = NULL;
+	struct monitor_record rec = { 0 };
+	struct micro_batch batch;
+	struct sigaction sa;
+	struct timespec ts;
+	uint64_t period = 1000000000ULL / cfg->rate_hz;
+	uint64_t next, now;
+	unsigned long samples = 0, missed = 0, errors = 0;
+	uint16_t temperature;
+	uint16_t mask;
+	int span = 0;
+	FILE *out = stdout;
+	int ret = -1;
+
+	if (board->method != UPDATE_V1) {
+		fprintf(stderr, "Monitoring needs a V1 supervisor\n");
+		return -1;
+	}
+
+	if (do_v1_micro_snapshot(board, micro) < 0)
+		return -1;
+
+	/* Only read as far as the highest advertised channel */
+	mask = micro->snap.adc_chan_adv & ((1U << MONITOR_MAX_CHAN) - 1);
+	if (!mask)
+		fprintf(stderr, "Supervisor does not advertise any ADC channels, sampling temperature only\n");
+	while (mask >> span)
+		span++;
+
+	if (cfg->format == MONITOR_SHM) {
+		pub = telemetry_publish_open(cfg->path, 1000000 / cfg->rate_hz);
+		if (!pub)
+			return -1;
+	} else if (cfg->path) {
+		out = fopen(cfg->path, cfg->format == MONITOR_BINARY ? "wb" : "w");
+		if (!out) {
+			perror("Unable to open monitor output");
+			return -1;
+		}
+	}
+	/* Samples go out in bulk, at most once a second */
+	if (out != stdout)
+		setvbuf(out, NULL, _IOFBF, 64 * 1024);
+
+	if (!pub && monitor_write_header(out, cfg, micro->snap.model, mask) < 0)
+		goto err_write;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = monitor_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	next = monitor_clock_ns(CLOCK_MONOTONIC);
+	while (!monitor_stop && (!cfg->count || samples + errors < cfg->count)) {
+		ts.tv_sec = next / 1000000000ULL;
+		ts.tv_nsec = next % 1000000000ULL;
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			continue;
+
+		/*
+		 * The channels and the temperature, in one transaction. Published
+		 * samples carry the identity and inputs too, so that readers never
+		 * need the bus themselves.
+		 */
+		micro_batch_init(&batch, micro);
+		if (pub)
+			micro_batch_peek16(&batch, SUPER_MODEL, low, sizeof(low));
+		if (span)
+			micro_batch_peek16(&batch, SUPER_ADC_BASE, regs, span * sizeof(uint16_t));
+		micro_batch_peek16(&batch, SUPER_TEMPERATURE, &temperature, sizeof(uint16_t));
+		rec.time_ns = monitor_clock_ns(CLOCK_REALTIME);
+		if (micro_batch_run(&batch, 1) < 0) {
+			errors++;
+		} else {
+			rec.temperature = temperature;
+			samples++;
+			if (pub) {
+				monitor_publish(pub, cfg, mask, &rec, low, regs, samples, errors);
+			} else {
+				if (monitor_write_record(out, cfg, mask, &rec, regs) < 0)
+					goto err_write;
+				if (!(samples % cfg->rate_hz))
+					fflush(out);
+			}
+		}
+
+		/* Fell more than a period behind, skip the ones that are gone */
+		next += period;
+		rec.seq++;
+		now = monitor_clock_ns(CLOCK_MONOTONIC);
+		if (now >= next + period) {
+			uint64_t behind = (now - next) / period;
+
+			missed += behind;
+			next += behind * period;
+			rec.seq += behind;
+		}
+	}
+
+	if (fflush(out) != 0)
+		goto err_write;
+
+	fprintf(stderr, "Monitor: %lu samples, %lu read errors, %lu missed periods\n", samples, errors, missed);
+	ret = 0;
+	goto out;
+
+err_write:
+	perror("Unable to write monitor output");
+out:
+	if (out != stdout)
+		fclose(out);
+	telemetry_publish_close(pub);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	return ret;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "micro.h"
+#include "update-shared.h"
+
+/*
+ * Telemetry monitor
+ *
+ * Samples a V1 supervisor's ADC channels and temperature at a fixed rate.
+ * Each sample is one bus transaction, taken on an absolute schedule so the
+ * rate does not drift. A sample that cannot be read is skipped, which shows
+ * up as a gap in the sequence numbers.
+ *
+ * With MONITOR_SHM, each sample also reads the supervisor's identity and
+ * inputs and is published to shared memory rather than written out, see
+ * telemetry.h.
+ */
+enum monitor_format {
+	MONITOR_CSV,
+	MONITOR_BINARY,
+	MONITOR_SHM,
+};
+
+struct monitor_cfg {
+	unsigned int rate_hz;
+	enum monitor_format format;
+	const char *path; /* NULL for stdout, or the segment name for MONITOR_SHM */
+	unsigned long count; /* Samples to take, 0 to run until signalled */
+};
+
+/*
+ * Binary output is a header followed by fixed size records, all little
+ * endian. Each record is a struct monitor_record followed by the raw value
+ * of every channel set in chan_mask, lowest channel first.
+ */
+#define MONITOR_MAGIC "TSMN"
+#define MONITOR_VERSION 1
+
+struct monitor_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t model;
+	uint16_t chan_mask; /* SUPER_ADC_CHAN_ADV, channel n is SUPER_ADC_BASE + n */
+	uint16_t nchan;
+	uint32_t rate_hz;
+} __attribute__((packed));
+
+struct monitor_record {
+	uint64_t time_ns; /* CLOCK_REALTIME when the sample was taken */
+	uint32_t seq; /* Sample period number, counting from 0 */
+	uint16_t temperature; /* Raw SUPER_TEMPERATURE */
+} __attribute__((packed));
+
+void monitor_default_cfg(struct monitor_cfg *cfg);
+int monitor_parse_opts(char *opts, struct monitor_cfg *cfg);
+int monitor_run(board_t *board, micro_t *micro, const struct monitor_cfg *cfg);
@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "micro.h"
+#include "realtime.h"
+
+void realtime_default_cfg(struct realtime_cfg *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->cpu = -1;
+	cfg->spin_us = REALTIME_DEFAULT_SPIN_US;
+}
+
+/*
+ * Parse a comma separated list of settings, e.g. "prio=50,cpu=1,spin=100".
+ * Returns < 0 on an unknown or bad setting, 0 on success.
+ */
+int realtime_parse_opts(char *opts, struct realtime_cfg *cfg)
+{
+	enum { O_PRIO, O_CPU, O_SPIN };
+	char *const tokens[] = {
+		[O_PRIO] = "prio",
+		[O_CPU] = "cpu",
+		[O_SPIN] = "spin",
+		NULL,
+	};
+	char *value;
+	int min = sched_get_priority_min(SCHED_FIFO);
+	int max = sched_get_priority_max(SCHED_FIFO);
+
+	while (*opts != '\0') {
+		int tok = getsubopt(&opts, tokens, &value);
+
+		if (tok < 0) {
+			fprintf(stderr, "Unknown realtime option \"%s\"\n", value);
+			return -1;
+		}
+		if (!value) {
+			fprintf(stderr, "Realtime option \"%s\" needs a value\n", tokens[tok]);
+			return -1;
+		}
+
+		switch (tok) {
+		case O_PRIO:
+			cfg->priority = strtol(value, NULL, 0);
+			if (cfg->priority < min || cfg->priority > max) {
+				fprintf(stderr, "Realtime priority must be %d to %d\n", min, max);
+				return -1;
+			}
+			break;
+		case O_CPU:
+			cfg->cpu = strtol(value, NULL, 0);
+			if (cfg->cpu < 0 || cfg->cpu >= CPU_SETSIZE) {
+				fprintf(stderr, "Bad realtime CPU %s\n", value);
+				return -1;
+			}
+			break;
+		case O_SPIN:
+			cfg->spin_us = strtoul(value, NULL, 0);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Set up the calling process, before any threads are started so that they
+ * inherit it. Returns < 0 if any of it could not be done.
+ */
+int realtime_setup(const struct realtime_cfg *cfg)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+
+	/* No page faults in the middle of a block */
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		perror("Unable to lock memory");
+		return -1;
+	}
+
+	if (cfg->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cfg->cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+			perror("Unable to set CPU affinity");
+			return -1;
+		}
+	}
+
+	if (cfg->priority) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = cfg->priority;
+		if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+			perror("Unable to set SCHED_FIFO");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Have waits on micro's behalf spin out their last cfg->spin_us */
+void realtime_apply(micro_t *micro, const struct realtime_cfg *cfg)
+{
+	micro->realtime = 1;
+	micro->spin_us = cfg->spin_us;
+}
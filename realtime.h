@@ -0,0 +1,26 @@
+#pragma once
+
+#include "micro.h"
+
+/*
+ * Realtime mode
+ *
+ * Every wait in an update is short, and a busy system wakes the updater late
+ * from each of them, which stretches every block. In realtime mode the
+ * process is locked in memory, optionally moved to SCHED_FIFO and pinned to
+ * one CPU, and its handles finish each wait spinning rather than trusting
+ * the scheduler, see micro_sleep_us(). The statistics report how much
+ * longer the waits took than asked for.
+ */
+#define REALTIME_DEFAULT_SPIN_US 200
+
+struct realtime_cfg {
+	int priority; /* SCHED_FIFO priority, 0 leaves the scheduling policy alone */
+	int cpu; /* CPU to run on, -1 for any */
+	unsigned int spin_us; /* How much of each wait to spin rather than sleep */
+};
+
+void realtime_default_cfg(struct realtime_cfg *cfg);
+int realtime_parse_opts(char *opts, struct realtime_cfg *cfg);
+int realtime_setup(const struct realtime_cfg *cfg);
+void realtime_apply(micro_t *micro, const struct realtime_cfg *cfg);
@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "micro.h"
+#include "micro-sim.h"
+#include "update-shared.h"
+#include "update-stats.h"
+#include "update-v0.h"
+#include "update-v1.h"
+#include "update-sm.h"
+#include "update-loop.h"
+#include "targets.h"
+
+static const struct update_ops update_ops_v0 = {
+	.update_start = do_v0_micro_update_start,
+	.get_rev = do_v0_micro_get_rev,
+	.open_image = do_v0_micro_open_image,
+	.probe_footer = do_v0_micro_probe_footer,
+	.snapshot = do_v0_micro_snapshot,
+};
+
+static const struct update_ops update_ops_v1 = {
+	.update_start = do_v1_micro_update_start,
+	.get_rev = do_v1_micro_get_rev,
+	.open_image = do_v1_micro_open_image,
+	.probe_footer = do_v1_micro_probe_footer,
+	.snapshot = do_v1_micro_snapshot,
+};
+
+const struct update_ops *update_ops_get(update_meth_t method)
+{
+	switch (method) {
+	case UPDATE_V0:
+		return &update_ops_v0;
+	case UPDATE_V1:
+		return &update_ops_v1;
+	default:
+		return NULL;
+	}
+}
+
+static void target_msg(struct target *t, FILE *f, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (t->prefix)
+		fprintf(f, "%s: ", t->label);
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Open the bus to the target's supervisor, or a simulation of it if sim is
+ * not NULL. Returns < 0 on failure.
+ */
+int target_open(struct target *t, struct sim_cfg *sim)
+{
+	board_t *board = &t->board;
+
+	t->ops = update_ops_get(board->method);
+	if (!t->ops) {
+		fprintf(stderr, "Unsupported update method\n");
+		return -1;
+	}
+
+	snprintf(t->label, sizeof(t->label), "bus %d chip 0x%02X", board->i2c_bus, board->i2c_chip);
+
+	if (sim) {
+		/* The micro on a carrier reports the carrier's model */
+		sim->method = board->method;
+		sim->modelnum = board->compatible_id ? board->compatible_id : board->modelnum;
+		if (!sim->revision)
+			sim->revision = board->min_rev ? board->min_rev : 1;
+		t->micro = micro_open(&sim_transport, board->i2c_bus, board->i2c_chip, sim);
+	} else {
+		t->micro = micro_init(board->i2c_bus, board->i2c_chip);
+	}
+
+	if (!t->micro) {
+		perror("Unable to open i2c bus");
+		return -1;
+	}
+
+	return 0;
+}
+
+void target_close(struct target *t)
+{
+	micro_close(t->micro);
+	t->micro = NULL;
+}
+
+/*
+ * Compare revisions and, if the target needs it, start its update in t->sm.
+ * Returns < 0 on failure, 1 once started, 0 if there is nothing to update.
+ * Either way the image is left for the caller to close.
+ */
+int target_update_begin(struct target *t, int force, int dry_run)
+{
+	board_t *board = &t->board;
+
+	t->result = TARGET_FAILED;
+	memset(&t->img, 0, sizeof(t->img));
+
+	if (t->ops->get_rev(board, t->micro, &t->micro_revision) < 0)
+		return -1;
+
+	/* The image is mapped and checked once, the update itself only reads it */
+	if (t->ops->open_image(board, &t->img, t->update_path) < 0)
+		return -1;
+	t->update_revision = t->img.revision;
+
+	if (t->micro_revision < board->min_rev) {
+		target_msg(t, stderr, "Microcontroller must be at least rev %d to support in-field updates.\n",
+			   board->min_rev);
+		t->result = TARGET_TOO_OLD;
+		return 0;
+	}
+
+	if ((t->update_revision <= t->micro_revision) && !force) {
+		target_msg(t, stdout, "Already at revision %d, update file is revision %d\n", t->micro_revision,
+			   t->update_revision);
+		t->result = TARGET_CURRENT;
+		return 0;
+	}
+
+	target_msg(t, stdout, "Updating from revision %d to %d\n", t->micro_revision, t->update_revision);
+
+	if (dry_run) {
+		target_msg(t, stdout, "Dry run specified, not updating\n");
+		t->result = TARGET_DRY_RUN;
+		return 0;
+	}
+
+	t->ops->update_start(&t->sm, board, t->micro, &t->img);
+	return 1;
+}
+
+/* The update started by target_update_begin() finished, and returned ret */
+void target_update_end(struct target *t, int ret)
+{
+	stats_report(t->micro);
+	if (ret == 0)
+		t->result = TARGET_UPDATED;
+}
+
+/*
+ * Compare revisions and update the target if needed. Returns non-zero on
+ * failure, the same way the tool exits.
+ */
+int target_update(struct target *t, int force, int dry_run)
+{
+	int ret;
+
+	ret = target_update_begin(t, force, dry_run);
+	if (ret > 0) {
+		ret = update_sm_run(&t->sm);
+		target_update_end(t, ret);
+	}
+	update_image_close(&t->img);
+
+	return ret ? 1 : 0;
+}
+
+void target_print_result(struct target *t)
+{
+	static const char *const results[] = {
+		[TARGET_PENDING] = "not run",
+		[TARGET_UPDATED] = "updated",
+		[TARGET_CURRENT] = "up to date",
+		[TARGET_DRY_RUN] = "would update",
+		[TARGET_TOO_OLD] = "too old to update",
+		[TARGET_FAILED] = "FAILED",
+	};
+
+	printf("%s (0x%04X): %s, revision %d, update revision %d\n", t->label, t->board.modelnum, results[t->result],
+	       t->micro_revision, t->update_revision);
+}
+
+/*
+ * Print what the supervisor reports about itself, all from one snapshot of
+ * its registers. Returns < 0 on failure.
+ */
+int target_print_info(struct target *t, enum info_format format)
+{
+	struct micro_snapshot *snap = &t->micro->snap;
+	board_t *board = &t->board;
+	int v1 = (board->method == UPDATE_V1);
+
+	if (t->ops->snapshot(board, t->micro) < 0)
+		return -1;
+
+	if (format == INFO_JSON) {
+		printf("{\"target\":\"%s\",\"method\":\"%s\"", t->label, v1 ? "v1" : "v0");
+		if (v1) {
+			printf(",\"modelnum\":\"0x%04X\"", snap->model);
+			if (board->compatible_id && (board->compatible_id != snap->model))
+				printf(",\"compatible\":\"0x%04X\"", board->compatible_id);
+			printf(",\"revision\":%d,\"dirty\":%d", snap->revision & 0x7fff, !!(snap->revision & (1 << 15)));
+			printf(",\"features\":\"0x%04X\",\"adc_chan_adv\":\"0x%04X\",\"gen_flags\":\"0x%04X\","
+			       "\"gen_inputs\":\"0x%04X\"",
+			       snap->features, snap->adc_chan_adv, snap->gen_flags, snap->gen_inputs);
+		} else {
+			printf(",\"revision\":%d", snap->revision);
+		}
+		printf("}\n");
+		return 0;
+	}
+
+	if (!v1) {
+		printf("revision=%d\n", snap->revision);
+		return 0;
+	}
+
+	printf("modelnum=0x%04X\n", snap->model);
+	if (board->compatible_id && (board->compatible_id != snap->model))
+		printf("compatible=0x%04X\n", board->compatible_id);
+	printf("revision=%d\n", snap->revision & 0x7fff);
+	printf("dirty=%d\n", !!(snap->revision & (1 << 15)));
+
+	return 0;
+}
+
+/*
+ * Running several updates at once
+ *
+ * Every target's update is a state machine, see update-sm.h. The targets on
+ * one bus all run from one update loop, so while one supervisor is busy with
+ * flash the others get the bus, transaction by transaction. A transaction
+ * holds up its thread for as long as it is on the wire, so every bus gets a
+ * worker thread with its own loop. Progress from all of them is combined
+ * onto one line.
+ */
+struct bus_worker {
+	pthread_t thread;
+	int started;
+	int bus;
+	struct target **targets;
+	int ntargets;
+	int force;
+	int dry_run;
+	int ret;
+};
+
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct target *progress_targets;
+static int progress_ntargets;
+
+static void targets_progress(micro_t *micro, unsigned int done, unsigned int total)
+{
+	struct target *t = micro->progress_arg;
+	unsigned int old_pct, pct;
+	int i;
+
+	pthread_mutex_lock(&progress_lock);
+	old_pct = t->total ? (t->done * 100) / t->total : 0;
+	pct = total ? (done * 100) / total : 0;
+	t->done = done;
+	t->total = total;
+
+	/* Only redraw when something visibly changed */
+	if (pct != old_pct || done == 0) {
+		printf("\r");
+		for (i = 0; i < progress_ntargets; i++) {
+			struct target *p = &progress_targets[i];
+
+			printf("[%s %3u%%] ", p->label, p->total ? (p->done * 100) / p->total : 0);
+		}
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&progress_lock);
+}
+
+static void targets_update_done(struct update_sm *sm, int ret)
+{
+	struct target *t = sm->arg;
+
+	target_update_end(t, ret);
+	update_image_close(&t->img);
+}
+
+static void *bus_worker_fn(void *arg)
+{
+	struct bus_worker *w = arg;
+	struct update_loop loop;
+	struct target *t;
+	int i;
+
+	if (update_loop_init(&loop) < 0) {
+		w->ret = 1;
+		return NULL;
+	}
+
+	for (i = 0; i < w->ntargets; i++) {
+		t = w->targets[i];
+
+		/* Targets without an update are only there to be queried */
+		if (!t->update_path)
+			continue;
+
+		if (target_update_begin(t, w->force, w->dry_run) <= 0) {
+			update_image_close(&t->img);
+			continue;
+		}
+
+		t->sm.done = targets_update_done;
+		t->sm.arg = t;
+		if (update_loop_add(&loop, &t->sm) < 0) {
+			t->result = TARGET_FAILED;
+			update_image_close(&t->img);
+		}
+	}
+
+	if (update_loop_run(&loop) < 0)
+		w->ret = 1;
+	update_loop_close(&loop);
+
+	for (i = 0; i < w->ntargets; i++) {
+		if (w->targets[i]->update_path && w->targets[i]->result == TARGET_FAILED)
+			w->ret = 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Update all targets, in parallel across buses. Returns non-zero if any of
+ * them failed.
+ */
+int targets_update_parallel(struct target *targets, int ntargets, int force, int dry_run)
+{
+	struct bus_worker *workers;
+	int nworkers = 0;
+	int ret = 0;
+	int i, j;
+
+	/*
+	 * A V0 update finishes by resetting the micro, which takes the rest of
+	 * the system with it, so it can't share a run with anything else.
+	 */
+	for (i = 0; i < ntargets && ntargets > 1; i++) {
+		if (targets[i].board.method == UPDATE_V0) {
+			fprintf(stderr, "%s: V0 updates reset the system and must be run on their own\n",
+				targets[i].label);
+			return 1;
+		}
+	}
+
+	workers = calloc(ntargets, sizeof(*workers));
+	if (!workers)
+		return 1;
+
+	for (i = 0; i < ntargets; i++) {
+		for (j = 0; j < nworkers; j++) {
+			if (workers[j].bus == targets[i].board.i2c_bus)
+				break;
+		}
+		if (j == nworkers) {
+			workers[j].bus = targets[i].board.i2c_bus;
+			workers[j].targets = calloc(ntargets, sizeof(struct target *));
+			workers[j].force = force;
+			workers[j].dry_run = dry_run;
+			nworkers++;
+			if (!workers[j].targets) {
+				ret = 1;
+				goto out;
+			}
+		}
+		workers[j].targets[workers[j].ntargets++] = &targets[i];
+
+		targets[i].prefix = 1;
+		targets[i].micro->progress = targets_progress;
+		targets[i].micro->progress_arg = &targets[i];
+	}
+
+	progress_targets = targets;
+	progress_ntargets = ntargets;
+
+	for (j = 0; j < nworkers; j++) {
+		/* If a thread can't be had, do that bus's work here instead */
+		if (pthread_create(&workers[j].thread, NULL, bus_worker_fn, &workers[j]) != 0)
+			bus_worker_fn(&workers[j]);
+		else
+			workers[j].started = 1;
+	}
+
+	for (j = 0; j < nworkers; j++) {
+		if (workers[j].started)
+			pthread_join(workers[j].thread, NULL);
+		if (workers[j].ret)
+			ret = 1;
+	}
+	printf("\n");
+
+out:
+	for (j = 0; j < nworkers; j++)
+		free(workers[j].targets);
+	free(workers);
+
+	return ret;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "micro.h"
+#include "micro-sim.h"
+#include "update-shared.h"
+#include "update-stats.h"
+#include "update-sm.h"
+
+/* Entry points for one update method */
+struct update_ops {
+	/* Set up the update as a state machine, see update-sm.h */
+	void (*update_start)(struct update_sm *sm, board_t *board, micro_t *micro, struct update_image *img);
+	int (*get_rev)(board_t *board, micro_t *micro, int *revision);
+	int (*open_image)(board_t *board, struct update_image *img, char *update_path);
+	/* Quietly, from the end of a file only, see struct update_footer_info */
+	int (*probe_footer)(const uint8_t *tail, size_t tail_len, size_t full_size, struct update_footer_info *info);
+	int (*snapshot)(board_t *board, micro_t *micro); /* Fill in micro->snap */
+};
+
+enum info_format {
+	INFO_TEXT, /* key=value lines */
+	INFO_JSON, /* One object per line */
+};
+
+enum target_result {
+	TARGET_PENDING,
+	TARGET_UPDATED,
+	TARGET_CURRENT, /* Already at or past the update's revision */
+	TARGET_DRY_RUN,
+	TARGET_TOO_OLD, /* Micro is older than the board's min_rev */
+	TARGET_FAILED,
+};
+
+/*
+ * One supervisor to update. Each has its own board description, since the
+ * bus and chip can be overridden per target, and its own bus handle.
+ */
+struct target {
+	board_t board;
+	char *update_path;
+	const struct update_ops *ops;
+	micro_t *micro;
+	struct update_stats stats;
+	struct update_image img; /* While updating */
+	struct update_sm sm;
+	char label[32];
+	int prefix; /* Prefix messages with label, set when updating several */
+
+	int micro_revision;
+	int update_revision;
+	enum target_result result;
+	unsigned int done; /* Progress in bytes */
+	unsigned int total;
+};
+
+const struct update_ops *update_ops_get(update_meth_t method);
+int target_open(struct target *t, struct sim_cfg *sim);
+void target_close(struct target *t);
+int target_update_begin(struct target *t, int force, int dry_run);
+void target_update_end(struct target *t, int ret);
+int target_update(struct target *t, int force, int dry_run);
+int targets_update_parallel(struct target *targets, int ntargets, int force, int dry_run);
+void target_print_result(struct target *t);
+int target_print_info(struct target *t, enum info_format format);
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "telemetry.h"
+
+/* How often a reader retries before deciding the publisher died mid-write */
+#define TELEMETRY_READ_TRIES 10000
+
+struct telemetry {
+	struct telemetry_shm *shm;
+	int fd;
+	char name[64];
+};
+
+/*
+ * Map the segment published under name, read-only. Returns NULL with errno
+ * set if there is none, or it is not one we understand. errno is EAGAIN if
+ * the publisher has not sized it yet, or died before it did.
+ */
+struct telemetry *telemetry_open(const char *name)
+{
+	struct telemetry *t;
+	struct stat st;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->fd = shm_open(name ? name : TELEMETRY_DEFAULT_NAME, O_RDONLY, 0);
+	if (t->fd < 0)
+		goto err_free;
+
+	/* Reading past the end of a short segment is a SIGBUS, not an error */
+	if (fstat(t->fd, &st) < 0)
+		goto err_close;
+	if (st.st_size < (off_t)sizeof(*t->shm)) {
+		errno = EAGAIN;
+		goto err_close;
+	}
+
+	t->shm = mmap(NULL, sizeof(*t->shm), PROT_READ, MAP_SHARED, t->fd, 0);
+	if (t->shm == MAP_FAILED)
+		goto err_close;
+
+	if (t->shm->magic != TELEMETRY_MAGIC || t->shm->version != TELEMETRY_VERSION) {
+		munmap(t->shm, sizeof(*t->shm));
+		errno = EPROTO;
+		goto err_close;
+	}
+
+	return t;
+
+err_close:
+	close(t->fd);
+err_free:
+	free(t);
+	return NULL;
+}
+
+/*
+ * Copy out the latest sample. Returns 0 on success, < 0 with errno EAGAIN if
+ * nothing has been published yet or the publisher stopped partway through.
+ */
+int telemetry_read(struct telemetry *t, struct telemetry_sample *sample)
+{
+	uint32_t before, after;
+	int tries;
+
+	for (tries = 0; tries < TELEMETRY_READ_TRIES; tries++) {
+		before = __atomic_load_n(&t->shm->seq, __ATOMIC_ACQUIRE);
+		if (before & 1)
+			continue;
+
+		memcpy(sample, &t->shm->sample, sizeof(*sample));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&t->shm->seq, __ATOMIC_RELAXED);
+
+		if (before == after) {
+			if (!sample->count)
+				break;
+			return 0;
+		}
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+void telemetry_close(struct telemetry *t)
+{
+	if (!t)
+		return;
+
+	munmap(t->shm, sizeof(*t->shm));
+	close(t->fd);
+	free(t);
+}
+
+/*
+ * Create, or take over, the segment under name and lock it so no second
+ * publisher can share it. Returns NULL on failure, which is printed.
+ */
+struct telemetry *telemetry_publish_open(const char *name, uint32_t period_us)
+{
+	struct telemetry *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	snprintf(t->name, sizeof(t->name), "%s", name ? name : TELEMETRY_DEFAULT_NAME);
+	t->fd = shm_open(t->name, O_RDWR | O_CREAT, 0644);
+	if (t->fd < 0) {
+		perror("Unable to create telemetry segment");
+		goto err_free;
+	}
+
+	if (flock(t->fd, LOCK_EX | LOCK_NB) < 0) {
+		fprintf(stderr, "Telemetry %s is already being published\n", t->name);
+		goto err_close;
+	}
+
+	if (ftruncate(t->fd, sizeof(*t->shm)) < 0) {
+		perror("Unable to size telemetry segment");
+		goto err_close;
+	}
+
+	t->shm = mmap(NULL, sizeof(*t->shm), PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+	if (t->shm == MAP_FAILED) {
+		perror("Unable to map telemetry segment");
+		goto err_close;
+	}
+
+	/* Readers that see the magic before a sample get EAGAIN until one lands */
+	__atomic_store_n(&t->shm->seq, 0, __ATOMIC_RELAXED);
+	memset(&t->shm->sample, 0, sizeof(t->shm->sample));
+	t->shm->sample.period_us = period_us;
+	t->shm->pid = getpid();
+	t->shm->version = TELEMETRY_VERSION;
+	__atomic_store_n(&t->shm->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+	return t;
+
+err_close:
+	close(t->fd);
+err_free:
+	free(t);
+	return NULL;
+}
+
+void telemetry_publish(struct telemetry *t, const struct telemetry_sample *sample)
+{
+	uint32_t seq = t->shm->seq;
+
+	__atomic_store_n(&t->shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&t->shm->sample, sample, sizeof(*sample));
+	__atomic_store_n(&t->shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Stop publishing and remove the segment, readers still mapping it keep the last sample */
+void telemetry_publish_close(struct telemetry *t)
+{
+	if (!t)
+		return;
+
+	munmap(t->shm, sizeof(*t->shm));
+	shm_unlink(t->name);
+	close(t->fd);
+	free(t);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Supervisor telemetry in shared memory
+ *
+ * One process, tssupervisorupdate --monitor=format=shm, reads the supervisor
+ * and publishes the latest sample in a POSIX shared memory segment. Any
+ * number of readers can then pick it up without a syscall or touching the
+ * bus. The sample is guarded by a sequence count that is odd while it is
+ * being written; readers retry until they get a copy the count did not move
+ * under.
+ */
+#define TELEMETRY_DEFAULT_NAME "/tssupervisor"
+#define TELEMETRY_MAGIC 0x54535354 /* "TSST" */
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_ADC_CHANS 16
+
+struct telemetry_sample {
+	uint64_t time_ns; /* CLOCK_REALTIME when the sample was taken */
+	uint64_t count; /* Samples published so far, including this one */
+	uint32_t errors; /* Failed reads since the publisher started */
+	uint32_t period_us; /* How often the publisher samples */
+	uint16_t model;
+	uint16_t revision; /* As read, V1 keeps a dirty flag in bit 15 */
+	uint16_t features;
+	uint16_t gen_flags;
+	uint16_t gen_inputs;
+	uint16_t adc_chan_adv; /* Channel n of adc is valid if bit n is set */
+	uint16_t temperature;
+	uint16_t adc[TELEMETRY_ADC_CHANS];
+};
+
+struct telemetry_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t pid; /* Of the publisher */
+	struct telemetry_sample sample;
+};
+
+struct telemetry;
+
+/* Reading, for consumers */
+struct telemetry *telemetry_open(const char *name);
+int telemetry_read(struct telemetry *t, struct telemetry_sample *sample);
+void telemetry_close(struct telemetry *t);
+
+/* Publishing, only one process per name at a time */
+struct telemetry *telemetry_publish_open(const char *name, uint32_t period_us);
+void telemetry_publish(struct telemetry *t, const struct telemetry_sample *sample);
+void telemetry_publish_close(struct telemetry *t);
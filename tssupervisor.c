@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+#include "micro.h"
+#include "micro-sim.h"
+#include "update-shared.h"
+#include "update-sm.h"
+#include "update-journal.h"
+#include "boards.h"
+#include "targets.h"
+#include "tssupervisor.h"
+
+struct tssupervisor {
+	struct target t;
+	struct sim_cfg sim;
+	tssupervisor_progress_fn progress;
+	void *progress_arg;
+	int updating; /* Started by tssupervisor_update_start() and not finished */
+};
+
+const char *tssupervisor_version(void)
+{
+	return TAG;
+}
+
+static void tssupervisor_progress(micro_t *micro, unsigned int done, unsigned int total)
+{
+	struct tssupervisor *sv = micro->progress_arg;
+
+	if (sv->progress)
+		sv->progress(sv->progress_arg, done, total);
+}
+
+/* Open the bus to board's supervisor, or a simulation of it if sim is not NULL */
+static struct tssupervisor *tssupervisor_open_board(const board_t *board, int bus, int chip, struct sim_cfg *sim)
+{
+	struct tssupervisor *sv;
+
+	if (!board) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	sv = calloc(1, sizeof(*sv));
+	if (!sv)
+		return NULL;
+
+	sv->t.board = *board;
+	if (bus >= 0)
+		sv->t.board.i2c_bus = bus;
+	if (chip >= 0)
+		sv->t.board.i2c_chip = chip;
+	if (sim)
+		sv->sim = *sim;
+
+	if (target_open(&sv->t, sim ? &sv->sim : NULL) < 0) {
+		free(sv);
+		return NULL;
+	}
+
+	/* The library never writes progress to stdout itself */
+	sv->t.micro->progress = tssupervisor_progress;
+	sv->t.micro->progress_arg = sv;
+	sv->t.micro->journal_dir = JOURNAL_DEFAULT_DIR;
+
+	return sv;
+}
+
+/* Open the supervisor of the board we are running on, as the devicetree describes it */
+tssupervisor_t *tssupervisor_probe(void)
+{
+	return tssupervisor_open_board(get_board(), -1, -1, NULL);
+}
+
+/*
+ * Open the supervisor of a board by model, 0 for the board we are running
+ * on. bus and chip override the board's own, unless < 0.
+ */
+tssupervisor_t *tssupervisor_open(uint16_t model, int bus, int chip)
+{
+	return tssupervisor_open_board(model ? get_board_by_model(model) : get_board(), bus, chip, NULL);
+}
+
+/*
+ * Open a simulated supervisor, for testing without one. opts are those of
+ * tssupervisorupdate --simulate.
+ */
+tssupervisor_t *tssupervisor_open_simulated(const char *opts)
+{
+	struct sim_cfg sim;
+	uint16_t model = 0x7250;
+	char *buf;
+	int ret;
+
+	buf = strdup(opts ? opts : "");
+	if (!buf)
+		return NULL;
+
+	sim_default_cfg(&sim);
+	ret = sim_parse_opts(buf, &sim, &model);
+	free(buf);
+	if (ret < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return tssupervisor_open_board(get_board_by_model(model), -1, -1, &sim);
+}
+
+void tssupervisor_close(tssupervisor_t *sv)
+{
+	if (!sv)
+		return;
+
+	if (sv->updating) {
+		journal_close(&sv->t.sm.journal);
+		update_image_close(&sv->t.img);
+	}
+	target_close(&sv->t);
+	free(sv);
+}
+
+/* Read everything the supervisor reports about itself, afresh */
+int tssupervisor_get_info(tssupervisor_t *sv, struct tssupervisor_info *info)
+{
+	struct micro_snapshot *snap = &sv->t.micro->snap;
+	board_t *board = &sv->t.board;
+	int v1 = (board->method == UPDATE_V1);
+
+	snap->valid = 0;
+	if (sv->t.ops->snapshot(board, sv->t.micro) < 0)
+		return -1;
+
+	memset(info, 0, sizeof(*info));
+	info->model = board->modelnum;
+	info->compatible = board->compatible_id;
+	info->method = v1 ? TSSUPERVISOR_METHOD_V1 : TSSUPERVISOR_METHOD_V0;
+	info->bus = board->i2c_bus;
+	info->chip = board->i2c_chip;
+	info->revision = v1 ? (snap->revision & 0x7fff) : snap->revision;
+	if (v1) {
+		info->dirty = !!(snap->revision & (1 << 15));
+		info->micro_model = snap->model;
+		info->features = snap->features;
+		info->adc_chan_adv = snap->adc_chan_adv;
+		info->gen_flags = snap->gen_flags;
+		info->gen_inputs = snap->gen_inputs;
+	}
+
+	return 0;
+}
+
+/* Returns the supervisor's current revision, or < 0 on failure */
+int tssupervisor_get_revision(tssupervisor_t *sv)
+{
+	int revision;
+
+	sv->t.micro->snap.valid = 0;
+	if (sv->t.ops->get_rev(&sv->t.board, sv->t.micro, &revision) < 0)
+		return -1;
+
+	return revision;
+}
+
+/*
+ * Check that the update file at path is a valid update for the handle's
+ * board, without touching the supervisor. image, if not NULL, is filled in
+ * with what the footer says.
+ */
+int tssupervisor_check_image(tssupervisor_t *sv, const char *path, struct tssupervisor_image *image)
+{
+	struct update_image img;
+
+	errno = 0;
+	if (sv->t.ops->open_image(&sv->t.board, &img, (char *)path) < 0) {
+		/* Files that map fine but are not valid updates */
+		if (!errno)
+			errno = EINVAL;
+		return -1;
+	}
+
+	if (image) {
+		memset(image, 0, sizeof(*image));
+		image->model = img.model;
+		image->revision = img.revision;
+		image->size = img.bin_size;
+	}
+	update_image_close(&img);
+
+	return 0;
+}
+
+/*
+ * Where to keep the journal that lets an interrupted update resume, see
+ * update-journal.h. NULL turns it off. dir is not copied.
+ */
+void tssupervisor_set_journal_dir(tssupervisor_t *sv, const char *dir)
+{
+	sv->t.micro->journal_dir = dir;
+}
+
+void tssupervisor_set_progress(tssupervisor_t *sv, tssupervisor_progress_fn fn, void *arg)
+{
+	sv->progress = fn;
+	sv->progress_arg = arg;
+}
+
+/* What a finished update did, as the update calls return it */
+static int tssupervisor_result(struct target *t)
+{
+	switch (t->result) {
+	case TARGET_UPDATED:
+		return TSSUPERVISOR_UPDATED;
+	case TARGET_CURRENT:
+		return TSSUPERVISOR_CURRENT;
+	case TARGET_DRY_RUN:
+		return TSSUPERVISOR_DRY_RUN;
+	case TARGET_TOO_OLD:
+		errno = EOPNOTSUPP;
+		return -1;
+	default:
+		if (!errno)
+			errno = EIO;
+		return -1;
+	}
+}
+
+/*
+ * Update the supervisor from the file at path, if that raises its revision
+ * or flags has TSSUPERVISOR_FORCE. Returns an enum tssupervisor_result, or
+ * < 0 on failure. A V0 update resets the whole system when it is done, so
+ * it only ever returns on failure.
+ */
+int tssupervisor_update(tssupervisor_t *sv, const char *path, int flags)
+{
+	struct target *t = &sv->t;
+
+	if (sv->updating) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	t->update_path = (char *)path;
+	target_update(t, !!(flags & TSSUPERVISOR_FORCE), !!(flags & TSSUPERVISOR_DRY_RUN_ONLY));
+	t->update_path = NULL;
+
+	return tssupervisor_result(t);
+}
+
+/* Start the update tssupervisor_update() would run, see tssupervisor.h */
+int tssupervisor_update_start(tssupervisor_t *sv, const char *path, int flags)
+{
+	struct target *t = &sv->t;
+	int ret;
+
+	if (sv->updating) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	t->update_path = (char *)path;
+	ret = target_update_begin(t, !!(flags & TSSUPERVISOR_FORCE), !!(flags & TSSUPERVISOR_DRY_RUN_ONLY));
+	t->update_path = NULL;
+	if (ret > 0) {
+		sv->updating = 1;
+		return TSSUPERVISOR_IN_PROGRESS;
+	}
+	update_image_close(&t->img);
+
+	return tssupervisor_result(t);
+}
+
+int tssupervisor_update_step(tssupervisor_t *sv)
+{
+	struct target *t = &sv->t;
+	int ret;
+
+	if (!sv->updating) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ret = update_sm_step_timed(&t->sm);
+	if (ret == UPDATE_SM_WAIT)
+		return TSSUPERVISOR_IN_PROGRESS;
+
+	sv->updating = 0;
+	target_update_end(t, ret);
+	update_image_close(&t->img);
+
+	return tssupervisor_result(t);
+}
+
+/* When the update in progress next wants to be stepped, 0 if there is none */
+uint64_t tssupervisor_update_deadline(tssupervisor_t *sv)
+{
+	return sv->updating ? sv->t.sm.deadline_ns : 0;
+}
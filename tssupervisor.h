@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * libtssupervisor
+ *
+ * The supervisor update code as a library, for programs that would rather
+ * keep a supervisor open than run tssupervisorupdate for every query. A
+ * handle is opened once, which finds the board and opens its bus, and can
+ * then be asked for the supervisor's revision, checked against update files,
+ * and updated, as often as needed.
+ *
+ * Functions return < 0 with errno set on failure. Most failures are also
+ * described on stderr, and an update says what it is doing on stdout, the
+ * same way the tool does. Progress only goes to the progress callback.
+ *
+ * This interface is stable: TSSUPERVISOR_API_VERSION only changes if a
+ * function or structure here does, and structures only ever grow into their
+ * reserved space.
+ */
+#define TSSUPERVISOR_API_VERSION 2
+
+#define TSSUPERVISOR_API __attribute__((visibility("default")))
+
+typedef struct tssupervisor tssupervisor_t;
+
+enum tssupervisor_method {
+	TSSUPERVISOR_METHOD_V0,
+	TSSUPERVISOR_METHOD_V1,
+};
+
+/* The board a handle was opened for, and what its supervisor reports */
+struct tssupervisor_info {
+	uint16_t model; /* Of the board */
+	uint16_t compatible; /* Model whose updates the board takes, 0 for its own */
+	int method; /* enum tssupervisor_method */
+	int bus;
+	int chip;
+	int revision;
+	int dirty; /* V1 firmware built from a modified tree */
+	/* V1 only, 0 on V0 */
+	uint16_t micro_model; /* As the supervisor reports it */
+	uint16_t features;
+	uint16_t adc_chan_adv;
+	uint16_t gen_flags;
+	uint16_t gen_inputs;
+	uint32_t reserved[8];
+};
+
+/* An update file that has been checked against a handle's board */
+struct tssupervisor_image {
+	uint16_t model; /* From the footer, 0 if it does not carry one */
+	int revision;
+	uint32_t size; /* Of the update proper, without the footer */
+	uint32_t reserved[8];
+};
+
+/* What tssupervisor_update() did, when it did not fail */
+enum tssupervisor_result {
+	TSSUPERVISOR_UPDATED = 0,
+	TSSUPERVISOR_CURRENT = 1, /* Already at or past the update's revision */
+	TSSUPERVISOR_DRY_RUN = 2,
+	TSSUPERVISOR_IN_PROGRESS = 3, /* Non-blocking update still running, see tssupervisor_update_start() */
+};
+
+/* Flags for tssupervisor_update() */
+#define TSSUPERVISOR_FORCE (1 << 0) /* Update even if the revision would not go up */
+#define TSSUPERVISOR_DRY_RUN_ONLY (1 << 1) /* Check everything, but do not update */
+
+/* Called as the update goes, done of total bytes written */
+typedef void (*tssupervisor_progress_fn)(void *arg, unsigned int done, unsigned int total);
+
+TSSUPERVISOR_API const char *tssupervisor_version(void);
+
+TSSUPERVISOR_API tssupervisor_t *tssupervisor_probe(void);
+TSSUPERVISOR_API tssupervisor_t *tssupervisor_open(uint16_t model, int bus, int chip);
+TSSUPERVISOR_API tssupervisor_t *tssupervisor_open_simulated(const char *opts);
+TSSUPERVISOR_API void tssupervisor_close(tssupervisor_t *sv);
+
+TSSUPERVISOR_API int tssupervisor_get_info(tssupervisor_t *sv, struct tssupervisor_info *info);
+TSSUPERVISOR_API int tssupervisor_get_revision(tssupervisor_t *sv);
+TSSUPERVISOR_API int tssupervisor_check_image(tssupervisor_t *sv, const char *path, struct tssupervisor_image *image);
+
+TSSUPERVISOR_API void tssupervisor_set_journal_dir(tssupervisor_t *sv, const char *dir);
+TSSUPERVISOR_API void tssupervisor_set_progress(tssupervisor_t *sv, tssupervisor_progress_fn fn, void *arg);
+TSSUPERVISOR_API int tssupervisor_update(tssupervisor_t *sv, const char *path, int flags);
+
+/*
+ * The same update without blocking, for programs with their own event loop.
+ * tssupervisor_update_start() checks the update and starts it, returning
+ * TSSUPERVISOR_IN_PROGRESS if there is one to run and otherwise what
+ * tssupervisor_update() would. While it runs, call tssupervisor_update_step()
+ * once CLOCK_MONOTONIC reaches tssupervisor_update_deadline(), in ns, e.g.
+ * from a timerfd armed with TFD_TIMER_ABSTIME. Each step does the bus
+ * transactions that are due, never sleeps, and returns TSSUPERVISOR_IN_PROGRESS
+ * until the update has finished, then its result. Stepped early it does
+ * nothing. Closing the handle abandons an update in progress.
+ */
+TSSUPERVISOR_API int tssupervisor_update_start(tssupervisor_t *sv, const char *path, int flags);
+TSSUPERVISOR_API int tssupervisor_update_step(tssupervisor_t *sv);
+TSSUPERVISOR_API uint64_t tssupervisor_update_deadline(tssupervisor_t *sv);
@@ -12,99 +12,109 @@
 #include <getopt.h>
 
 #include "micro.h"
+#include "micro-sim.h"
+#include "update-stats.h"
 #include "update-v0.h"
 #include "update-v1.h"
+#include "targets.h"
+#include "monitor.h"
+#include "update-journal.h"
+#include "realtime.h"
+#include "boards.h"
+#include "board-db.h"
+#include "catalog.h"
+#include "bundle.h"
+#include "update-lz.h"
 
-board_t boards[] = {
-	{
-		.compatible = "technologic,imx6q-ts7970",
-		.i2c_bus = 0,
-		.i2c_chip = 0x10,
-		.modelnum = 0x7970,
-		.min_rev = 7,
-		.method = UPDATE_V0,
-	},
-	{
-		.compatible = "technologic,imx6dl-ts7970",
-		.i2c_bus = 0,
-		.i2c_chip = 0x10,
-		.modelnum = 0x7970,
-		.min_rev = 7,
-		.method = UPDATE_V0,
-	},
-	{
-		.compatible = "fsl,imx6q-ts7970", /* Legacy < 4.9.x kernels */
-		.i2c_bus = 0,
-		.i2c_chip = 0x10,
-		.modelnum = 0x7970,
-		.min_rev = 7,
-		.method = UPDATE_V0,
-	},
-	{
-		.compatible = "fsl,imx6dl-ts7970", /* Legacy < 4.9.x kernels */
-		.i2c_bus = 0,
-		.i2c_chip = 0x10,
-		.modelnum = 0x7970,
-		.min_rev = 7,
-		.method = UPDATE_V0,
-	},
-	{
-		.compatible = "technologic,ts7250v3",
-		.i2c_bus = 0,
-		.i2c_chip = 0x10,
-		.modelnum = 0x7250,
-		.method = UPDATE_V1,
-	},
-	{
-		.compatible = "technologic,ts4300",
-		.modelnum = 0x4300,
-		.compatible_id = 0x9370,
-		.i2c_bus = 3,
-		.i2c_chip = 0x54,
-		.method = UPDATE_V1,
-	},
-	{
-		.compatible = "technologic,ts9370",
-		.modelnum = 0x9370,
-		.compatible_id = 0x9370,
-		.i2c_bus = 3,
-		.i2c_chip = 0x54,
-		.method = UPDATE_V1,
-	},
-	{
-		.compatible = "technologic,ts9390",
-		.modelnum = 0x9390,
-		.compatible_id = 0x9370,
-		.i2c_bus = 3,
-		.i2c_chip = 0x54,
-		.method = UPDATE_V1,
-	},
-};
-
-board_t *get_board()
+#define MAX_TARGETS 16
+
+/*
+ * Fill in a target from a comma separated list of settings, starting from
+ * the detected board. Returns < 0 on failure.
+ */
+static int parse_target(char *opts, board_t *board, struct target *t)
 {
-	FILE *file;
-	char comp[256];
+	enum { O_BUS, O_CHIP, O_MODEL, O_UPDATE };
+	char *const tokens[] = {
+		[O_BUS] = "bus",
+		[O_CHIP] = "chip",
+		[O_MODEL] = "model",
+		[O_UPDATE] = "update",
+		NULL,
+	};
+	char *value;
+	int bus = -1;
+	int chip = -1;
+
+	if (board)
+		t->board = *board;
+
+	while (*opts != '\0') {
+		int tok = getsubopt(&opts, tokens, &value);
 
-	file = fopen("/sys/firmware/devicetree/base/compatible", "r");
-	if (!file) {
-		perror("Unable to open /sys/firmware/devicetree/base/compatible");
-		return NULL;
+		if (tok < 0) {
+			fprintf(stderr, "Unknown target option \"%s\"\n", value);
+			return -1;
+		}
+		if (!value) {
+			fprintf(stderr, "Target option \"%s\" needs a value\n", tokens[tok]);
+			return -1;
+		}
+
+		switch (tok) {
+		case O_BUS:
+			bus = strtoul(value, NULL, 0);
+			break;
+		case O_CHIP:
+			chip = strtoul(value, NULL, 0);
+			break;
+		case O_MODEL:
+			board = get_board_by_model(strtoul(value, NULL, 0));
+			if (!board) {
+				fprintf(stderr, "Unsupported model \"%s\"\n", value);
+				return -1;
+			}
+			t->board = *board;
+			break;
+		case O_UPDATE:
+			t->update_path = value;
+			break;
+		}
 	}
 
-	if (fgets(comp, sizeof(comp), file) == NULL) {
-		perror("Failed to read compatible string");
-		fclose(file);
-		return NULL;
+	if (!board) {
+		fprintf(stderr, "Target needs a model on an unsupported board\n");
+		return -1;
 	}
-	fclose(file);
 
-	for (int i = 0; i < (int)(sizeof(boards) / sizeof(boards[0])); i++) {
-		if (strstr(comp, boards[i].compatible) != NULL) {
-			return &boards[i];
-		}
+	/* Applied last so they win over the model's defaults regardless of order */
+	if (bus != -1)
+		t->board.i2c_bus = bus;
+	if (chip != -1)
+		t->board.i2c_chip = chip;
+
+	return 0;
+}
+
+/*
+ * Point a target without an update file at the newest one for its board in
+ * the catalog. Returns < 0 if there is none.
+ */
+static int catalog_fill_target(struct catalog *cat, struct target *t)
+{
+	const struct catalog_entry *e;
+
+	if (t->update_path)
+		return 0;
+
+	t->update_path = (char *)catalog_pick(cat, &t->board, &e);
+	if (!t->update_path) {
+		printf("No update for the %04X in %s\n", t->board.modelnum, cat->dir);
+		return -1;
 	}
-	return NULL;
+	printf("Using %s, revision %d, for the %04X\n", t->update_path, e->revision, t->board.modelnum);
+
+	return 0;
 }
 
 void usage(char **argv)
@@ -113,14 +123,58 @@ void usage(char **argv)
 		"Usage: %s [OPTION] ...\n"
 		"embeddedTS supervisory microcontroller update utility\n"
 		"\n"
-		"  -i, --info             Print current revision information and close\n"
+		"  -i, --info[=json]      Print current revision information and close, as\n"
+		"                         key=value lines or one line of JSON per supervisor\n"
 		"  -f, --force            Update even if revisions match (not recommended).\n"
 		"                         Requires -u.\n"
 		"  -n, --dry-run          Check file and current revision, prints the changes\n"
 		"                         it would make but does not update.  Requires -u.\n"
 		"  -u, --update <file>    Update file.\n"
+		"  -C, --catalog <dir>    Update from the newest file in dir for each\n"
+		"                         supervisor's model, for those without -u.\n"
+		"                         What the files are is indexed in the journal\n"
+		"                         directory, so only new files are read again.\n"
+		"  -B, --make-bundle <out> <file>...\n"
+		"                         Write the update files to out as one bundle,\n"
+		"                         which -u then takes on any board in it.\n"
+		"  -z, --compress <out> <file>\n"
+		"                         Write the update file to out compressed, which\n"
+		"                         -u takes as it is.\n"
+		"  -d, --board-db <file>  Take the boards from file, default\n"
+		"                         " BOARD_DB_PATH ",\n"
+		"                         or the built-in ones if there is none.\n"
+		"  -D, --make-board-db <out> <list>\n"
+		"                         Write the boards in list to out as a board\n"
+		"                         database, see the README.\n"
 		"  -b, --bus              Override default i2c bus\n"
 		"  -c, --chip-addr        Override default i2c chip address\n"
+		"  -t, --target <opts>    Update the supervisor described by opts, a comma\n"
+		"                         separated list of bus=, chip=, model= and\n"
+		"                         update= settings. May be given more than once;\n"
+		"                         all supervisors given update at once.\n"
+		"                         Unset settings come from the detected board and -u.\n"
+		"  -s, --stats[=json]     Print update timing statistics when done, as\n"
+		"                         text or as a single line of JSON\n"
+		"  -S, --simulate <opts>  Talk to a simulated supervisor instead of i2c.\n"
+		"                         opts is a comma separated list of model=,\n"
+		"                         rev=, features=, xblock=, khz=, xfer=, erase=,\n"
+		"                         decrypt=, program=, kept=, cut=, corrupt=, and\n"
+		"                         drop= settings, times in microseconds.\n"
+		"  -j, --journal <dir>    Where to keep the journals that let an interrupted\n"
+		"                         update resume, default " JOURNAL_DEFAULT_DIR "\n"
+		"  -m, --monitor[=opts]   Sample the ADC channels and temperature until\n"
+		"                         interrupted. opts is a comma separated list of\n"
+		"                         rate= (Hz, default 10), format=csv|bin|shm, out=\n"
+		"                         (file, default stdout) and count= settings.\n"
+		"                         format=shm publishes the latest sample in shared\n"
+		"                         memory instead, out= naming the segment (default\n"
+		"                         /tssupervisor), see telemetry.h.\n"
+		"  -r, --realtime[=opts]  Lock memory and finish each wait spinning rather\n"
+		"                         than trusting the scheduler to wake on time.\n"
+		"                         opts is a comma separated list of prio=\n"
+		"                         (SCHED_FIFO priority), cpu= (CPU to pin to),\n"
+		"                         and spin= (us of each wait to spin, default\n"
+		"                         200) settings.\n"
 		"  -v, --version          Print version\n"
 		"  -h, --help             This message\n"
 		"\n",
@@ -131,35 +185,67 @@ int main(int argc, char *argv[])
 {
 	int option_index = 0;
 	board_t *board;
-	int update_revision;
-	int micro_revision;
-	int i2cfd;
-	int ret;
+	struct target targets[MAX_TARGETS] = { 0 };
+	char *target_opts[MAX_TARGETS];
+	int ntargets = 0;
+	struct sim_cfg sim_cfg;
+	uint16_t sim_model = 0x7250;
+	int ret = 0;
 	int c;
+	int i;
 
 	int dry_run_flag = 0;
 	int force_flag = 0;
 	int info_flag = 0;
+	char *monitor_opts = NULL;
+	int monitor_flag = 0;
+	struct monitor_cfg monitor_cfg;
+	enum info_format info_format = INFO_TEXT;
 	char *update_path = 0;
+	char *catalog_dir = NULL;
+	char *bundle_path = NULL;
+	char *compress_path = NULL;
+	char *board_db_path = NULL;
+	char *make_board_db_path = NULL;
+	struct catalog catalog = { 0 };
 	int opt_bus = -1;
 	int opt_chip_addr = -1;
+	char *sim_opts = NULL;
+	const char *journal_dir = JOURNAL_DEFAULT_DIR;
+	char *realtime_opts = NULL;
+	int realtime_flag = 0;
+	struct realtime_cfg realtime_cfg;
+	int stats_flag = 0;
+	enum stats_format stats_format = STATS_TEXT;
 
 	if (argc < 2) {
 		usage(argv);
 		return 1;
 	}
 
-	static struct option long_options[] = { { "info", no_argument, NULL, 'i' },
+	static struct option long_options[] = { { "info", optional_argument, NULL, 'i' },
 						{ "force", no_argument, NULL, 'f' },
 						{ "update", required_argument, NULL, 'u' },
+						{ "catalog", required_argument, NULL, 'C' },
+						{ "make-bundle", required_argument, NULL, 'B' },
+						{ "compress", required_argument, NULL, 'z' },
+						{ "board-db", required_argument, NULL, 'd' },
+						{ "make-board-db", required_argument, NULL, 'D' },
 						{ "dry-run", no_argument, NULL, 'n' },
 						{ "chip-addr", required_argument, NULL, 'c' },
 						{ "bus", required_argument, NULL, 'b' },
+						{ "target", required_argument, NULL, 't' },
+						{ "simulate", required_argument, NULL, 'S' },
+						{ "stats", optional_argument, NULL, 's' },
+						{ "monitor", optional_argument, NULL, 'm' },
+						{ "journal", required_argument, NULL, 'j' },
+						{ "realtime", optional_argument, NULL, 'r' },
 						{ "version", no_argument, NULL, 'v' },
 						{ "help", no_argument, NULL, 'h' },
 						{ 0, 0, 0, 0 } };
 
-	while ((c = getopt_long(argc, argv, "u:nihfc:b:v", long_options, &option_index)) != -1) {
+	while ((c = getopt_long(argc, argv, "u:C:B:z:d:D:ni::hfc:b:t:S:s::m::j:r::v", long_options,
+				&option_index)) != -1) {
 		switch (c) {
 		case 'f':
 			force_flag = 1;
@@ -169,6 +255,12 @@ int main(int argc, char *argv[])
 			return 0;
 		case 'i':
 			info_flag = 1;
+			if (optarg && !strcmp(optarg, "json")) {
+				info_format = INFO_JSON;
+			} else if (optarg && strcmp(optarg, "text")) {
+				printf("Unknown info format \"%s\"\n", optarg);
+				return 1;
+			}
 			break;
 		case 'n':
 			dry_run_flag = 1;
@@ -182,6 +274,51 @@ int main(int argc, char *argv[])
 		case 'u':
 			update_path = optarg;
 			break;
+		case 'C':
+			catalog_dir = optarg;
+			break;
+		case 'B':
+			bundle_path = optarg;
+			break;
+		case 'z':
+			compress_path = optarg;
+			break;
+		case 'd':
+			board_db_path = optarg;
+			break;
+		case 'D':
+			make_board_db_path = optarg;
+			break;
+		case 't':
+			if (ntargets == MAX_TARGETS) {
+				printf("At most %d targets are supported\n", MAX_TARGETS);
+				return 1;
+			}
+			target_opts[ntargets++] = optarg;
+			break;
+		case 'S':
+			sim_opts = optarg;
+			break;
+		case 's':
+			stats_flag = 1;
+			if (optarg && !strcmp(optarg, "json")) {
+				stats_format = STATS_JSON;
+			} else if (optarg && strcmp(optarg, "text")) {
+				printf("Unknown stats format \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
+		case 'm':
+			monitor_flag = 1;
+			monitor_opts = optarg;
+			break;
+		case 'j':
+			journal_dir = optarg;
+			break;
+		case 'r':
+			realtime_flag = 1;
+			realtime_opts = optarg;
+			break;
 		case 'v':
 			printf("tssupervisorupdate %s\n", TAG);
 			return 0;
@@ -192,90 +329,155 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if ((dry_run_flag || force_flag) && update_path == NULL) {
-		printf("Must specify the update file\n");
+	/* Nothing to do with a supervisor */
+	if (make_board_db_path) {
+		if (argc - optind != 1) {
+			printf("Must specify one board list\n");
+			return 1;
+		}
+		return (board_db_create(make_board_db_path, argv[optind]) < 0) ? 1 : 0;
+	}
+	/* Bundles are indexed by the boards known, so this comes first */
+	if (board_db_path && boards_use_db(board_db_path) < 0)
 		return 1;
+	if (bundle_path)
+		return (bundle_create(bundle_path, &argv[optind], argc - optind) < 0) ? 1 : 0;
+	if (compress_path) {
+		if (argc - optind != 1) {
+			printf("Must specify one update file to compress\n");
+			return 1;
+		}
+		return (lz_compress_file(compress_path, argv[optind]) < 0) ? 1 : 0;
 	}
 
-	board = get_board();
-	if (!board) {
-		printf("Unsupported board\n");
+	if ((dry_run_flag || force_flag) && update_path == NULL && !catalog_dir && !ntargets) {
+		printf("Must specify the update file\n");
 		return 1;
 	}
 
-	if (opt_chip_addr != -1)
-		board->i2c_chip = opt_chip_addr;
-
-	if (opt_bus != -1)
-		board->i2c_bus = opt_bus;
-
-	int (*update_func)(board_t * board, int i2cfd, char *update_path) = NULL;
-	int (*get_rev_func)(board_t * board, int i2cfd, int *revision) = NULL;
-	int (*get_update_rev_func)(board_t * board, int *revision, char *update_path) = NULL;
-	int (*print_micro_info_func)(board_t * board, int i2cfd) = NULL;
-
-	switch (board->method) {
-	case UPDATE_V0:
-		update_func = do_v0_micro_update;
-		get_rev_func = do_v0_micro_get_rev;
-		get_update_rev_func = do_v0_micro_get_file_rev;
-		print_micro_info_func = do_v0_micro_print_info;
-		break;
-
-	case UPDATE_V1:
-		update_func = do_v1_micro_update;
-		get_rev_func = do_v1_micro_get_rev;
-		get_update_rev_func = do_v1_micro_get_file_rev;
-		print_micro_info_func = do_v1_micro_print_info;
-		break;
-
-	default:
-		fprintf(stderr, "Unsupported update method\n");
+	monitor_default_cfg(&monitor_cfg);
+	if (monitor_opts && monitor_parse_opts(monitor_opts, &monitor_cfg) < 0)
 		return 1;
-	}
 
-	i2cfd = micro_init(board->i2c_bus, board->i2c_chip);
-	if (i2cfd < 0) {
-		perror("Unable to open i2c bus");
+	realtime_default_cfg(&realtime_cfg);
+	if (realtime_opts && realtime_parse_opts(realtime_opts, &realtime_cfg) < 0)
 		return 1;
+
+	if (sim_opts) {
+		sim_default_cfg(&sim_cfg);
+		if (sim_parse_opts(sim_opts, &sim_cfg, &sim_model) < 0)
+			return 1;
+		board = get_board_by_model(sim_model);
+	} else {
+		board = get_board();
 	}
 
-	if (info_flag) {
-		if (print_micro_info_func(board, i2cfd) < 0)
+	if (catalog_dir) {
+		if (catalog_scan(&catalog, catalog_dir, journal_dir) < 0)
 			return 1;
+		printf("Cataloged %u update files in %s, read %u\n", catalog.nentries, catalog_dir, catalog.read);
 	}
 
-	if (update_path) {
-		if (get_rev_func(board, i2cfd, &micro_revision) < 0)
+	if (ntargets) {
+		for (i = 0; i < ntargets; i++) {
+			targets[i].update_path = update_path;
+			if (parse_target(target_opts[i], board, &targets[i]) < 0)
+				return 1;
+			if (catalog_dir && catalog_fill_target(&catalog, &targets[i]) < 0)
+				return 1;
+			if ((dry_run_flag || force_flag) && targets[i].update_path == NULL) {
+				printf("Must specify the update file\n");
+				return 1;
+			}
+		}
+	} else {
+		if (!board) {
+			printf("Unsupported board\n");
 			return 1;
+		}
 
-		if (get_update_rev_func(board, &update_revision, update_path) < 0)
+		targets[0].board = *board;
+		targets[0].update_path = update_path;
+		if (opt_chip_addr != -1)
+			targets[0].board.i2c_chip = opt_chip_addr;
+
+		if (opt_bus != -1)
+			targets[0].board.i2c_bus = opt_bus;
+		ntargets = 1;
+
+		if (catalog_dir && catalog_fill_target(&catalog, &targets[0]) < 0)
 			return 1;
+	}
 
-		if (micro_revision < board->min_rev) {
-			fprintf(stderr, "Microcontroller must be at least rev %d to support in-field updates.\n",
-				board->min_rev);
-			return 0;
-		}
+	/* Before any update threads are started, they inherit it */
+	if (realtime_flag && realtime_setup(&realtime_cfg) < 0)
+		return 1;
 
-		if ((update_revision <= micro_revision) && !force_flag) {
-			printf("Already at revision %d, update file is revision %d\n", micro_revision, update_revision);
-			return 0;
+	for (i = 0; i < ntargets; i++) {
+		/* Every simulated target gets its own copy of the settings */
+		struct sim_cfg target_sim_cfg = sim_cfg;
+
+		if (target_open(&targets[i], sim_opts ? &target_sim_cfg : NULL) < 0)
+			return 1;
+		targets[i].micro->journal_dir = journal_dir;
+		if (realtime_flag)
+			realtime_apply(targets[i].micro, &realtime_cfg);
+
+		if (stats_flag) {
+			/* Several targets print their statistics after all are done */
+			stats_init(&targets[i].stats, stats_format, stdout);
+			targets[i].stats.reported = (ntargets > 1);
+			targets[i].micro->stats = &targets[i].stats;
 		}
+	}
 
-		printf("Updating from revision %d to %d\n", micro_revision, update_revision);
+	if (info_flag) {
+		for (i = 0; i < ntargets; i++) {
+			if (ntargets > 1 && info_format == INFO_TEXT)
+				printf("[%s]\n", targets[i].label);
+			if (target_print_info(&targets[i], info_format) < 0)
+				return 1;
+		}
+	}
 
-		if (dry_run_flag) {
-			printf("Dry run specified, not updating\n");
-			return 0;
+	if (monitor_flag) {
+		if (ntargets > 1 || update_path) {
+			printf("--monitor takes one supervisor and no update\n");
+			ret = 1;
+		} else if (monitor_run(&targets[0].board, targets[0].micro, &monitor_cfg) < 0) {
+			ret = 1;
+		}
+	} else if (ntargets == 1) {
+		if (targets[0].update_path) {
+			ret = target_update(&targets[0], force_flag, dry_run_flag);
+			if (ret != 0)
+				return ret;
 		}
+	} else {
+		for (i = 0; i < ntargets; i++) {
+			if (targets[i].update_path)
+				break;
+		}
+
+		if (i < ntargets) {
+			ret = targets_update_parallel(targets, ntargets, force_flag, dry_run_flag);
 
-		ret = update_func(board, i2cfd, update_path);
-		if (ret != 0)
-			return ret;
+			for (i = 0; i < ntargets; i++) {
+				if (!targets[i].update_path)
+					continue;
+				if (stats_flag) {
+					printf("[%s]\n", targets[i].label);
+					targets[i].stats.reported = 0;
+					stats_report(targets[i].micro);
+				}
+				target_print_result(&targets[i]);
+			}
+		}
 	}
 
-	close(i2cfd);
+	for (i = 0; i < ntargets; i++)
+		target_close(&targets[i]);
+	catalog_close(&catalog);
 
-	return 0;
+	return ret;
 }
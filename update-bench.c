@@ -0,0 +1,344 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "micro.h"
+#include "micro-sim.h"
+#include "update-shared.h"
+#include "update-stats.h"
+#include "update-lz.h"
+#include "update-v0.h"
+#include "update-v1.h"
+
+/*
+ * End to end update benchmark
+ *
+ * Runs the real update code for either method against the simulated
+ * supervisor and reports how long it took and where the time went. The
+ * updater's own output is discarded so only the results are printed. With
+ * --compare it also runs against a micro with other features, and fails if
+ * the features under test cost more bus transactions per block.
+ */
+
+static board_t bench_boards[] = {
+	[UPDATE_V0] = {
+		.compatible = "bench,v0",
+		.i2c_bus = 0,
+		.i2c_chip = 0x10,
+		.modelnum = 0x7970,
+		.min_rev = 7,
+		.method = UPDATE_V0,
+	},
+	[UPDATE_V1] = {
+		.compatible = "bench,v1",
+		.i2c_bus = 0,
+		.i2c_chip = 0x10,
+		.modelnum = 0x7250,
+		.method = UPDATE_V1,
+	},
+};
+
+/*
+ * Write out a random image with a valid footer for the given board. The
+ * path is returned in path, the image contents in *image. A compressible
+ * image repeats earlier bytes about as often as real firmware does.
+ */
+static int make_image(board_t *board, unsigned int blocks, uint16_t revision, int compressible, char *path,
+		      uint8_t **image)
+{
+	uint32_t bin_size = blocks * 128;
+	uint8_t ftr[22];
+	int ftr_sz;
+	unsigned int i, dist, run;
+	int fd;
+
+	*image = malloc(bin_size);
+	if (!*image)
+		return -1;
+
+	srand(blocks);
+	for (i = 0; i < bin_size; i++) {
+		/* Runs of 4 to 19 bytes from up to 1 KiB back, half the time */
+		if (compressible && i >= 1024 && rand() % 2) {
+			dist = 1 + rand() % 1024;
+			for (run = 4 + rand() % 16; run && i < bin_size; run--, i++)
+				(*image)[i] = (*image)[i - dist];
+			i--;
+		} else {
+			(*image)[i] = rand();
+		}
+	}
+
+	memcpy(&ftr[0], &bin_size, 4);
+	if (board->method == UPDATE_V0) {
+		ftr[4] = revision;
+		ftr[5] = 0;
+		ftr[6] = 0;
+		ftr[7] = 0;
+		memcpy(&ftr[8], "TS_UC_RA4M2", 11);
+		ftr_sz = 19;
+	} else {
+		memcpy(&ftr[4], &board->modelnum, 2);
+		memcpy(&ftr[6], &revision, 2);
+		ftr[8] = 0;
+		ftr[9] = 0;
+		ftr[10] = 1;
+		memcpy(&ftr[11], "TS_UC_RA4M2", 11);
+		ftr_sz = 22;
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("Unable to create update image");
+		return -1;
+	}
+
+	if (write(fd, *image, bin_size) != (ssize_t)bin_size || write(fd, ftr, ftr_sz) != ftr_sz) {
+		perror("Unable to write update image");
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/* Returns < 0 if the update failed, with the transactions it took per block in *per_block */
+static int run_one(board_t *board, struct sim_cfg *cfg, const char *path, const uint8_t *image, uint32_t bin_size,
+		   double *per_block)
+{
+	struct update_stats stats;
+	struct sim_state state;
+	struct update_image img;
+	micro_t *micro;
+	uint64_t start, wall;
+	unsigned int blocks = bin_size / 128;
+	int stdout_fd;
+	int devnull;
+	int ok;
+	int ret;
+
+	micro = micro_open(&sim_transport, board->i2c_bus, board->i2c_chip, cfg);
+	if (!micro) {
+		fprintf(stderr, "Unable to open simulated supervisor\n");
+		return -1;
+	}
+	/* Only for the prepare time, a report goes with the rest of the output */
+	stats_init(&stats, STATS_TEXT, stdout);
+	micro->stats = &stats;
+
+	/* Keep the progress output out of the results */
+	fflush(stdout);
+	stdout_fd = dup(STDOUT_FILENO);
+	devnull = open("/dev/null", O_WRONLY);
+	if (stdout_fd < 0 || devnull < 0) {
+		perror("Unable to redirect stdout");
+		micro_close(micro);
+		return -1;
+	}
+	dup2(devnull, STDOUT_FILENO);
+	close(devnull);
+
+	start = micro_now_ns();
+	if (board->method == UPDATE_V0)
+		ret = do_v0_micro_open_image(board, &img, (char *)path);
+	else
+		ret = do_v1_micro_open_image(board, &img, (char *)path);
+	if (ret == 0) {
+		if (board->method == UPDATE_V0)
+			ret = do_v0_micro_update(board, micro, &img);
+		else
+			ret = do_v1_micro_update(board, micro, &img);
+		update_image_close(&img);
+	}
+	wall = micro_now_ns() - start;
+
+	fflush(stdout);
+	dup2(stdout_fd, STDOUT_FILENO);
+	close(stdout_fd);
+
+	/*
+	 * A V0 update never returns success, the micro is reset and takes the
+	 * rest of the system with it. Judge it by what the micro received.
+	 */
+	sim_get_state(micro, &state);
+	ok = (state.fl_written == bin_size) && !memcmp(state.flash, image, bin_size);
+	if (board->method == UPDATE_V0)
+		ok = ok && (state.resets == 1);
+	else
+		ok = ok && (ret == 0) && (state.flash_flags & SUPER_UPDATE_ON_REBOOT);
+
+	printf("%s %4u kHz decrypt %5u us program %4u us features 0x%04X: %u blocks in %.3f s, %.1f blocks/s, "
+	       "%.2f transfers/block, transfer %.3f s, sleep %.3f s, prepare %.3f ms in %.3f ms open wait%s\n",
+	       board->method == UPDATE_V0 ? "v0" : "v1", cfg->bus_khz, cfg->decrypt_us, cfg->program_us,
+	       cfg->features, blocks, wall / 1e9, blocks / (wall / 1e9), (double)micro->counters.transfers / blocks,
+	       micro->counters.xfer_ns / 1e9, micro->counters.sleep_ns / 1e9, stats.prep_us / 1e3,
+	       stats.open_wait.elapsed_us / 1e3, ok ? "" : " FAILED");
+
+	*per_block = (double)micro->counters.transfers / blocks;
+	micro_close(micro);
+
+	return ok ? 0 : -1;
+}
+
+static void usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTION] ...\n"
+		"Benchmark supervisor updates against a simulated supervisor\n"
+		"\n"
+		"  -m, --method <v0|v1>   Update method (default v1)\n"
+		"  -k, --khz <n>          Bus clock in kHz (default 100)\n"
+		"  -d, --decrypt <us>     Per-block decrypt time\n"
+		"  -p, --program <us>     Per-block flash program time\n"
+		"  -e, --erase <us>       Flash open and erase time\n"
+		"  -x, --xfer <us>        Fixed cost per bus transaction\n"
+		"  -f, --features <n>     SUPER_FEATURES0 the simulated micro reports\n"
+		"  -X, --xblock <n>       Largest block in bytes with SUPER_FEAT_XBLOCK\n"
+		"  -n, --blocks <n>       Size of the update in 128-byte blocks (default 128)\n"
+		"  -r, --runs <n>         Number of times to run (default 1)\n"
+		"  -z, --compress         Update from a compressed image, see update-lz.h\n"
+		"  -c, --compare <n>      Also run with these features, fail if they need fewer transfers per block\n"
+		"  -h, --help             This message\n"
+		"\n",
+		argv[0]);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct option long_options[] = { { "method", required_argument, NULL, 'm' },
+						{ "khz", required_argument, NULL, 'k' },
+						{ "decrypt", required_argument, NULL, 'd' },
+						{ "program", required_argument, NULL, 'p' },
+						{ "erase", required_argument, NULL, 'e' },
+						{ "xfer", required_argument, NULL, 'x' },
+						{ "features", required_argument, NULL, 'f' },
+						{ "xblock", required_argument, NULL, 'X' },
+						{ "blocks", required_argument, NULL, 'n' },
+						{ "runs", required_argument, NULL, 'r' },
+						{ "compress", no_argument, NULL, 'z' },
+						{ "compare", required_argument, NULL, 'c' },
+						{ "help", no_argument, NULL, 'h' },
+						{ 0, 0, 0, 0 } };
+	char path[] = "/tmp/tssupervisorbench-XXXXXX";
+	char zpath[sizeof(path) + 3];
+	update_meth_t method = UPDATE_V1;
+	struct sim_cfg cfg, base_cfg;
+	double per_block, base_per_block;
+	uint16_t base_features = 0;
+	int compare = 0;
+	unsigned int blocks = 128;
+	unsigned int runs = 1;
+	int compress = 0;
+	board_t *board;
+	uint8_t *image;
+	int failed = 0;
+	int c;
+
+	sim_default_cfg(&cfg);
+
+	while ((c = getopt_long(argc, argv, "m:k:d:p:e:x:f:X:n:r:zc:h", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'm':
+			if (!strcmp(optarg, "v0")) {
+				method = UPDATE_V0;
+			} else if (!strcmp(optarg, "v1")) {
+				method = UPDATE_V1;
+			} else {
+				fprintf(stderr, "Unknown method \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
+		case 'k':
+			cfg.bus_khz = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			cfg.decrypt_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			cfg.program_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			cfg.erase_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			cfg.xfer_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			cfg.features = strtoul(optarg, NULL, 0) | SUPER_FEAT_FWUPD;
+			break;
+		case 'X':
+			cfg.xblock_max = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			runs = strtoul(optarg, NULL, 0);
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		case 'c':
+			base_features = strtoul(optarg, NULL, 0) | SUPER_FEAT_FWUPD;
+			compare = 1;
+			break;
+		case 'h':
+			usage(argv);
+			return 0;
+		default:
+			usage(argv);
+			return 1;
+		}
+	}
+
+	if (!blocks || blocks > 1024 || !cfg.bus_khz) {
+		fprintf(stderr, "Invalid block count or bus speed\n");
+		return 1;
+	}
+
+	board = &bench_boards[method];
+	cfg.method = method;
+	cfg.modelnum = board->modelnum;
+	cfg.revision = board->min_rev ? board->min_rev : 1;
+
+	if (make_image(board, blocks, cfg.revision + 1, compress, path, &image) < 0)
+		return 1;
+	snprintf(zpath, sizeof(zpath), "%s.z", path);
+	if (compress && lz_compress_file(zpath, path) < 0) {
+		unlink(path);
+		free(image);
+		return 1;
+	}
+
+	while (runs--) {
+		if (run_one(board, &cfg, compress ? zpath : path, image, blocks * 128, &per_block) < 0)
+			failed = 1;
+		if (!compare)
+			continue;
+
+		/* Everything but the features as under test */
+		base_cfg = cfg;
+		base_cfg.features = base_features;
+		if (run_one(board, &base_cfg, compress ? zpath : path, image, blocks * 128, &base_per_block) < 0)
+			failed = 1;
+		if (per_block > base_per_block) {
+			fprintf(stderr, "Features 0x%04X took %.2f transfers/block, more than 0x%04X's %.2f\n",
+				cfg.features, per_block, base_cfg.features, base_per_block);
+			failed = 1;
+		}
+	}
+
+	unlink(path);
+	if (compress)
+		unlink(zpath);
+	free(image);
+
+	return failed;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "update-shared.h"
+#include "update-journal.h"
+
+/*
+ * Open the journal for the supervisor on board's bus and chip, in dir,
+ * creating it if need be. A NULL dir turns journaling off. Returns 1 if the
+ * journal describes an interrupted update of this very image to this micro,
+ * with j->rec as it was left, or 0 if not, with j->rec describing the image.
+ * Failing to journal is not fatal to the update, it is reported and the
+ * update goes ahead without it.
+ */
+int journal_open(struct update_journal *j, const char *dir, const board_t *board, const struct update_image *img,
+		 const struct micro_snapshot *snap)
+{
+	struct journal_record rec;
+	uint64_t hash = update_image_hash(img);
+
+	memset(j, 0, sizeof(*j));
+	j->fd = -1;
+	j->rec.magic = JOURNAL_MAGIC;
+	j->rec.version = JOURNAL_VERSION;
+	j->rec.image_hash = hash;
+	j->rec.bin_size = img->bin_size;
+	j->rec.model = snap->model;
+	j->rec.revision = snap->revision;
+
+	if (!dir)
+		return 0;
+
+	mkdir(dir, 0755);
+	snprintf(j->path, sizeof(j->path), "%s/supervisor-%d-%02x.journal", dir, board->i2c_bus, board->i2c_chip);
+	j->fd = open(j->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (j->fd < 0) {
+		fprintf(stderr, "Unable to open update journal %s: %s, updating without it\n", j->path,
+			strerror(errno));
+		return 0;
+	}
+
+	if (pread(j->fd, &rec, sizeof(rec), 0) != sizeof(rec))
+		return 0;
+
+	if (rec.magic != JOURNAL_MAGIC || rec.version != JOURNAL_VERSION || rec.image_hash != hash ||
+	    rec.bin_size != img->bin_size || rec.model != snap->model || rec.revision != snap->revision)
+		return 0;
+
+	j->rec = rec;
+	return 1;
+}
+
+/*
+ * Record that the image is being written in blocks of block_sz. This is
+ * synced, so the journal survives losing power any time after.
+ */
+int journal_begin(struct update_journal *j, unsigned int block_sz)
+{
+	if (j->fd < 0)
+		return 0;
+
+	j->rec.block_sz = block_sz;
+	if (pwrite(j->fd, &j->rec, sizeof(j->rec), 0) != sizeof(j->rec) || fdatasync(j->fd) < 0) {
+		fprintf(stderr, "Unable to write update journal %s: %s\n", j->path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The update completed, there is nothing left to resume */
+void journal_finish(struct update_journal *j)
+{
+	if (j->fd < 0)
+		return;
+
+	unlink(j->path);
+	journal_close(j);
+}
+
+void journal_close(struct update_journal *j)
+{
+	if (j->fd >= 0)
+		close(j->fd);
+	j->fd = -1;
+}
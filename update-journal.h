@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "micro.h"
+#include "update-shared.h"
+
+/*
+ * Update journal
+ *
+ * A small file per supervisor recording which image is being written to it
+ * and in what size of block. Firmware with
+ * SUPER_FEAT_RESUME keeps what it already wrote across an interruption, and
+ * the journal is what ties that partial image to the update file on the
+ * host: a later run only resumes if the image hash, size, block size, and
+ * the micro's model and revision all still match. The journal is removed
+ * once an update completes. How far the update got is only ever taken from
+ * the micro, whose SUPER_FL_WRITE_OFS counts what it actually programmed.
+ */
+#define JOURNAL_DEFAULT_DIR "/var/lib/tssupervisorupdate"
+#define JOURNAL_MAGIC 0x4a555354 /* "TSUJ" */
+#define JOURNAL_VERSION 2
+
+struct journal_record {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t image_hash; /* See update_image_hash() */
+	uint32_t bin_size;
+	uint32_t block_sz;
+	uint16_t model; /* As the micro reported it */
+	uint16_t revision; /* Of the firmware running while the update was written */
+};
+
+struct update_journal {
+	int fd; /* < 0 if journaling is off or failed */
+	char path[256];
+	struct journal_record rec;
+};
+
+int journal_open(struct update_journal *j, const char *dir, const board_t *board, const struct update_image *img,
+		 const struct micro_snapshot *snap);
+int journal_begin(struct update_journal *j, unsigned int block_sz);
+void journal_finish(struct update_journal *j);
+void journal_close(struct update_journal *j);
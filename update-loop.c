@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "update-sm.h"
+#include "update-loop.h"
+
+/* Events taken from epoll at once, more just wait for the next call */
+#define UPDATE_LOOP_EVENTS 16
+
+int update_loop_init(struct update_loop *loop)
+{
+	loop->active = 0;
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		perror("Unable to create update loop");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Fire sm's timer at its deadline, straight away if that has passed. A
+ * realtime handle's fires spin_us early, for micro_wait_finish() to spin out.
+ */
+static int update_loop_arm(struct update_sm *sm)
+{
+	struct itimerspec its = { 0 };
+	uint64_t lead = sm->micro->realtime ? (uint64_t)sm->micro->spin_us * 1000 : 0;
+	uint64_t when = sm->deadline_ns;
+
+	/* An all zero time disarms the timer instead */
+	when = (when > lead) ? when - lead : 1;
+
+	its.it_value.tv_sec = when / 1000000000ULL;
+	its.it_value.tv_nsec = when % 1000000000ULL;
+
+	return timerfd_settime(sm->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void update_loop_remove(struct update_loop *loop, struct update_sm *sm)
+{
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sm->timer_fd, NULL);
+	close(sm->timer_fd);
+	sm->timer_fd = -1;
+	loop->active--;
+}
+
+/*
+ * Add a machine that has been started, but not stepped, e.g. with
+ * do_v1_micro_update_start(). It first runs on the next dispatch. Returns < 0
+ * on failure.
+ */
+int update_loop_add(struct update_loop *loop, struct update_sm *sm)
+{
+	struct epoll_event ev = { 0 };
+
+	sm->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (sm->timer_fd < 0) {
+		perror("Unable to create update timer");
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = sm;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sm->timer_fd, &ev) < 0) {
+		perror("Unable to add update timer");
+		goto err_out;
+	}
+	loop->active++;
+
+	if (update_loop_arm(sm) < 0) {
+		perror("Unable to arm update timer");
+		update_loop_remove(loop, sm);
+		return -1;
+	}
+
+	return 0;
+
+err_out:
+	close(sm->timer_fd);
+	sm->timer_fd = -1;
+	return -1;
+}
+
+int update_loop_fd(struct update_loop *loop)
+{
+	return loop->epfd;
+}
+
+/*
+ * Wait up to timeout_ms, -1 for as long as it takes, for machines that are
+ * due and step each of them. Returns how many machines are left, or < 0 on
+ * failure.
+ */
+int update_loop_dispatch(struct update_loop *loop, int timeout_ms)
+{
+	struct epoll_event ev[UPDATE_LOOP_EVENTS];
+	struct update_sm *sm;
+	uint64_t expired;
+	int ret;
+	int n;
+	int i;
+
+	n = epoll_wait(loop->epfd, ev, UPDATE_LOOP_EVENTS, timeout_ms);
+	if (n < 0) {
+		if (errno == EINTR)
+			return loop->active;
+		perror("Unable to wait for updates");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		sm = ev[i].data.ptr;
+
+		/* Nothing to learn from it, but the timer stays readable until read */
+		if (read(sm->timer_fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+			perror("Unable to read update timer");
+
+		ret = update_sm_step_timed(sm);
+		if (ret == UPDATE_SM_WAIT) {
+			if (update_loop_arm(sm) == 0)
+				continue;
+			perror("Unable to arm update timer");
+			ret = UPDATE_SM_FAILED;
+		}
+
+		update_loop_remove(loop, sm);
+		if (sm->done)
+			sm->done(sm, ret);
+	}
+
+	return loop->active;
+}
+
+/* Dispatch until every machine has finished. Returns < 0 on failure. */
+int update_loop_run(struct update_loop *loop)
+{
+	while (loop->active) {
+		if (update_loop_dispatch(loop, -1) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Once every machine has finished, closing the loop does not stop them */
+void update_loop_close(struct update_loop *loop)
+{
+	close(loop->epfd);
+	loop->epfd = -1;
+}
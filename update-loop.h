@@ -0,0 +1,30 @@
+#pragma once
+
+#include "update-sm.h"
+
+/*
+ * Event loop driver for update state machines
+ *
+ * Runs any number of updates, see update-sm.h, from one thread. Every machine
+ * gets a timerfd armed for the time it next wants to run, all of them in one
+ * epoll set, so the thread only ever blocks in epoll_wait() and nothing waits
+ * on one supervisor while another could use the bus.
+ *
+ * The epoll set is itself pollable. A program with its own event loop can
+ * add update_loop_fd() to it and call update_loop_dispatch() with a timeout
+ * of 0 whenever it is readable, rather than update_loop_run().
+ *
+ * When a machine finishes, its done callback, if any, is called with what
+ * the update returned and the machine is dropped from the loop.
+ */
+struct update_loop {
+	int epfd;
+	unsigned int active; /* Machines not finished yet */
+};
+
+int update_loop_init(struct update_loop *loop);
+int update_loop_add(struct update_loop *loop, struct update_sm *sm);
+int update_loop_fd(struct update_loop *loop);
+int update_loop_dispatch(struct update_loop *loop, int timeout_ms);
+int update_loop_run(struct update_loop *loop);
+void update_loop_close(struct update_loop *loop);
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "update-shared.h"
+#include "targets.h"
+#include "update-lz.h"
+
+#define LZ_MIN_MATCH 4
+/* A match can't start closer to the end than this, nor run into the last literals */
+#define LZ_MF_LIMIT 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+/* Largest update file either method takes, with room for its footer */
+#define LZ_FILE_MAX (128 * 1024 + 64)
+
+/*
+ * The header at the start of data, if it is a compressed update file whose
+ * sizes add up, otherwise NULL.
+ */
+const struct lz_header *lz_header_get(const uint8_t *data, size_t len)
+{
+	const struct lz_header *hdr = (const struct lz_header *)data;
+
+	if (len < sizeof(*hdr) || hdr->magic != LZ_MAGIC || hdr->version != LZ_VERSION ||
+	    hdr->header_size < sizeof(*hdr) || hdr->footer_size > UPDATE_FOOTER_MAX ||
+	    hdr->footer_size > hdr->full_size ||
+	    (uint64_t)hdr->header_size + hdr->comp_size + hdr->footer_size != len)
+		return NULL;
+
+	return hdr;
+}
+
+/*
+ * How long the update file is uncompressed, given head_len bytes from the
+ * start of a file file_size long. That is what its footer describes.
+ */
+size_t lz_full_size(const uint8_t *head, size_t head_len, size_t file_size)
+{
+	const struct lz_header *hdr;
+
+	/* Only the header is looked at, the rest just has to be file_size long */
+	if (head_len < sizeof(*hdr))
+		return file_size;
+
+	hdr = lz_header_get(head, file_size);
+	return hdr ? hdr->full_size : file_size;
+}
+
+/* An LZ4 length: 15 in the token means more follows, in bytes up to 255 */
+static int lz_read_len(struct lz_stream *s, size_t *len)
+{
+	uint8_t b;
+
+	if (*len != 15)
+		return 0;
+
+	do {
+		if (s->src_pos >= s->src_len)
+			return -1;
+		b = s->src[s->src_pos++];
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/*
+ * Decode whole sequences until at least want bytes of dst are filled in, or
+ * the stream ends. Each sequence ends in a match, but for the last. Returns
+ * < 0 if the stream is corrupt or ended before want.
+ */
+int lz_decode(struct lz_stream *s, size_t want)
+{
+	const uint8_t *ref;
+	size_t lit, match, offset;
+	uint8_t *op;
+	uint8_t token;
+
+	while (s->dst_pos < want && s->src_pos < s->src_len) {
+		token = s->src[s->src_pos++];
+
+		lit = token >> 4;
+		if (lz_read_len(s, &lit) < 0 || lit > s->src_len - s->src_pos || lit > s->dst_len - s->dst_pos)
+			return -1;
+		memcpy(&s->dst[s->dst_pos], &s->src[s->src_pos], lit);
+		s->src_pos += lit;
+		s->dst_pos += lit;
+
+		/* Literals alone are the last sequence */
+		if (s->src_pos == s->src_len)
+			break;
+
+		if (s->src_len - s->src_pos < 2)
+			return -1;
+		offset = s->src[s->src_pos] | (s->src[s->src_pos + 1] << 8);
+		s->src_pos += 2;
+		if (!offset || offset > s->dst_pos)
+			return -1;
+
+		match = token & 0xf;
+		if (lz_read_len(s, &match) < 0)
+			return -1;
+		match += LZ_MIN_MATCH;
+		if (match > s->dst_len - s->dst_pos)
+			return -1;
+
+		op = &s->dst[s->dst_pos];
+		ref = op - offset;
+		s->dst_pos += match;
+		/* A match may overlap itself, repeating the last offset bytes */
+		if (offset >= match) {
+			memcpy(op, ref, match);
+		} else {
+			while (match--)
+				*op++ = *ref++;
+		}
+	}
+
+	return (s->dst_pos >= want) ? 0 : -1;
+}
+
+size_t lz_compress_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+static size_t lz_write_len(uint8_t *dst, size_t op, size_t len)
+{
+	if (len < 15)
+		return op;
+
+	for (len -= 15; len >= 255; len -= 255)
+		dst[op++] = 255;
+	dst[op++] = len;
+
+	return op;
+}
+
+/* One sequence, match is 0 for the last, which has no match */
+static size_t lz_write_seq(uint8_t *dst, size_t op, const uint8_t *lit, size_t nlit, size_t offset, size_t match)
+{
+	size_t mcode = match ? match - LZ_MIN_MATCH : 0;
+
+	dst[op++] = ((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15);
+	op = lz_write_len(dst, op, nlit);
+	memcpy(&dst[op], lit, nlit);
+	op += nlit;
+
+	if (!match)
+		return op;
+
+	dst[op++] = offset & 0xff;
+	dst[op++] = offset >> 8;
+
+	return lz_write_len(dst, op, mcode);
+}
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Compress len bytes of src into dst, which must have room for
+ * lz_compress_bound(len) bytes. Greedy, with one candidate per hash, which is
+ * plenty for updates that are only compressed once. Returns the compressed
+ * length.
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst)
+{
+	uint32_t table[1 << LZ_HASH_BITS] = { 0 }; /* Position + 1 of the last 4 bytes with each hash */
+	size_t anchor = 0;
+	size_t ip = 0;
+	size_t op = 0;
+	size_t ref, match;
+	uint32_t seq, h;
+
+	while (len >= LZ_MF_LIMIT && ip <= len - LZ_MF_LIMIT) {
+		seq = lz_read32(&src[ip]);
+		h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+		ref = table[h];
+		table[h] = ip + 1;
+
+		if (!ref || ip - (ref - 1) > LZ_MAX_OFFSET || lz_read32(&src[ref - 1]) != seq) {
+			ip++;
+			continue;
+		}
+		ref--;
+
+		match = LZ_MIN_MATCH;
+		while (ip + match < len - LZ_LAST_LITERALS && src[ref + match] == src[ip + match])
+			match++;
+
+		op = lz_write_seq(dst, op, &src[anchor], ip - anchor, ip - ref, match);
+		ip += match;
+		anchor = ip;
+	}
+
+	return lz_write_seq(dst, op, &src[anchor], len - anchor, 0, 0);
+}
+
+/* Read all of the file at path, up to LZ_FILE_MAX bytes, into *data. Returns its length, or < 0 on failure. */
+static ssize_t lz_read_file(const char *path, uint8_t **data)
+{
+	struct stat st;
+	ssize_t ret;
+	size_t done = 0;
+	int fd;
+
+	*data = NULL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+		goto err_out;
+	}
+	if (st.st_size <= 0 || st.st_size > LZ_FILE_MAX) {
+		fprintf(stderr, "%s is not an update file\n", path);
+		goto err_out;
+	}
+
+	*data = malloc(st.st_size);
+	if (!*data) {
+		perror("Unable to allocate update file");
+		goto err_out;
+	}
+	while (done < (size_t)st.st_size) {
+		ret = read(fd, *data + done, st.st_size - done);
+		if (ret <= 0) {
+			fprintf(stderr, "Unable to read %s: %s\n", path, ret ? strerror(errno) : "truncated");
+			goto err_out;
+		}
+		done += ret;
+	}
+	close(fd);
+
+	return done;
+
+err_out:
+	free(*data);
+	*data = NULL;
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+/*
+ * Write the update file at in to out, compressed, replacing it. Returns < 0
+ * on failure.
+ */
+int lz_compress_file(const char *out, const char *in)
+{
+	static const update_meth_t methods[] = { UPDATE_V1, UPDATE_V0 };
+	struct update_footer_info info;
+	struct lz_header hdr = { 0 };
+	struct update_image img = { 0 };
+	char tmp[PATH_MAX + 8];
+	uint8_t *data = NULL;
+	uint8_t *comp = NULL;
+	unsigned int i;
+	ssize_t len;
+	int fd;
+	int ret = -1;
+
+	len = lz_read_file(in, &data);
+	if (len < 0)
+		return -1;
+
+	if (lz_header_get(data, len)) {
+		fprintf(stderr, "%s is already compressed\n", in);
+		goto out;
+	}
+
+	for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+		if (update_ops_get(methods[i])->probe_footer(data, len, len, &info) == 0)
+			break;
+	}
+	if (i == sizeof(methods) / sizeof(methods[0])) {
+		fprintf(stderr, "%s is not an update file\n", in);
+		goto out;
+	}
+
+	comp = malloc(lz_compress_bound(info.bin_size));
+	if (!comp) {
+		perror("Unable to allocate compressed update");
+		goto out;
+	}
+
+	img.bin = data;
+	img.bin_size = info.bin_size;
+	hdr.magic = LZ_MAGIC;
+	hdr.version = LZ_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.full_size = len;
+	hdr.comp_size = lz_compress(data, info.bin_size, comp);
+	hdr.footer_size = len - info.bin_size;
+	hdr.bin_hash = update_image_hash(&img);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to create %s: %s\n", tmp, strerror(errno));
+		goto out;
+	}
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, comp, hdr.comp_size) != (ssize_t)hdr.comp_size ||
+	    write(fd, &data[info.bin_size], hdr.footer_size) != hdr.footer_size) {
+		fprintf(stderr, "Unable to write %s: %s\n", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	if (close(fd) < 0) {
+		fprintf(stderr, "Unable to write %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	if (rename(tmp, out) < 0) {
+		fprintf(stderr, "Unable to write %s: %s\n", out, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+
+	printf("Compressed %u byte update to %u bytes\n", info.bin_size, hdr.comp_size);
+	ret = 0;
+
+out:
+	free(comp);
+	free(data);
+	return ret;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Compressed update files
+ *
+ * The update proper compressed in the LZ4 block format: sequences of a
+ * token, literals, and a match copied from up to 64 KiB back in what was
+ * already decoded. The footer is kept as it is at the end of the file, so it
+ * is checked without decompressing anything:
+ *
+ *   struct lz_header | compressed update | footer
+ *
+ * Decoding needs no memory but the update itself, which the footer limits to
+ * 128 KiB. It is done when the footer is checked, see update_image_set_bin(),
+ * and the result is checked against bin_hash before the micro is touched, so
+ * a corrupt file never gets as far as erasing flash. The header is in native
+ * byte order, as --compress wrote it, which is little-endian on every board
+ * this runs on.
+ */
+#define LZ_MAGIC 0x5a555354 /* "TSUZ" */
+#define LZ_VERSION 1
+
+struct lz_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size; /* Where the compressed update starts */
+	uint32_t full_size; /* Of the update file uncompressed, footer included */
+	uint32_t comp_size; /* Of the compressed update */
+	uint16_t footer_size; /* Follows the compressed update */
+	uint16_t reserved[3];
+	uint64_t bin_hash; /* update_image_hash() of the update proper */
+};
+
+/* Decoding in progress, from src into dst */
+struct lz_stream {
+	const uint8_t *src;
+	size_t src_len;
+	size_t src_pos;
+	uint8_t *dst;
+	size_t dst_len;
+	size_t dst_pos;
+};
+
+const struct lz_header *lz_header_get(const uint8_t *data, size_t len);
+size_t lz_full_size(const uint8_t *head, size_t head_len, size_t file_size);
+int lz_decode(struct lz_stream *s, size_t want);
+size_t lz_compress_bound(size_t len);
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst);
+int lz_compress_file(const char *out, const char *in);
@@ -1,7 +1,268 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crc8.h"
+#include "crc32.h"
+#include "bundle.h"
 
 #include "update-shared.h"
+#include "update-stats.h"
+
+#define UPDATE_HASH_INIT 0xcbf29ce484222325ULL
+
+/* Continue a 64-bit FNV-1a hash over len bytes of data */
+static uint64_t update_hash_bytes(uint64_t hash, const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Where the footer is in img->file, which may be compressed */
+static void update_image_find_footer(struct update_image *img)
+{
+	img->full_size = img->file_len;
+	img->tail_len = (img->file_len < UPDATE_FOOTER_MAX) ? img->file_len : UPDATE_FOOTER_MAX;
+
+	img->lz = lz_header_get(img->file, img->file_len);
+	if (img->lz) {
+		img->full_size = img->lz->full_size;
+		img->tail_len = img->lz->footer_size;
+	}
+
+	img->tail = img->file + img->file_len - img->tail_len;
+}
+
+/*
+ * Map an update file read-only, or the image for board in a bundle of them.
+ * Returns < 0 on failure.
+ */
+int update_image_map(struct update_image *img, const char *path, const board_t *board)
+{
+	const struct bundle_entry *e;
+	struct stat st;
+	int fd;
+
+	memset(img, 0, sizeof(*img));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("Unable to open update file");
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("Unable to stat update file");
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size <= 0) {
+		fprintf(stderr, "Update file is empty\n");
+		close(fd);
+		return -1;
+	}
+
+	img->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (img->map == MAP_FAILED) {
+		perror("Unable to map update file");
+		img->map = NULL;
+		return -1;
+	}
+	img->map_len = st.st_size;
+	img->file = img->map;
+	img->file_len = img->map_len;
+
+	/* Checking the image's CRC reads it in, and nothing else in the bundle is needed */
+	if (bundle_is_bundle(img->map, img->map_len)) {
+		e = bundle_find(img->map, img->map_len, board);
+		if (!e) {
+			update_image_close(img);
+			return -1;
+		}
+		img->file = img->map + e->offset;
+		img->file_len = e->length;
+		img->file_crc = e->crc;
+		img->check_crc = 1;
+	} else {
+		/* Start reading it in now, it is all needed shortly */
+		madvise(img->map, img->map_len, MADV_WILLNEED);
+	}
+
+	update_image_find_footer(img);
+
+	return 0;
+}
+
+/*
+ * Decompress a compressed update into memory of its own and check it against
+ * the hash in its header. Returns < 0 on failure.
+ */
+static int update_image_lz_decode(struct update_image *img)
+{
+	struct lz_stream *s = &img->lz_stream;
+
+	s->dst = malloc(img->bin_size ? img->bin_size : 1);
+	if (!s->dst) {
+		perror("Unable to allocate update");
+		return -1;
+	}
+	s->dst_len = img->bin_size;
+	s->dst_pos = 0;
+	s->src = img->file + img->lz->header_size;
+	s->src_len = img->lz->comp_size;
+	s->src_pos = 0;
+	img->bin = s->dst;
+
+	if (lz_decode(s, s->dst_len) < 0 || s->src_pos != s->src_len || s->dst_pos != s->dst_len ||
+	    update_hash_bytes(UPDATE_HASH_INIT, img->bin, img->bin_size) != img->lz->bin_hash) {
+		fprintf(stderr, "Compressed update file is corrupt\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Once the footer has been checked, mark the start of the image as the update
+ * proper and take the CRC of each block, along with the whole file's if there
+ * is one to check it against, in one pass. A compressed update is decompressed
+ * and checked here, so nothing that is not going to be sent gets as far as
+ * erasing flash, but its block CRCs are left for update_image_prepare().
+ * Returns < 0 on failure.
+ */
+int update_image_set_bin(struct update_image *img, uint32_t bin_size)
+{
+	uint32_t crc = 0;
+
+	img->bin_size = bin_size;
+	img->block_sz = UPDATE_BLOCK_SZ;
+	img->nblocks = bin_size / UPDATE_BLOCK_SZ;
+
+	if (img->lz) {
+		/* The file's CRC first, a corrupt bundle should not be decoded */
+		if (img->check_crc) {
+			crc = crc32_update(0, img->file, img->file_len);
+			if (crc != img->file_crc)
+				goto err_corrupt;
+		}
+		return update_image_lz_decode(img);
+	}
+
+	img->bin = img->file;
+	img->block_crc = malloc(img->nblocks ? img->nblocks : 1);
+	if (!img->block_crc) {
+		perror("Unable to allocate block CRCs");
+		return -1;
+	}
+	crc8_blocks(img->bin, bin_size, UPDATE_BLOCK_SZ, img->block_crc, img->check_crc ? &crc : NULL);
+	if (img->check_crc)
+		crc = crc32_update(crc, img->file + bin_size, img->file_len - bin_size);
+
+	if (img->check_crc && crc != img->file_crc)
+		goto err_corrupt;
+
+	return 0;
+
+err_corrupt:
+	fprintf(stderr, "Update in the bundle is corrupt\n");
+	return -1;
+}
+
+/*
+ * Split the image into blocks of block_sz, a multiple of UPDATE_BLOCK_SZ,
+ * instead. Must be called before the image is prepared. Returns < 0 on failure.
+ */
+int update_image_set_block_size(struct update_image *img, unsigned int block_sz)
+{
+	unsigned int per = block_sz / UPDATE_BLOCK_SZ;
+	unsigned int nblocks = img->nblocks;
+	unsigned int i, j;
+	uint8_t crc;
+
+	if (!block_sz || (block_sz % UPDATE_BLOCK_SZ) || img->prepared) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (img->block_crc && block_sz != img->block_sz) {
+		if (img->block_sz == UPDATE_BLOCK_SZ) {
+			/* Each block's CRC from those of the 128-byte blocks it is made of, in place */
+			for (i = 0; i * per < nblocks; i++) {
+				crc = 0;
+				for (j = i * per; j < (i + 1) * per && j < nblocks; j++)
+					crc = crc8_combine(crc, img->block_crc[j], UPDATE_BLOCK_SZ);
+				img->block_crc[i] = crc;
+			}
+		} else {
+			crc8_blocks(img->bin, img->bin_size, block_sz, img->block_crc, NULL);
+		}
+	}
+
+	img->block_sz = block_sz;
+	img->nblocks = (img->bin_size + block_sz - 1) / block_sz;
+
+	return 0;
+}
+
+/*
+ * Finish the image off for sending. The update code calls this right after
+ * asking the micro to open and erase flash, so the work is done while the
+ * micro is busy anyway. Only a compressed update has any left: the CRC of
+ * each block, once the method has settled how big they are. Returns < 0 on
+ * failure.
+ */
+int update_image_prepare(struct update_image *img)
+{
+	if (img->prepared || !img->lz) {
+		img->prepared = 1;
+		return 0;
+	}
+
+	img->block_crc = malloc(img->nblocks ? img->nblocks : 1);
+	if (!img->block_crc) {
+		perror("Unable to allocate block CRCs");
+		return -1;
+	}
+	crc8_blocks(img->bin, img->bin_size, img->block_sz, img->block_crc, NULL);
+
+	img->prepared = 1;
+	return 0;
+}
+
+/*
+ * 64-bit FNV-1a of the update proper, to tell images apart across runs. A
+ * compressed update's is in its header, and checked when its footer is.
+ */
+uint64_t update_image_hash(const struct update_image *img)
+{
+	if (img->lz)
+		return img->lz->bin_hash;
+
+	return update_hash_bytes(UPDATE_HASH_INIT, img->bin, img->bin_size);
+}
+
+void update_image_close(struct update_image *img)
+{
+	if (img->map)
+		munmap(img->map, img->map_len);
+	free(img->lz_stream.dst);
+	free(img->block_crc);
+	memset(img, 0, sizeof(*img));
+}
 
 void flash_print_error(uint8_t status)
 {
@@ -26,3 +287,273 @@ void flash_print_error(uint8_t status)
 		break;
 	}
 }
+
+/*
+ * Report how many bytes of the update have been sent, either through the
+ * handle's progress callback or as a self-overwriting line on stdout.
+ */
+void update_progress(micro_t *micro, unsigned int done, unsigned int total)
+{
+	if (micro->progress) {
+		micro->progress(micro, done, total);
+		return;
+	}
+
+	printf("\r%d/%d", done, total);
+	fflush(stdout);
+}
+
+/*
+ * Opening flash erases and blank checks the whole update area, which can take
+ * up to a second. Writing a block is mostly decryption plus a short flash
+ * program, normally well under 2 ms, and poll_cfg_block is only the first
+ * guess at it, see poll_cfg_block_learn().
+ */
+struct poll_cfg poll_cfg_open = {
+	.initial_us = 50000,
+	.min_us = 10000,
+	.max_us = 100000,
+	.deadline_us = 5000000,
+};
+
+struct poll_cfg poll_cfg_block = {
+	.initial_us = 100,
+	.min_us = 50,
+	.max_us = 1000,
+	.deadline_us = 250000,
+};
+
+/*
+ * How long a block takes depends on the micro's clocks, and a block wait
+ * sampled from poll_cfg_block's first guesses costs several transactions. So
+ * after each block fit cfg to the wait res it took. A wait that needed more
+ * than its first sample was sampled too soon: the next one starts a step short
+ * of how long it took, and backs off from there in that step, so it is caught
+ * by the second sample at most. One finished at its first sample may have
+ * been sampled too late, so the next one is sampled a step sooner. A slow
+ * block only doubles the wait, and no sample comes before holdoff_us.
+ */
+void poll_cfg_block_learn(struct poll_cfg *cfg, const struct poll_result *res, unsigned int holdoff_us)
+{
+	unsigned int limit = 2 * (cfg->initial_us + cfg->min_us);
+	unsigned int elapsed_us = res->elapsed_us;
+	unsigned int step;
+
+	if (elapsed_us > limit)
+		elapsed_us = limit;
+
+	step = elapsed_us / 16;
+	if (step < poll_cfg_block.min_us)
+		step = poll_cfg_block.min_us;
+	if (step > cfg->max_us)
+		step = cfg->max_us;
+
+	if (res->polls - res->given == 1)
+		cfg->initial_us = (cfg->initial_us > step) ? cfg->initial_us - step : 0;
+	else
+		cfg->initial_us = (elapsed_us > step) ? elapsed_us - step : 0;
+	cfg->min_us = step;
+	if (cfg->initial_us < holdoff_us)
+		cfg->initial_us = holdoff_us;
+}
+
+struct poll_cfg poll_cfg_close = {
+	.initial_us = 0,
+	.min_us = 50,
+	.max_us = 1000,
+	.deadline_us = 100000,
+};
+
+int poll_busy_opening(uint8_t status)
+{
+	/*
+	 * The micro may not have picked up the open command yet, so anything
+	 * other than READY or an outright failure means keep waiting.
+	 */
+	switch (status) {
+	case STATUS_READY:
+	case STATUS_CRC_ERR:
+	case STATUS_ERASE_ERR:
+	case STATUS_WRITE_ERR:
+	case STATUS_NOT_BLANK:
+	case STATUS_OPEN_ERR:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+int poll_busy_resuming(uint8_t status)
+{
+	/* Resuming ends where the interrupted update left off, so also in IN_PROC or DONE */
+	return poll_busy_opening(status) && status != STATUS_IN_PROC && status != STATUS_DONE;
+}
+
+int poll_busy_writing(uint8_t status)
+{
+	return (status == STATUS_WAIT);
+}
+
+int poll_busy_closing(uint8_t status)
+{
+	return (status != STATUS_CLOSED);
+}
+
+/*
+ * An I2C controller reports a NAK or a stalled transfer with one of these. Any
+ * other error means something is wrong on our side and waiting won't fix it.
+ */
+int update_err_is_transient(int err)
+{
+	switch (err) {
+	case ENXIO:
+	case EREMOTEIO:
+	case EIO:
+	case ETIMEDOUT:
+	case EAGAIN:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void poll_finish(struct poll_state *ps, int ret)
+{
+	ps->done = 1;
+	ps->ret = ret;
+	ps->res.elapsed_us = (micro_now_ns() - ps->start_ns) / 1000;
+}
+
+/*
+ * Start waiting for the micro. If sampled is not NULL it is a first sample,
+ * e.g. one read in the same transaction as the command that started the
+ * wait, and may already end it.
+ */
+void poll_begin(struct poll_state *ps, const struct poll_cfg *cfg, poll_read_fn read_status, poll_busy_fn busy,
+		const uint8_t *sampled)
+{
+	memset(ps, 0, sizeof(*ps));
+	ps->cfg = cfg;
+	ps->read_status = read_status;
+	ps->busy = busy;
+	ps->interval_us = cfg->min_us;
+	ps->start_ns = micro_now_ns();
+	ps->next_ns = ps->start_ns + ((uint64_t)cfg->initial_us * 1000);
+
+	if (sampled) {
+		ps->res.polls++;
+		ps->res.given++;
+		if (!busy(*sampled)) {
+			poll_finish(ps, 0);
+			return;
+		}
+		ps->res.busy++;
+	}
+}
+
+/*
+ * Returns POLL_AGAIN while waiting, see struct poll_state. Otherwise returns
+ * 0 once the micro reports a status that busy() does not consider busy, with
+ * that status in *status, or < 0 if the deadline passes first or a read fails
+ * in a way that is not just the micro being busy. The result, once there is
+ * one, is in ps->res.
+ */
+int poll_step(struct poll_state *ps, micro_t *micro, uint8_t *status)
+{
+	const struct poll_cfg *cfg = ps->cfg;
+	unsigned int interval;
+	unsigned int now;
+
+	if (ps->done)
+		return ps->ret;
+
+	if (micro_now_ns() < ps->next_ns)
+		return POLL_AGAIN;
+
+	ps->res.polls++;
+	if (ps->read_status(micro, status) < 0) {
+		if (!update_err_is_transient(errno)) {
+			poll_finish(ps, -1);
+			return -1;
+		}
+		ps->res.naks++;
+	} else if (ps->busy(*status)) {
+		ps->res.busy++;
+	} else {
+		poll_finish(ps, 0);
+		return 0;
+	}
+
+	now = (micro_now_ns() - ps->start_ns) / 1000;
+	if (now >= cfg->deadline_us) {
+		poll_finish(ps, -1);
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	/* Never wait past the deadline, always take one last sample */
+	interval = ps->interval_us;
+	if (interval > cfg->deadline_us - now)
+		interval = cfg->deadline_us - now;
+	ps->next_ns = ps->start_ns + ((uint64_t)(now + interval) * 1000);
+
+	ps->interval_us *= 2;
+	if (ps->interval_us > cfg->max_us)
+		ps->interval_us = cfg->max_us;
+
+	return POLL_AGAIN;
+}
+
+struct retry_policy retry_policy_block = {
+	.max_retries = 5,
+	.backoff_us = 1000,
+	.backoff_max_us = 50000,
+};
+
+/*
+ * Account for one more try at the current block, *tries of them so far.
+ * Returns how long to back off before it in us, or < 0 if the policy allows
+ * no more.
+ */
+int update_retry(micro_t *micro, const struct retry_policy *policy, unsigned int *tries, enum retry_reason reason)
+{
+	unsigned int backoff;
+
+	if (*tries >= policy->max_retries)
+		return -1;
+
+	backoff = policy->backoff_us << *tries;
+	if (backoff > policy->backoff_max_us)
+		backoff = policy->backoff_max_us;
+
+	(*tries)++;
+	stats_retry(micro, reason);
+
+	return backoff;
+}
+
+/*
+ * Called straight after asking the micro to open flash. Erasing and blank
+ * checking keeps it busy for a good while, so the image is prepared and
+ * progress reporting started in the meantime. *open_cfg is filled in with
+ * poll_cfg_open, its initial delay shortened by however long that took.
+ * Returns < 0 on failure.
+ */
+int update_prepare_during_open(micro_t *micro, struct update_image *img, struct poll_cfg *open_cfg)
+{
+	uint64_t start = micro_now_ns();
+	unsigned int us;
+
+	*open_cfg = poll_cfg_open;
+
+	if (update_image_prepare(img) < 0)
+		return -1;
+
+	update_progress(micro, 0, img->bin_size);
+
+	us = (micro_now_ns() - start) / 1000;
+	stats_prepare(micro, us);
+	open_cfg->initial_us -= (us < open_cfg->initial_us) ? us : open_cfg->initial_us;
+
+	return 0;
+}
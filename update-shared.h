@@ -1,5 +1,8 @@
 #pragma once
 
+#include "micro.h"
+#include "update-lz.h"
+
 typedef enum update_method {
 	UPDATE_V0,
 	UPDATE_V1,
@@ -15,7 +18,164 @@ typedef struct board {
 	update_meth_t method;
 } board_t;
 
+/*
+ * An update file, mapped and validated once
+ *
+ * The footer is parsed and checked by the update method when the image is
+ * opened, before the micro is ever touched, and the CRC of each 128-byte
+ * block taken in the same pass that checks the CRC-32 a bundle has for the
+ * file. Larger blocks' CRCs are combined from those. A compressed file, see
+ * update-lz.h, is decompressed and checked along with the footer, but its
+ * block CRCs are taken by update_image_prepare() while the micro erases flash
+ * instead. After that the update only reads from memory.
+ */
+#define UPDATE_BLOCK_SZ 128
+
+struct update_image {
+	uint8_t *map;
+	size_t map_len;
+	const uint8_t *file; /* The update file in the map, all of it unless it is a bundle, see bundle.h */
+	size_t file_len;
+	size_t full_size; /* Of the update file uncompressed, as its footer has it */
+	const uint8_t *tail; /* Its last tail_len bytes, where the footer is */
+	size_t tail_len;
+	const uint8_t *bin; /* Start of the update proper, bin_size bytes */
+	uint32_t bin_size;
+	const struct lz_header *lz; /* Set if the file is compressed */
+	struct lz_stream lz_stream;
+	int check_crc; /* A bundle gave file_crc, the CRC-32 of the whole file */
+	uint32_t file_crc;
+	int prepared;
+	unsigned int block_sz; /* UPDATE_BLOCK_SZ unless the method negotiated more */
+	unsigned int nblocks; /* The last may be short when block_sz is larger */
+	uint8_t *block_crc; /* crc8 of each block, when the footer is checked or once a compressed file is prepared */
+	uint16_t revision;
+	uint16_t model; /* 0 if the footer does not carry one */
+};
+
+/*
+ * What a footer says about its update, read from no more than the last
+ * UPDATE_FOOTER_MAX bytes of the file without mapping it. See the methods'
+ * probe_footer.
+ */
+#define UPDATE_FOOTER_MAX 22
+
+struct update_footer_info {
+	uint32_t bin_size;
+	uint16_t revision;
+	uint16_t model; /* 0 if the footer does not carry one */
+	uint8_t footer_version;
+};
+
+int update_image_map(struct update_image *img, const char *path, const board_t *board);
+int update_image_set_bin(struct update_image *img, uint32_t bin_size);
+int update_image_set_block_size(struct update_image *img, unsigned int block_sz);
+int update_image_prepare(struct update_image *img);
+uint64_t update_image_hash(const struct update_image *img);
+
+static inline unsigned int update_image_block_len(const struct update_image *img, unsigned int blk)
+{
+	uint32_t left = img->bin_size - (blk * img->block_sz);
+
+	return (left < img->block_sz) ? left : img->block_sz;
+}
+void update_image_close(struct update_image *img);
+
 void flash_print_error(uint8_t status);
+void update_progress(micro_t *micro, unsigned int done, unsigned int total);
+
+/*
+ * Status polling
+ *
+ * Rather than sleeping a fixed worst case amount of time after each flash
+ * operation, the status is sampled with an exponentially growing interval
+ * until the micro reports something other than a busy state, or a deadline
+ * passes. The micro disables interrupts while touching flash, during which it
+ * may NAK; those failures are counted as busy rather than as errors.
+ */
+struct poll_cfg {
+	unsigned int initial_us; /* Delay before the first sample */
+	unsigned int min_us; /* First interval between samples */
+	unsigned int max_us; /* Interval between samples never grows past this */
+	unsigned int deadline_us; /* Give up this long after polling starts */
+};
+
+struct poll_result {
+	unsigned int elapsed_us; /* How long the wait actually took */
+	unsigned int polls; /* Number of status samples attempted */
+	unsigned int given; /* Of those, the one poll_begin() was given, 0 or 1 */
+	unsigned int busy; /* Samples that reported a busy status */
+	unsigned int naks; /* Samples that failed while the micro was busy */
+};
+
+/* Returns < 0 on a failed read, 0 on success with the status in *status */
+typedef int (*poll_read_fn)(micro_t *micro, uint8_t *status);
+/* Returns non-zero if status means the micro has not finished yet */
+typedef int (*poll_busy_fn)(uint8_t status);
+
+/*
+ * The wait is taken one sample at a time, so callers never block. After
+ * poll_begin(), each poll_step() takes at most one sample and returns
+ * POLL_AGAIN while the micro is still busy, with next_ns the CLOCK_MONOTONIC
+ * time it wants to be called again. Called any earlier it does nothing.
+ */
+#define POLL_AGAIN 1
+
+struct poll_state {
+	const struct poll_cfg *cfg;
+	poll_read_fn read_status;
+	poll_busy_fn busy;
+	uint64_t start_ns;
+	uint64_t next_ns;
+	unsigned int interval_us;
+	int done; /* Set once finished, with ret what poll_step() returns from then on */
+	int ret;
+	struct poll_result res;
+};
+
+void poll_begin(struct poll_state *ps, const struct poll_cfg *cfg, poll_read_fn read_status, poll_busy_fn busy,
+		const uint8_t *sampled);
+int poll_step(struct poll_state *ps, micro_t *micro, uint8_t *status);
+
+void poll_cfg_block_learn(struct poll_cfg *cfg, const struct poll_result *res, unsigned int holdoff_us);
+
+int poll_busy_opening(uint8_t status);
+int poll_busy_resuming(uint8_t status);
+int poll_busy_writing(uint8_t status);
+int poll_busy_closing(uint8_t status);
+
+/* Deadlines for each phase of an update, shared by all update methods */
+extern struct poll_cfg poll_cfg_open;
+extern struct poll_cfg poll_cfg_block;
+extern struct poll_cfg poll_cfg_close;
+
+/*
+ * Retrying a block
+ *
+ * One bad transaction should not cost a whole update. A block the micro
+ * rejected as corrupt, or that may not have reached it, is sent again after
+ * a backoff, and a block that takes longer than its deadline is given
+ * another one, up to max_retries times per block. Flash errors are final.
+ */
+struct retry_policy {
+	unsigned int max_retries; /* Per block */
+	unsigned int backoff_us; /* Before the first retry, doubling after each */
+	unsigned int backoff_max_us;
+};
+
+enum retry_reason {
+	RETRY_BUS, /* The transfer failed, e.g. a NAK while the micro had interrupts off */
+	RETRY_CRC, /* The micro received the block corrupted, STATUS_CRC_ERR */
+	RETRY_TIMEOUT, /* The micro was still busy with the block at its deadline */
+	RETRY_REASON_MAX,
+};
+
+extern struct retry_policy retry_policy_block;
+
+int update_retry(micro_t *micro, const struct retry_policy *policy, unsigned int *tries, enum retry_reason reason);
+int update_err_is_transient(int err);
+
+int update_prepare_during_open(micro_t *micro, struct update_image *img, struct poll_cfg *open_cfg);
 
 /* Read-back status values */
 /* Default value of status, closed */
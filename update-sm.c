@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "micro.h"
+#include "update-sm.h"
+
+void update_sm_init(struct update_sm *sm, int (*step)(struct update_sm *sm), board_t *board, micro_t *micro,
+		    struct update_image *img)
+{
+	memset(sm, 0, sizeof(*sm));
+	sm->step = step;
+	sm->board = board;
+	sm->micro = micro;
+	sm->img = img;
+	sm->flash_sts = STATUS_CLOSED;
+	sm->journal.fd = -1;
+	sm->timer_fd = -1;
+}
+
+/*
+ * Run the machine as far as it will go without waiting. Returns an
+ * update_sm_ret, UPDATE_SM_WAIT with sm->deadline_ns set if it is not
+ * finished.
+ */
+int update_sm_step(struct update_sm *sm)
+{
+	if (micro_now_ns() < sm->deadline_ns)
+		return UPDATE_SM_WAIT;
+
+	return sm->step(sm);
+}
+
+/*
+ * Step a machine that something other than update_sm_run() waits for, e.g. a
+ * timer armed for sm->deadline_ns. Each wait is finished off and counted the
+ * way update_sm_run()'s sleeps are, see micro_wait_finish(), so a realtime
+ * handle's timer may fire spin_us early. Returns an update_sm_ret.
+ */
+int update_sm_step_timed(struct update_sm *sm)
+{
+	uint64_t now;
+	int ret;
+
+	if (!sm->micro->realtime && micro_now_ns() < sm->deadline_ns)
+		return UPDATE_SM_WAIT;
+
+	if (sm->wait_start_ns) {
+		micro_wait_finish(sm->micro, sm->wait_start_ns, sm->deadline_ns);
+		sm->wait_start_ns = 0;
+	}
+
+	ret = update_sm_step(sm);
+	now = micro_now_ns();
+	if (ret == UPDATE_SM_WAIT && sm->deadline_ns > now)
+		sm->wait_start_ns = now;
+
+	return ret;
+}
+
+/*
+ * Drive the machine to completion, sleeping on the micro's behalf in between.
+ * Returns < 0 on failure.
+ */
+int update_sm_run(struct update_sm *sm)
+{
+	uint64_t now;
+	int ret;
+
+	while ((ret = update_sm_step(sm)) == UPDATE_SM_WAIT) {
+		now = micro_now_ns();
+		if (sm->deadline_ns > now)
+			micro_sleep_us(sm->micro, (sm->deadline_ns - now + 999) / 1000);
+	}
+
+	return ret;
+}
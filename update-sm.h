@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "micro.h"
+#include "update-shared.h"
+#include "update-journal.h"
+
+/*
+ * Update state machines
+ *
+ * Each update method is a state machine that never sleeps. A step runs the
+ * update as far as it can without waiting on the micro, i.e. the bus
+ * transactions that are due, and returns UPDATE_SM_WAIT with deadline_ns the
+ * CLOCK_MONOTONIC time it next wants to run. Stepped early it does nothing.
+ * Transactions themselves are still synchronous, i2c-dev has no other kind,
+ * so time is the only thing a machine ever waits on.
+ *
+ * update_sm_run() drives one machine to completion, sleeping in between,
+ * which is all the blocking do_vN_micro_update() are. update-loop.h drives
+ * any number of them from one thread.
+ */
+enum update_sm_ret {
+	UPDATE_SM_FAILED = -1,
+	UPDATE_SM_DONE = 0,
+	UPDATE_SM_WAIT = 1,
+};
+
+struct update_sm {
+	board_t *board;
+	micro_t *micro;
+	struct update_image *img;
+	int (*step)(struct update_sm *sm); /* The method's, returns an update_sm_ret */
+	int state; /* The method's own */
+	uint64_t deadline_ns;
+
+	/* Where the update has got to, shared by both methods */
+	struct poll_state poll;
+	struct poll_cfg open_cfg;
+	struct poll_cfg block_cfg; /* Fitted to the micro as blocks go, see poll_cfg_block_learn() */
+	unsigned int block_holdoff_us; /* No block's status is read sooner than this */
+	uint8_t flash_sts;
+	unsigned int blk;
+	unsigned int start; /* First block written in this run, non-zero when resumed */
+	unsigned int tries;
+	enum retry_reason reason;
+	uint64_t block_start;
+	uint64_t block_xfer;
+
+	/* V1 only */
+	uint16_t features;
+	unsigned int block_sz;
+	int resume;
+	struct update_journal journal;
+
+	/* V0 only */
+	uint8_t buf[UPDATE_BLOCK_SZ + 1];
+
+	/* For whoever drives the machine, see update-loop.h */
+	int timer_fd;
+	uint64_t wait_start_ns; /* When the wait began, 0 if none, see update_sm_step_timed() */
+	void (*done)(struct update_sm *sm, int ret);
+	void *arg;
+};
+
+void update_sm_init(struct update_sm *sm, int (*step)(struct update_sm *sm), board_t *board, micro_t *micro,
+		    struct update_image *img);
+int update_sm_step(struct update_sm *sm);
+int update_sm_step_timed(struct update_sm *sm);
+int update_sm_run(struct update_sm *sm);
+
+/* Have the machine run again after us, returns UPDATE_SM_WAIT */
+static inline int update_sm_wait_us(struct update_sm *sm, unsigned int us)
+{
+	sm->deadline_ns = micro_now_ns() + ((uint64_t)us * 1000);
+	return UPDATE_SM_WAIT;
+}
+
+/* Have the machine run again when sm->poll next wants a sample, returns UPDATE_SM_WAIT */
+static inline int update_sm_wait_poll(struct update_sm *sm)
+{
+	sm->deadline_ns = sm->poll.next_ns;
+	return UPDATE_SM_WAIT;
+}
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "micro.h"
+#include "update-shared.h"
+#include "update-stats.h"
+
+static const char *const phase_names[STATS_PHASE_MAX] = {
+	[STATS_PHASE_OPEN] = "open",
+	[STATS_PHASE_BLOCKS] = "blocks",
+	[STATS_PHASE_CLOSE] = "close",
+};
+
+void stats_init(struct update_stats *st, enum stats_format format, FILE *out)
+{
+	memset(st, 0, sizeof(*st));
+	st->format = format;
+	st->out = out;
+	st->block_min_ns = UINT64_MAX;
+}
+
+void stats_phase_begin(micro_t *micro, enum stats_phase phase)
+{
+	struct update_stats *st = micro->stats;
+
+	if (!st)
+		return;
+
+	st->phase_start_ns[phase] = micro_now_ns();
+}
+
+void stats_phase_end(micro_t *micro, enum stats_phase phase)
+{
+	struct update_stats *st = micro->stats;
+
+	if (!st)
+		return;
+
+	st->phase_ns[phase] += micro_now_ns() - st->phase_start_ns[phase];
+	st->phase_ran |= (1 << phase);
+}
+
+void stats_prepare(micro_t *micro, unsigned int us)
+{
+	struct update_stats *st = micro->stats;
+
+	if (!st)
+		return;
+
+	st->prep_us = us;
+}
+
+void stats_open_wait(micro_t *micro, const struct poll_result *pres)
+{
+	struct update_stats *st = micro->stats;
+
+	if (!st)
+		return;
+
+	st->open_wait = *pres;
+}
+
+void stats_resume(micro_t *micro, unsigned int blk)
+{
+	struct update_stats *st = micro->stats;
+
+	if (!st)
+		return;
+
+	st->resumed_at = blk;
+}
+
+static unsigned int stats_bucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned int bucket = 0;
+
+	while (us > 1 && bucket < STATS_HIST_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/*
+ * Record one block. start_ns is when the block write began, xfer_ns how long
+ * handing it to the micro took, and pres the wait for the micro to finish it.
+ */
+void stats_block(micro_t *micro, unsigned int idx, uint64_t start_ns, uint64_t xfer_ns, const struct poll_result *pres)
+{
+	struct update_stats *st = micro->stats;
+	uint64_t ns;
+
+	if (!st)
+		return;
+
+	ns = micro_now_ns() - start_ns;
+
+	st->blocks++;
+	st->block_xfer_ns += xfer_ns;
+	st->block_ns += ns;
+	if (ns < st->block_min_ns)
+		st->block_min_ns = ns;
+	if (ns > st->block_max_ns) {
+		st->block_max_ns = ns;
+		st->block_max_idx = idx;
+	}
+	st->hist[stats_bucket(ns)]++;
+
+	st->polls += pres->polls;
+	st->busy += pres->busy;
+	st->naks += pres->naks;
+	if (pres->polls > st->block_max_polls) {
+		st->block_max_polls = pres->polls;
+		st->block_max_polls_idx = idx;
+	}
+}
+
+void stats_retry(micro_t *micro, enum retry_reason reason)
+{
+	struct update_stats *st = micro->stats;
+
+	if (!st)
+		return;
+
+	st->retries[reason]++;
+}
+
+static void stats_print_text(struct update_stats *st, const struct micro_counters *c)
+{
+	unsigned int peak = 0;
+	uint64_t total = 0;
+	int i;
+
+	fprintf(st->out, "Update statistics:\n");
+	for (i = 0; i < STATS_PHASE_MAX; i++) {
+		if (!(st->phase_ran & (1 << i)))
+			continue;
+		fprintf(st->out, "  %-8s %10.3f ms\n", phase_names[i], st->phase_ns[i] / 1e6);
+		total += st->phase_ns[i];
+	}
+	fprintf(st->out, "  %-8s %10.3f ms\n", "total", total / 1e6);
+
+	if (st->phase_ran & (1 << STATS_PHASE_OPEN))
+		fprintf(st->out, "  open wait %.3f ms, %u polls, %u naks, image prepared in %.3f ms meanwhile\n",
+			st->open_wait.elapsed_us / 1e3, st->open_wait.polls, st->open_wait.naks, st->prep_us / 1e3);
+	if (st->resumed_at)
+		fprintf(st->out, "  resumed an interrupted update at block %u\n", st->resumed_at);
+
+	if (st->blocks) {
+		fprintf(st->out, "  %u blocks: avg %.3f ms, min %.3f ms, max %.3f ms (block %u), transfer avg %.3f ms\n",
+			st->blocks, st->block_ns / 1e6 / st->blocks, st->block_min_ns / 1e6, st->block_max_ns / 1e6,
+			st->block_max_idx, st->block_xfer_ns / 1e6 / st->blocks);
+		fprintf(st->out, "  polls %lu (%.2f/block, max %u at block %u), STATUS_WAIT %lu, naks %lu\n", st->polls,
+			(double)st->polls / st->blocks, st->block_max_polls, st->block_max_polls_idx, st->busy, st->naks);
+	}
+	if (st->retries[RETRY_BUS] || st->retries[RETRY_CRC] || st->retries[RETRY_TIMEOUT])
+		fprintf(st->out, "  retries: %lu bus errors, %lu CRC errors, %lu timeouts\n", st->retries[RETRY_BUS],
+			st->retries[RETRY_CRC], st->retries[RETRY_TIMEOUT]);
+
+	fprintf(st->out, "  bus: %lu transfers, %lu errors, %lu bytes, %.3f ms transferring, %.3f ms sleeping\n",
+		c->transfers, c->errors, c->bytes, c->xfer_ns / 1e6, c->sleep_ns / 1e6);
+	fprintf(st->out, "  buffers: %lu bytes copied, %lu allocations\n", c->copied, c->allocs);
+	fprintf(st->out, "  waits: %lu, %.3f ms requested, %.3f ms slept, worst oversleep %.3f ms\n", c->sleeps,
+		c->sleep_req_ns / 1e6, c->sleep_ns / 1e6, c->sleep_over_max_ns / 1e6);
+
+	if (!st->blocks)
+		return;
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		if (st->hist[i] > peak)
+			peak = st->hist[i];
+	}
+
+	fprintf(st->out, "  block latency:\n");
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		if (!st->hist[i])
+			continue;
+		fprintf(st->out, "    %8lu us+ %6u ", 1UL << i, st->hist[i]);
+		for (unsigned int n = 0; n < (st->hist[i] * 40 + peak - 1) / peak; n++)
+			fputc('#', st->out);
+		fputc('\n', st->out);
+	}
+}
+
+static void stats_print_json(struct update_stats *st, const struct micro_counters *c)
+{
+	const char *sep = "";
+	int i;
+
+	fprintf(st->out, "{\"phases_ms\":{");
+	for (i = 0; i < STATS_PHASE_MAX; i++) {
+		fprintf(st->out, "%s\"%s\":", i ? "," : "", phase_names[i]);
+		if (st->phase_ran & (1 << i))
+			fprintf(st->out, "%.3f", st->phase_ns[i] / 1e6);
+		else
+			fprintf(st->out, "null");
+	}
+	fprintf(st->out, "},\"open_wait\":{\"ms\":%.3f,\"polls\":%u,\"naks\":%u,\"prep_ms\":%.3f}",
+		st->open_wait.elapsed_us / 1e3, st->open_wait.polls, st->open_wait.naks, st->prep_us / 1e3);
+	fprintf(st->out, ",\"resumed_at\":%u", st->resumed_at);
+	fprintf(st->out,
+		",\"blocks\":%u,\"block_ms\":{\"avg\":%.3f,\"min\":%.3f,\"max\":%.3f,\"max_block\":%u,\"xfer_avg\":%.3f}",
+		st->blocks, st->blocks ? st->block_ns / 1e6 / st->blocks : 0.0,
+		st->blocks ? st->block_min_ns / 1e6 : 0.0, st->block_max_ns / 1e6, st->block_max_idx,
+		st->blocks ? st->block_xfer_ns / 1e6 / st->blocks : 0.0);
+	fprintf(st->out, ",\"polls\":%lu,\"status_wait\":%lu,\"naks\":%lu,\"max_polls\":%u,\"max_polls_block\":%u",
+		st->polls, st->busy, st->naks, st->block_max_polls, st->block_max_polls_idx);
+	fprintf(st->out, ",\"retries\":{\"bus\":%lu,\"crc\":%lu,\"timeout\":%lu}", st->retries[RETRY_BUS],
+		st->retries[RETRY_CRC], st->retries[RETRY_TIMEOUT]);
+	fprintf(st->out,
+		",\"bus\":{\"transfers\":%lu,\"errors\":%lu,\"bytes\":%lu,\"xfer_ms\":%.3f,\"sleep_ms\":%.3f,"
+		"\"copied\":%lu,\"allocs\":%lu,\"sleeps\":%lu,\"sleep_req_ms\":%.3f,\"sleep_over_max_ms\":%.3f}",
+		c->transfers, c->errors, c->bytes, c->xfer_ns / 1e6, c->sleep_ns / 1e6, c->copied, c->allocs, c->sleeps,
+		c->sleep_req_ns / 1e6, c->sleep_over_max_ns / 1e6);
+
+	/* Histogram as [lower bound us, count] pairs, empty buckets left out */
+	fprintf(st->out, ",\"block_hist_us\":[");
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		if (!st->hist[i])
+			continue;
+		fprintf(st->out, "%s[%lu,%u]", sep, 1UL << i, st->hist[i]);
+		sep = ",";
+	}
+	fprintf(st->out, "]}\n");
+}
+
+/*
+ * Print the statistics, once. Called by the update code when it is about to
+ * do something it may not come back from, and by the caller afterwards.
+ */
+void stats_report(micro_t *micro)
+{
+	struct update_stats *st = micro->stats;
+
+	if (!st || st->reported)
+		return;
+
+	st->reported = 1;
+	if (st->format == STATS_JSON)
+		stats_print_json(st, &micro->counters);
+	else
+		stats_print_text(st, &micro->counters);
+	fflush(st->out);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "micro.h"
+#include "update-shared.h"
+
+/*
+ * Update timing statistics
+ *
+ * When a micro_t has stats attached, the update code timestamps each phase
+ * and every block as it goes. Block latency, from the start of the block
+ * write until the micro reports it done, is also kept as a log2 histogram.
+ */
+enum stats_phase {
+	STATS_PHASE_OPEN, /* Header, erase, until the micro reports ready */
+	STATS_PHASE_BLOCKS,
+	STATS_PHASE_CLOSE, /* Close flash and apply */
+	STATS_PHASE_MAX,
+};
+
+enum stats_format {
+	STATS_TEXT,
+	STATS_JSON,
+};
+
+/* Bucket n holds latencies in [2^n, 2^(n+1)) microseconds, the last catches the rest */
+#define STATS_HIST_BUCKETS 22
+
+struct update_stats {
+	enum stats_format format;
+	FILE *out;
+	int reported;
+
+	uint64_t phase_start_ns[STATS_PHASE_MAX];
+	uint64_t phase_ns[STATS_PHASE_MAX];
+	unsigned int phase_ran;
+
+	unsigned int prep_us; /* Image preparation, overlapped with the open wait */
+	struct poll_result open_wait;
+	unsigned int resumed_at; /* First block written, when resuming an interrupted update */
+
+	unsigned int blocks;
+	uint64_t block_xfer_ns; /* Sum of time spent handing blocks over */
+	uint64_t block_ns; /* Sum of block latencies */
+	uint64_t block_min_ns;
+	uint64_t block_max_ns;
+	unsigned int block_max_idx;
+	unsigned long polls;
+	unsigned long busy; /* Samples that came back busy, i.e. STATUS_WAIT */
+	unsigned long naks;
+	unsigned int block_max_polls;
+	unsigned int block_max_polls_idx;
+	unsigned int hist[STATS_HIST_BUCKETS];
+	unsigned long retries[RETRY_REASON_MAX];
+};
+
+void stats_init(struct update_stats *st, enum stats_format format, FILE *out);
+void stats_phase_begin(micro_t *micro, enum stats_phase phase);
+void stats_phase_end(micro_t *micro, enum stats_phase phase);
+void stats_prepare(micro_t *micro, unsigned int us);
+void stats_open_wait(micro_t *micro, const struct poll_result *pres);
+void stats_resume(micro_t *micro, unsigned int blk);
+void stats_block(micro_t *micro, unsigned int idx, uint64_t start_ns, uint64_t xfer_ns, const struct poll_result *pres);
+void stats_retry(micro_t *micro, enum retry_reason reason);
+void stats_report(micro_t *micro);
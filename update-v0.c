@@ -10,6 +10,9 @@
 #include "micro.h"
 #include "crc8.h"
 #include "update-shared.h"
+#include "update-v0.h"
+#include "update-stats.h"
+#include "update-sm.h"
 
 struct micro_update_footer_v0 {
 	uint32_t bin_size;
@@ -21,25 +24,13 @@ struct micro_update_footer_v0 {
 } __attribute__((packed));
 
 #define FTR_V0_SZ 19
-int micro_update_parse_footer_v0(int binfd, struct micro_update_footer_v0 *ftr)
-{
-	uint8_t data[FTR_V0_SZ];
-	off_t full_size;
-	int ret;
-
-	full_size = lseek(binfd, 0, SEEK_END);
-	lseek(binfd, (full_size - FTR_V0_SZ), SEEK_SET);
-
-	ret = read(binfd, &data, FTR_V0_SZ);
-	if (ret < 0) {
-		perror("Reading footer failed");
-		goto err_out;
-	}
-	if (ret != FTR_V0_SZ) {
-		fprintf(stderr, "Did not read correct footer size\n");
-		goto err_out;
-	}
 
+/*
+ * Check the footer in data, the last FTR_V0_SZ bytes of a file full_size
+ * long. Returns NULL if it is good, otherwise what is wrong with it.
+ */
+static const char *v0_check_footer(const uint8_t *data, size_t full_size, struct micro_update_footer_v0 *ftr)
+{
 	/* Note:
 	 * This is an intentional choice as it was noted that different compilers
 	 * appear to do different things when attempting to memcpy the entire
@@ -52,23 +43,37 @@ int micro_update_parse_footer_v0(int binfd, struct micro_update_footer_v0 *ftr)
 	ftr->footer_version = data[7];
 	memcpy(&ftr->magic, &data[8], 11);
 
-	if (strncmp("TS_UC_RA4M2", (char *)&ftr->magic, 11) != 0) {
-		fprintf(stderr, "Invalid update file\n");
-		goto err_out;
-	}
+	if (strncmp("TS_UC_RA4M2", (char *)&ftr->magic, 11) != 0)
+		return "Invalid update file";
 
 	/* Ensure that the bin_size specified by the footer both matches the
 	 * actual size of the binary as well as it not being more than 128 kbyte
 	 * (which is the max size an update can be on this platform).
 	 */
-	if (ftr->bin_size != (full_size - FTR_V0_SZ) || ftr->bin_size > 128 * 1024) {
-		fprintf(stderr, "Bin size is incorrect\n");
+	if (ftr->bin_size != (full_size - FTR_V0_SZ) || ftr->bin_size > 128 * 1024)
+		return "Bin size is incorrect";
+
+	/* Check file is 128-byte aligned */
+	if (ftr->bin_size & 0x7F)
+		return "Update binary is not 128-byte aligned.";
+
+	return NULL;
+}
+
+/* As v0_check_footer(), from tail, the last tail_len bytes of the file, saying what is wrong */
+int micro_update_parse_footer_v0(const uint8_t *tail, size_t tail_len, size_t full_size,
+			       struct micro_update_footer_v0 *ftr)
+{
+	const char *err;
+
+	if (tail_len < FTR_V0_SZ || full_size < FTR_V0_SZ) {
+		fprintf(stderr, "Did not read correct footer size\n");
 		goto err_out;
 	}
 
-	/* Check file is 128-byte aligned */
-	if (ftr->bin_size & 0x7F) {
-		fprintf(stderr, "Update binary is not 128-byte aligned.\n");
+	err = v0_check_footer(&tail[tail_len - FTR_V0_SZ], full_size, ftr);
+	if (err) {
+		fprintf(stderr, "%s\n", err);
 		goto err_out;
 	}
 
@@ -78,6 +83,29 @@ err_out:
 	return -1;
 }
 
+/*
+ * Quietly check whether tail, the last tail_len bytes of a file full_size
+ * long, ends in a V0 footer, and if so fill in info from it. Returns < 0 if
+ * it does not.
+ */
+int do_v0_micro_probe_footer(const uint8_t *tail, size_t tail_len, size_t full_size, struct update_footer_info *info)
+{
+	struct micro_update_footer_v0 ftr;
+
+	if (tail_len < FTR_V0_SZ || full_size < FTR_V0_SZ)
+		return -1;
+
+	if (v0_check_footer(&tail[tail_len - FTR_V0_SZ], full_size, &ftr))
+		return -1;
+
+	info->bin_size = ftr.bin_size;
+	info->revision = ftr.revision;
+	info->model = 0;
+	info->footer_version = ftr.footer_version;
+
+	return 0;
+}
+
 /* Pack the struct to be sure it is only as large as we need */
 struct open_header {
 	uint32_t magic_key;
@@ -86,181 +114,284 @@ struct open_header {
 	uint8_t crc;
 } __attribute__((packed));
 
-int do_v0_micro_get_rev(board_t *board, int i2cfd, int *revision)
+/*
+ * Fill in micro->snap, unless it already is. The V0 micro only has its
+ * revision to offer, at the end of its 32-byte register file. Returns < 0 on
+ * failure.
+ */
+int do_v0_micro_snapshot(board_t *board, micro_t *micro)
 {
 	uint8_t buf[32];
 
-	if (v0_stream_read(i2cfd, board->i2c_chip, buf, 32) < 0) {
-		fprintf(stderr, "Unable to get revision\n");
+	/* Unused */
+	(void)board;
+
+	if (micro->snap.valid)
+		return 0;
+
+	if (v0_stream_read(micro, buf, 32) < 0)
 		return -1;
-	}
-	*revision = (buf[30] << 8) | buf[31];
+
+	memset(&micro->snap, 0, sizeof(micro->snap));
+	micro->snap.revision = (buf[30] << 8) | buf[31];
+	micro->snap.valid = 1;
 
 	return 0;
 }
 
-int do_v0_micro_print_info(board_t *board, int i2cfd)
+int do_v0_micro_get_rev(board_t *board, micro_t *micro, int *revision)
 {
-	int revision;
-
-	if (do_v0_micro_get_rev(board, i2cfd, &revision) < 0)
+	if (do_v0_micro_snapshot(board, micro) < 0) {
+		fprintf(stderr, "Unable to get revision\n");
 		return -1;
+	}
+	*revision = micro->snap.revision;
 
-	printf("revision=%d\n", revision);
 	return 0;
 }
 
-int do_v0_micro_get_file_rev(board_t *board, int *revision, char *update_path)
+int do_v0_micro_open_image(board_t *board, struct update_image *img, char *update_path)
 {
 	struct micro_update_footer_v0 ftr;
-	int binfd;
-	int ret = 0;
 
-	/* Unused */
-	(void)board;
+	if (update_image_map(img, update_path, board) < 0)
+		return -1;
 
-	binfd = open(update_path, O_RDONLY | O_RSYNC);
-	if (binfd < 0) {
-		perror("Unable to open update file");
-		ret = -1;
-		goto out;
-	}
+	if (micro_update_parse_footer_v0(img->tail, img->tail_len, img->full_size, &ftr) < 0)
+		goto err_out;
 
-	if (micro_update_parse_footer_v0(binfd, &ftr) < 0)
-		ret = -1;
+	img->revision = ftr.revision;
+	if (update_image_set_bin(img, ftr.bin_size) < 0)
+		goto err_out;
 
-	if (close(binfd) < 0) {
-		perror("Unable to close update file");
-		ret = -1;
-	}
+	return 0;
 
-	*revision = ftr.revision;
+err_out:
+	update_image_close(img);
+	return -1;
+}
+
+/*
+ * The micro stalls the bus while it decrypts and programs a block, so its
+ * status is left alone this long after each one.
+ */
+#define V0_BLOCK_HOLDOFF_US 2000
 
-out:
-	return ret;
+static int v0_read_flash_status(micro_t *micro, uint8_t *status)
+{
+	return v0_stream_read_quiet(micro, status, 1);
 }
 
+/* The update as a state machine, see update-sm.h */
+enum v0_state {
+	V0_START,
+	V0_HEADER,
+	V0_OPENING,
+	V0_BLOCK, /* Send the next block, or finish */
+	V0_BLOCK_WAIT,
+	V0_BLOCK_EXTEND, /* Backed off from a slow block, wait on it again */
+	V0_RESET,
+	V0_RESET_WAIT,
+};
+
 /*
  * The v0 is very similar to the v1 update mechanism, but as the
  * supervisor that supports in field updates was deployed around an existing
  * design, we could not change the register interface to be compatible. This
  * method works around the existing 7970 i2c register set
  */
-int do_v0_micro_update(board_t *board, int i2cfd, char *update_path)
+static int v0_update_step(struct update_sm *sm)
 {
-	struct micro_update_footer_v0 ftr;
+	micro_t *micro = sm->micro;
+	struct update_image *img = sm->img;
 	struct open_header hdr;
-	uint8_t buf[129];
-	int binfd;
 	int ret;
-	int i;
-	int retry_count;
 
-	binfd = open(update_path, O_RDONLY | O_RSYNC);
-	if (binfd < 0) {
-		perror("Error opening update file");
-		return -1;
-	}
+	for (;;) {
+		switch (sm->state) {
+		case V0_START:
+			sm->block_cfg = poll_cfg_block;
+			sm->block_holdoff_us = V0_BLOCK_HOLDOFF_US;
+			if (sm->block_cfg.initial_us < sm->block_holdoff_us)
+				sm->block_cfg.initial_us = sm->block_holdoff_us;
 
-	if (micro_update_parse_footer_v0(binfd, &ftr) < 0)
-		goto err_out;
+			fflush(stdout);
 
-	fflush(stdout);
+			/*
+			 * Let the message print out.  Some of the flash operations will
+			 * cause the micro to drop some chars if they output while we touch 
+			 * flash 
+			 */
+			sm->state = V0_HEADER;
+			return update_sm_wait_us(sm, 1000 * 10);
 
-	/*
-	 * Let the message print out.  Some of the flash operations will
-	 * cause the micro to drop some chars if they output while we touch 
-	 * flash 
-	 */
-	usleep(1000 * 10);
+		case V0_HEADER:
+			hdr.magic_key = 0xf092c858;
+			hdr.loc = 0x28000;
+			hdr.len = img->bin_size;
+			hdr.crc = crc8((uint8_t *)&hdr, (sizeof(struct open_header) - 1));
 
-	lseek(binfd, 0, SEEK_SET);
+			stats_phase_begin(micro, STATS_PHASE_OPEN);
 
-	hdr.magic_key = 0xf092c858;
-	hdr.loc = 0x28000;
-	hdr.len = ftr.bin_size;
-	hdr.crc = crc8((uint8_t *)&hdr, (sizeof(struct open_header) - 1));
+			/* Whatever the micro reports may change from here on */
+			micro->snap.valid = 0;
 
-	/* Write magic key and length/location information */
-	if (v0_stream_write(i2cfd, board->i2c_chip, (uint8_t *)&hdr, 13) < 0) {
-		fprintf(stderr, "Failed to write header to I2C");
-		goto err_out;
-	}
+			/* Write magic key and length/location information */
+			if (v0_stream_write(micro, (uint8_t *)&hdr, 13) < 0) {
+				fprintf(stderr, "Failed to write header to I2C");
+				goto err_out;
+			}
 
-	/*
-	 * Wait a bit, the flash needs to open, erase, and blank check.
-	 * Could also loop on I2C read for STATUS_READY to be set
-	 */
-	usleep(1000000);
+			if (update_prepare_during_open(micro, img, &sm->open_cfg) < 0)
+				goto err_out;
 
-	if (v0_stream_read(i2cfd, board->i2c_chip, buf, 1) < 0) {
-		fprintf(stderr, "Failed to read device state, aborting!");
-		goto err_out;
-	}
+			/* The flash needs to open, erase, and blank check; poll for STATUS_READY */
+			poll_begin(&sm->poll, &sm->open_cfg, v0_read_flash_status, poll_busy_opening, NULL);
+			sm->state = V0_OPENING;
+			break;
+
+		case V0_OPENING:
+			ret = poll_step(&sm->poll, micro, &sm->flash_sts);
+			if (ret == POLL_AGAIN)
+				return update_sm_wait_poll(sm);
+			if (ret < 0) {
+				fprintf(stderr, "Failed to read device state after %u ms, aborting!",
+					sm->poll.res.elapsed_us / 1000);
+				goto err_out;
+			}
 
-	if (buf[0] != STATUS_READY) {
-		fprintf(stderr, "Device failed to report as opened, aborting!");
-		goto err_out;
-	}
+			if (sm->flash_sts != STATUS_READY) {
+				fprintf(stderr, "Device failed to report as opened, aborting!");
+				goto err_out;
+			}
 
-	/* Write BIN to MCU via I2C */
-	for (i = ftr.bin_size; i; i -= 128) {
-		printf("\r%d/%d", ftr.bin_size - i, ftr.bin_size);
-		fflush(stdout);
-		ret = read(binfd, buf, 128);
-		if (ret < 0) {
-			fprintf(stderr, "Error reading from bin file\n");
-			goto err_out;
-		} else if (ret < 128) {
-			fprintf(stderr, "Short read from bin, got %d, expected 128", ret);
-			goto err_out;
-		} else {
-			buf[128] = crc8(buf, 128);
-			if (v0_stream_write(i2cfd, board->i2c_chip, buf, 129) < 0) {
+			stats_open_wait(micro, &sm->poll.res);
+			stats_phase_end(micro, STATS_PHASE_OPEN);
+			stats_phase_begin(micro, STATS_PHASE_BLOCKS);
+
+			/*
+			 * Write BIN to MCU via I2C. A block rejected for its CRC is sent again,
+			 * but there is no telling whether a block that failed on the bus was
+			 * taken, so that stays fatal.
+			 */
+			sm->blk = 0;
+			sm->state = V0_BLOCK;
+			break;
+
+		case V0_BLOCK:
+			if (sm->blk >= img->nblocks) {
+				stats_phase_end(micro, STATS_PHASE_BLOCKS);
+				printf("\n");
+
+				if (sm->flash_sts == STATUS_DONE)
+					printf("Update successful, rebooting uC\n");
+				else
+					printf("Update incomplete but not errored, rebooting uC\n");
+
+				/* The reset below takes the whole system down, report while we can */
+				stats_report(micro);
+
+				/* Give time for the message to go to the console */
+				fflush(stdout);
+				sm->state = V0_RESET;
+				return update_sm_wait_us(sm, 1000000);
+			}
+
+			memcpy(sm->buf, &img->bin[sm->blk * UPDATE_BLOCK_SZ], UPDATE_BLOCK_SZ);
+			sm->buf[UPDATE_BLOCK_SZ] = img->block_crc[sm->blk];
+			sm->block_start = micro_now_ns();
+			if (v0_stream_write(micro, sm->buf, 129) < 0) {
 				fprintf(stderr, "Failed to write block\n");
 				goto err_out;
 			}
+			sm->block_xfer = micro_now_ns() - sm->block_start;
 
 			/* There is some unknown amount of time for a write to
 			 * complete, its based on the current uC and flash controller
-			 * clocks, but 2 milliseconds should be enough in most cases.
-			 * Most of the time is taken up by the decryption of the
-			 * data block. However, the actual flash write is a non-zero
-			 * time too. During which interrupts are disabled for flash
-			 * safety. The timeout helps ensure the process completes
-			 * before we start polling for state.
+			 * clocks. Most of the time is taken up by the decryption of
+			 * the data block. However, the actual flash write is a
+			 * non-zero time too. During which interrupts are disabled
+			 * for flash safety, and the micro may NAK. So nothing is
+			 * read back until V0_BLOCK_HOLDOFF_US has passed.
 			 */
-			usleep(2000);
-			retry_count = 100;
-			do {
-				usleep(10);
-				v0_stream_read(i2cfd, board->i2c_chip, buf, 1);
-				if (!retry_count--)
-					break;
-			} while (buf[0] == STATUS_WAIT);
-
-			if ((buf[0] != STATUS_IN_PROC) && (buf[0] != STATUS_DONE)) {
-				flash_print_error(buf[0]);
+			poll_begin(&sm->poll, &sm->block_cfg, v0_read_flash_status, poll_busy_writing, NULL);
+			sm->state = V0_BLOCK_WAIT;
+			break;
+
+		case V0_BLOCK_WAIT:
+			ret = poll_step(&sm->poll, micro, &sm->flash_sts);
+			if (ret == POLL_AGAIN)
+				return update_sm_wait_poll(sm);
+			if (ret < 0) {
+				/* A slow block is still a block in progress, give it longer */
+				if (errno == ETIMEDOUT) {
+					ret = update_retry(micro, &retry_policy_block, &sm->tries, RETRY_TIMEOUT);
+					if (ret >= 0) {
+						sm->state = V0_BLOCK_EXTEND;
+						return update_sm_wait_us(sm, ret);
+					}
+				}
+				fprintf(stderr, "\nTimed out waiting for block write (%u ms)\n",
+					sm->poll.res.elapsed_us / 1000);
+				goto err_out;
+			}
+
+			if (sm->flash_sts == STATUS_CRC_ERR) {
+				ret = update_retry(micro, &retry_policy_block, &sm->tries, RETRY_CRC);
+				if (ret >= 0) {
+					sm->state = V0_BLOCK;
+					return update_sm_wait_us(sm, ret);
+				}
+			}
+
+			if ((sm->flash_sts != STATUS_IN_PROC) && (sm->flash_sts != STATUS_DONE)) {
+				flash_print_error(sm->flash_sts);
 				goto err_out;
 			}
+
+			stats_block(micro, sm->blk, sm->block_start, sm->block_xfer, &sm->poll.res);
+			if (!sm->tries)
+				poll_cfg_block_learn(&sm->block_cfg, &sm->poll.res, sm->block_holdoff_us);
+			update_progress(micro, (sm->blk + 1) * UPDATE_BLOCK_SZ, img->bin_size);
+			sm->blk++;
+			sm->tries = 0;
+			sm->state = V0_BLOCK;
+			break;
+
+		case V0_BLOCK_EXTEND:
+			poll_begin(&sm->poll, &sm->block_cfg, v0_read_flash_status, poll_busy_writing, NULL);
+			sm->state = V0_BLOCK_WAIT;
+			break;
+
+		case V0_RESET:
+			/* Provoke microcontroller reset */
+			sm->buf[1] = STATUS_RESET;
+			v0_stream_write(micro, &sm->buf[1], 1);
+			sm->state = V0_RESET_WAIT;
+			return update_sm_wait_us(sm, 1000000);
+
+		case V0_RESET_WAIT:
+			/* If we're returning at all, something has gone wrong */
+			goto err_out;
 		}
 	}
-	printf("\n");
-
-	if (buf[0] == STATUS_DONE)
-		printf("Update successful, rebooting uC\n");
-	else
-		printf("Update incomplete but not errored, rebooting uC\n");
-
-	/* Give time for the message to go to the console */
-	fflush(stdout);
-	sleep(1);
-	/* Provoke microcontroller reset */
-	buf[1] = STATUS_RESET;
-	v0_stream_write(i2cfd, board->i2c_chip, &buf[1], 1);
-	sleep(1);
-	/* If we're returning at all, something has gone wrong */
+
 err_out:
-	close(binfd);
-	return -1;
+	return UPDATE_SM_FAILED;
+}
+
+/* Set sm up to update micro with img, see update-sm.h */
+void do_v0_micro_update_start(struct update_sm *sm, board_t *board, micro_t *micro, struct update_image *img)
+{
+	update_sm_init(sm, v0_update_step, board, micro, img);
+	sm->state = V0_START;
+}
+
+int do_v0_micro_update(board_t *board, micro_t *micro, struct update_image *img)
+{
+	struct update_sm sm;
+
+	do_v0_micro_update_start(&sm, board, micro, img);
+
+	return update_sm_run(&sm);
 }
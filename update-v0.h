@@ -1,8 +1,12 @@
 #pragma once
 
+#include "micro.h"
 #include "update-shared.h"
+#include "update-sm.h"
 
-int do_v0_micro_update(board_t *board, int i2cfd, char *update_path);
-int do_v0_micro_get_rev(board_t *board, int i2cfd, int *revision);
-int do_v0_micro_get_file_rev(board_t *board, int *revision, char *update_path);
-int do_v0_micro_print_info(board_t *board, int i2cfd);
+int do_v0_micro_update(board_t *board, micro_t *micro, struct update_image *img);
+void do_v0_micro_update_start(struct update_sm *sm, board_t *board, micro_t *micro, struct update_image *img);
+int do_v0_micro_get_rev(board_t *board, micro_t *micro, int *revision);
+int do_v0_micro_open_image(board_t *board, struct update_image *img, char *update_path);
+int do_v0_micro_probe_footer(const uint8_t *tail, size_t tail_len, size_t full_size, struct update_footer_info *info);
+int do_v0_micro_snapshot(board_t *board, micro_t *micro);
@@ -10,63 +10,10 @@
 #include "micro.h"
 #include "crc8.h"
 #include "update-shared.h"
-
-#define SUPER_MODEL 0
-#define SUPER_REV_INFO 1
-#define SUPER_ADC_CHAN_ADV 2
-#define SUPER_FEATURES0 3
-#define SUPER_CMDS 8
-#define SUPER_GEN_FLAGS 16
-#define SUPER_GEN_INPUTS 24
-#define SUPER_ADC_BASE 128
-#define SUPER_TEMPERATURE 159
-
-#define SUPER_FL_MAGIC_KEY0 65024 // 0xFE00
-#define SUPER_FL_MAGIC_KEY1 65025 // 0xFE01
-#define SUPER_FL_SZ0 65030 // 0xFE06
-#define SUPER_FL_SZ1 65031 // 0xFE07
-#define SUPER_FL_BLOCK_DATA 65033 // 0xFE09 /* 128 bytes long, or 64 16-bit registers */
-#define SUPER_FL_BLOCK_CRC 65097 // 0xFE49
-#define SUPER_FL_FLASH_CMD 65098 // 0xFE4A
-#define SUPER_FL_FLASH_STS 65099 // 0xFE4B
-#define SUPER_FL_BLOCK_DATA_LEN 64
-
-enum super_flash_status {
-	SUPER_UPDATE_ON_REBOOT = (1 << 8), /* Set when the APPLY_REBOOT command is issued */
-	/* Bits 7:0 are STATUS_ from flashwrite */
-};
-
-enum super_flash_cmd {
-	SUPER_APPLY_REBOOT = (1 << 3),
-	SUPER_CLOSE_FLASH = (1 << 2),
-	SUPER_OPEN_FLASH = (1 << 1),
-	SUPER_WRITE_BLOCK = (1 << 0),
-};
-
-/* Some return values of tend() */
-enum i2c_cmds_t {
-	I2C_NOCMD = (0 << 0),
-	I2C_REBOOT = (1 << 0),
-	I2C_HALT = (1 << 1),
-};
-
-enum gen_flags_t {
-	GEN_FLAG_LED_DAT = (1 << 3),
-	GEN_FLAG_OVERRIDE_LED = (1 << 2),
-	GEN_FLAG_WAKE_EN = (1 << 1),
-	GEN_FLAG_ALARM_TYPE = (1 << 0),
-};
-
-enum gen_inputs_t {
-	GEN_INPUTS_USB_VBUS = (1 << 1),
-	GEN_INPUTS_EN_DB9_CONSOLE = (1 << 0),
-};
-
-enum super_features_t {
-	SUPER_FEAT_SN = (1 << 2),
-	SUPER_FEAT_FWUPD = (1 << 1),
-	SUPER_FEAT_RSTC = (1 << 0),
-};
+#include "update-v1.h"
+#include "update-stats.h"
+#include "update-journal.h"
+#include "update-sm.h"
 
 struct micro_update_footer_v1 {
 	uint32_t bin_size;
@@ -79,25 +26,13 @@ struct micro_update_footer_v1 {
 } __attribute__((packed));
 
 #define FTR_V1_SZ (22U)
-int micro_update_parse_footer_v1(int binfd, struct micro_update_footer_v1 *ftr)
-{
-	uint8_t data[FTR_V1_SZ];
-	off_t full_size;
-	int ret;
-
-	full_size = lseek(binfd, 0, SEEK_END);
-	lseek(binfd, (full_size - FTR_V1_SZ), SEEK_SET);
-
-	ret = read(binfd, &data, FTR_V1_SZ);
-	if (ret < 0) {
-		perror("Unable to read footer");
-		goto err_out;
-	}
-	if (ret != FTR_V1_SZ) {
-		fprintf(stderr, "Did not read correct footer size\n");
-		goto err_out;
-	}
 
+/*
+ * Check the footer in data, the last FTR_V1_SZ bytes of a file full_size
+ * long. Returns NULL if it is good, otherwise what is wrong with it.
+ */
+static const char *v1_check_footer(const uint8_t *data, size_t full_size, struct micro_update_footer_v1 *ftr)
+{
 	memcpy(&ftr->bin_size, &data[0], 4);
 	memcpy(&ftr->model, &data[4], 2);
 	memcpy(&ftr->revision, &data[6], 2);
@@ -106,23 +41,37 @@ int micro_update_parse_footer_v1(int binfd, struct micro_update_footer_v1 *ftr)
 	ftr->footer_version = data[10];
 	memcpy(&ftr->magic, &data[11], 11);
 
-	if (strncmp("TS_UC_RA4M2", (char *)&ftr->magic, 11) != 0) {
-		fprintf(stderr, "Invalid update file\n");
-		goto err_out;
-	}
+	if (strncmp("TS_UC_RA4M2", (char *)&ftr->magic, 11) != 0)
+		return "Invalid update file";
 
 	/* Ensure that the bin_size specified by the footer both matches the
 	 * actual size of the binary as well as it not being more than 128 kbyte
 	 * (which is the max size an update can be on this platform).
 	 */
-	if (ftr->bin_size != (full_size - FTR_V1_SZ) || ftr->bin_size > 128 * 1024) {
-		fprintf(stderr, "Bin size is incorrect\n");
+	if (ftr->bin_size != (full_size - FTR_V1_SZ) || ftr->bin_size > 128 * 1024)
+		return "Bin size is incorrect";
+
+	/* Check file is 128-byte aligned */
+	if (ftr->bin_size & 0x7F)
+		return "Update binary is not 128-byte aligned.";
+
+	return NULL;
+}
+
+/* As v1_check_footer(), from tail, the last tail_len bytes of the file, saying what is wrong */
+int micro_update_parse_footer_v1(const uint8_t *tail, size_t tail_len, size_t full_size,
+			       struct micro_update_footer_v1 *ftr)
+{
+	const char *err;
+
+	if (tail_len < FTR_V1_SZ || full_size < FTR_V1_SZ) {
+		fprintf(stderr, "Did not read correct footer size\n");
 		goto err_out;
 	}
 
-	/* Check file is 128-byte aligned */
-	if (ftr->bin_size & 0x7F) {
-		fprintf(stderr, "Update binary is not 128-byte aligned.\n");
+	err = v1_check_footer(&tail[tail_len - FTR_V1_SZ], full_size, ftr);
+	if (err) {
+		fprintf(stderr, "%s\n", err);
 		goto err_out;
 	}
 
@@ -132,254 +81,749 @@ err_out:
 	return -1;
 }
 
-int do_v1_micro_get_rev(board_t *board, int i2cfd, int *revision)
-{
-	if (speek16(i2cfd, board->i2c_chip, SUPER_REV_INFO, (uint16_t *)revision) < 0) {
-		fprintf(stderr, "Unable to get revision\n");
-		return -1;
-	}
-	*revision &= 0x7fff;
-
-	return 0;
-}
-
-int do_v1_micro_print_info(board_t *board, int i2cfd)
+/*
+ * Quietly check whether tail, the last tail_len bytes of a file full_size
+ * long, ends in a V1 footer, and if so fill in info from it. Returns < 0 if
+ * it does not.
+ */
+int do_v1_micro_probe_footer(const uint8_t *tail, size_t tail_len, size_t full_size, struct update_footer_info *info)
 {
-	uint16_t revision, modelnum;
+	struct micro_update_footer_v1 ftr;
 
-	if (speek16(i2cfd, board->i2c_chip, SUPER_MODEL, &modelnum) < 0)
+	if (tail_len < FTR_V1_SZ || full_size < FTR_V1_SZ)
 		return -1;
-	if (speek16(i2cfd, board->i2c_chip, SUPER_REV_INFO, &revision) < 0)
+
+	if (v1_check_footer(&tail[tail_len - FTR_V1_SZ], full_size, &ftr))
 		return -1;
 
-	printf("modelnum=0x%04X\n", modelnum);
-	if (board->compatible_id && (board->compatible_id != modelnum))
-		printf("compatible=0x%04X\n", board->compatible_id);
-	printf("revision=%d\n", revision & 0x7fff);
-	printf("dirty=%d\n", !!(revision & (1 << 15)));
+	info->bin_size = ftr.bin_size;
+	info->revision = ftr.revision;
+	info->model = ftr.model;
+	info->footer_version = ftr.footer_version;
+
 	return 0;
 }
 
-int do_v1_micro_get_file_rev(board_t *board, int *revision, char *update_path)
+/*
+ * Fill in micro->snap, unless it already is, with one burst read of the
+ * registers from SUPER_MODEL through SUPER_GEN_INPUTS. Returns < 0 on failure.
+ */
+int do_v1_micro_snapshot(board_t *board, micro_t *micro)
 {
-	struct micro_update_footer_v1 ftr;
-	int binfd;
-	int ret = 0;
+	uint16_t regs[SUPER_GEN_INPUTS + 1];
+	struct micro_snapshot *snap = &micro->snap;
 
 	/* Unused */
 	(void)board;
 
-	binfd = open(update_path, O_RDONLY | O_RSYNC);
-	if (binfd < 0) {
-		perror("Unable to open update file");
-		ret = -1;
-		goto out;
+	if (snap->valid)
+		return 0;
+
+	if (speekstream16(micro, SUPER_MODEL, regs, sizeof(regs)) < 0) {
+		fprintf(stderr, "Unable to read supervisor registers\n");
+		return -1;
 	}
 
-	if (micro_update_parse_footer_v1(binfd, &ftr) < 0)
-		ret = -1;
+	snap->model = regs[SUPER_MODEL];
+	snap->revision = regs[SUPER_REV_INFO];
+	snap->adc_chan_adv = regs[SUPER_ADC_CHAN_ADV];
+	snap->features = regs[SUPER_FEATURES0];
+	snap->cmds = regs[SUPER_CMDS];
+	snap->gen_flags = regs[SUPER_GEN_FLAGS];
+	snap->gen_inputs = regs[SUPER_GEN_INPUTS];
+	snap->valid = 1;
 
-	if (close(binfd) < 0) {
-		perror("Unable to close update file");
-		ret = -1;
-	}
+	return 0;
+}
 
-	*revision = ftr.revision;
+int do_v1_micro_get_rev(board_t *board, micro_t *micro, int *revision)
+{
+	if (do_v1_micro_snapshot(board, micro) < 0) {
+		fprintf(stderr, "Unable to get revision\n");
+		return -1;
+	}
+	*revision = micro->snap.revision & 0x7fff;
 
-out:
-	return ret;
+	return 0;
 }
 
-int do_v1_micro_update(board_t *board, int i2cfd, char *update_path)
+int do_v1_micro_open_image(board_t *board, struct update_image *img, char *update_path)
 {
-	uint16_t status;
-	uint16_t crc;
-	uint32_t bin_size;
 	struct micro_update_footer_v1 ftr;
-	uint16_t buf[64];
-	int binfd;
-	int ret;
-	int i;
-	int retry_count;
 
-	binfd = open(update_path, O_RDONLY | O_RSYNC);
-	if (binfd < 0) {
-		perror("Error opening update file");
+	if (update_image_map(img, update_path, board) < 0)
 		return -1;
-	}
 
-	if (speek16(i2cfd, board->i2c_chip, SUPER_FEATURES0, &status) < 0)
+	if (micro_update_parse_footer_v1(img->tail, img->tail_len, img->full_size, &ftr) < 0)
 		goto err_out;
 
-	if (!(status & SUPER_FEAT_FWUPD)) {
-		fprintf(stderr, "Firmware does not support updates. (0x%X)\n", status);
+	if ((ftr.model != board->modelnum) && (ftr.model != board->compatible_id)) {
+		fprintf(stderr, "This update is for a %04X, not a %04X.\n", ftr.model, board->modelnum);
 		goto err_out;
 	}
 
-	if (micro_update_parse_footer_v1(binfd, &ftr) < 0)
+	img->revision = ftr.revision;
+	img->model = ftr.model;
+	if (update_image_set_bin(img, ftr.bin_size) < 0)
 		goto err_out;
 
-	if ((ftr.model != board->modelnum) && (ftr.model != board->compatible_id)) {
-		fprintf(stderr, "This update is for a %04X, not a %04X.\n", ftr.model, board->modelnum);
-		goto err_out;
-	}
+	return 0;
 
-	/* gcc warns this pointer has alignment issues in packed structure. */
-	bin_size = (uint32_t)ftr.bin_size;
+err_out:
+	update_image_close(img);
+	return -1;
+}
 
-	fflush(stdout);
+/* Largest block we will send, the whole write has to fit in one I2C message */
+#define V1_XBLOCK_MAX 2048
 
-	/*
-	 * Let the messages print out. Some of the flash operations will
-	 * cause the micro to drop some chars if they output while we touch 
-	 * flash 
-	 */
-	usleep(1000 * 10);
+/*
+ * Firmware that takes a block in separate writes stalls the bus while it
+ * decrypts and programs it, so its status is left alone this long first.
+ */
+#define V1_LEGACY_HOLDOFF_US 2000
 
-	/* Write magic key and length/location information */
-	if (spokestream16(i2cfd, board->i2c_chip, SUPER_FL_MAGIC_KEY0, (uint16_t *)&magic_key, 4) < 0) {
-		fprintf(stderr, "Failed to write magic key");
-		goto err_out;
+/* Firmware that takes a whole block in one write answers a status read right behind it */
+#define V1_FEAT_ONE_WRITE (SUPER_FEAT_BLKCMT | SUPER_FEAT_XBLOCK)
+
+/*
+ * Pick the largest power of two block size, up to V1_XBLOCK_MAX, that the
+ * firmware will take and tell it. Firmware without SUPER_FEAT_XBLOCK stays
+ * at 128 bytes. Returns the block size, or < 0 on failure.
+ */
+static int v1_negotiate_block_size(micro_t *micro, uint16_t features)
+{
+	uint16_t fw_max;
+	int block_sz = UPDATE_BLOCK_SZ;
+
+	if (!(features & SUPER_FEAT_XBLOCK))
+		return block_sz;
+
+	if (speek16(micro, SUPER_FL_XBLOCK_MAX, &fw_max) < 0)
+		return -1;
+
+	while (block_sz * 2 <= V1_XBLOCK_MAX && block_sz * 2 <= fw_max)
+		block_sz *= 2;
+
+	if (spoke16(micro, SUPER_FL_XBLOCK_LEN, block_sz) < 0)
+		return -1;
+
+	return block_sz;
+}
+
+/*
+ * Hand one block, already placed at micro_xfer_payload(), to the micro and
+ * kick off the write. If sts is not NULL the flash status is read back in the
+ * same transaction, as the first sample of the wait for the block, which only
+ * firmware with V1_FEAT_ONE_WRITE can be asked for.
+ *
+ * The block data, CRC, and command registers are contiguous, so firmware that
+ * advertises SUPER_FEAT_BLKCMT will take all three in a single auto-incrementing
+ * write, with the two trailing registers filled in right behind the data.
+ * Older firmware gets the three separate transactions it has always expected,
+ * each ended by a STOP. With SUPER_FEAT_XBLOCK the same single write goes through
+ * the large block window, where len may be anything up to the negotiated block
+ * size block_sz. Only the last block can be short, the micro is told how short
+ * first.
+ *
+ * Returns < 0 on failure, 0 on success
+ */
+static int v1_write_block(micro_t *micro, uint16_t features, unsigned int block_sz, unsigned int len, uint16_t crc,
+			  uint16_t *sts)
+{
+	uint16_t *buf = micro_xfer_payload(micro);
+	struct micro_batch batch;
+
+	if (!(features & V1_FEAT_ONE_WRITE)) {
+		if (spokebuf16(micro, SUPER_FL_BLOCK_DATA, 128) < 0 || spoke16(micro, SUPER_FL_BLOCK_CRC, crc) < 0 ||
+		    spoke16(micro, SUPER_FL_FLASH_CMD, SUPER_WRITE_BLOCK) < 0)
+			return -1;
+		return 0;
 	}
 
-	if (spokestream16(i2cfd, board->i2c_chip, SUPER_FL_SZ0, (uint16_t *)&bin_size, 4) < 0) {
-		fprintf(stderr, "Failed to write bin length");
-		goto err_out;
+	micro_batch_init(&batch, micro);
+
+	if (features & SUPER_FEAT_XBLOCK) {
+		if (len != block_sz)
+			micro_batch_poke16(&batch, SUPER_FL_XBLOCK_LEN, len);
+		buf[len / 2] = crc;
+		buf[len / 2 + 1] = SUPER_WRITE_BLOCK;
+		micro_batch_pokebuf16(&batch, SUPER_FL_XBLOCK_DATA, len + 2 * sizeof(uint16_t));
+	} else {
+		buf[SUPER_FL_BLOCK_DATA_LEN] = crc;
+		buf[SUPER_FL_BLOCK_DATA_LEN + 1] = SUPER_WRITE_BLOCK;
+		micro_batch_pokebuf16(&batch, SUPER_FL_BLOCK_DATA, (SUPER_FL_BLOCK_DATA_LEN + 2) * sizeof(uint16_t));
 	}
+	if (sts)
+		micro_batch_peek16(&batch, SUPER_FL_FLASH_STS, sts, 2);
 
-	lseek(binfd, 0, SEEK_SET);
+	return micro_batch_run(&batch, 0);
+}
 
-	/* If flash is already opened from a previous action, close it to reset
-	 * the flash state.
-	 */
-	if (speek16(i2cfd, board->i2c_chip, SUPER_FL_FLASH_STS, &status) < 0)
-		goto err_out;
+/*
+ * Issue a flash command and read the flash status it leaves behind, in one
+ * transaction. Returns < 0 on failure, 0 on success.
+ */
+static int v1_flash_cmd(micro_t *micro, uint16_t cmd, uint8_t *status)
+{
+	struct micro_batch batch;
+	uint16_t sts;
+
+	micro_batch_init(&batch, micro);
+	micro_batch_poke16(&batch, SUPER_FL_FLASH_CMD, cmd);
+	micro_batch_peek16(&batch, SUPER_FL_FLASH_STS, &sts, 2);
+	if (micro_batch_run(&batch, 0) < 0)
+		return -1;
+
+	*status = sts & 0xff;
+	return 0;
+}
 
-	if ((status & 0xff) != STATUS_CLOSED) {
-		if (spoke16(i2cfd, board->i2c_chip, SUPER_FL_FLASH_CMD, SUPER_CLOSE_FLASH) < 0)
-			goto err_out;
+static int v1_read_flash_status(micro_t *micro, uint8_t *status)
+{
+	uint16_t sts;
 
-		if (speek16(i2cfd, board->i2c_chip, SUPER_FL_FLASH_STS, &status) < 0)
-			goto err_out;
+	if (speek16_quiet(micro, SUPER_FL_FLASH_STS, &sts) < 0)
+		return -1;
 
-		if ((status & 0xff) != STATUS_CLOSED) {
-			fprintf(stderr, "Couldn't re-close flash!\n");
-			goto err_out;
-		}
-	}
+	*status = sts & 0xff;
+	return 0;
+}
+
+/*
+ * With SUPER_FEAT_DBLBUF, reports whether the micro can take another block.
+ * A block still queued behind the one in progress, or one not yet picked up,
+ * reads as STATUS_WAIT. Once the queue is empty the block in progress reads
+ * as STATUS_IN_PROC even though the micro is still busy with it.
+ */
+static uint8_t v1_spare_status(uint16_t sts)
+{
+	if ((sts & SUPER_BLOCK_PENDING) || (sts & 0xff) == STATUS_READY)
+		return STATUS_WAIT;
+	else if ((sts & 0xff) == STATUS_WAIT)
+		return STATUS_IN_PROC;
+	else
+		return sts & 0xff;
+}
+
+static int v1_read_spare_status(micro_t *micro, uint8_t *status)
+{
+	uint16_t sts;
+
+	if (speek16_quiet(micro, SUPER_FL_FLASH_STS, &sts) < 0)
+		return -1;
+
+	*status = v1_spare_status(sts);
+	return 0;
+}
 
+/*
+ * The update as a state machine, see update-sm.h. Each state runs until it
+ * has to wait on the micro, so a state named for a wait is entered to take
+ * the next sample.
+ */
+enum v1_state {
+	V1_START,
+	V1_HEADER, /* Magic key and length, then open, resume, or re-close */
+	V1_RESUMING,
+	V1_RECLOSING, /* Closing flash left open, before opening it afresh */
+	V1_OPEN,
+	V1_OPENING,
+	V1_OPENED,
+	V1_BLOCK, /* Send the next block, or finish */
+	V1_BLOCK_WAIT,
+	V1_BLOCK_EXTEND, /* Backed off from a slow block, wait on it again */
+	V1_BACKOFF, /* Backed off from a failed block, work out what to send next */
+	V1_SETTLE,
+	V1_FINISH,
+	V1_CLOSING,
+};
+
+/*
+ * Issue SUPER_OPEN_FLASH or SUPER_RESUME_FLASH, prepare the image while the
+ * micro works on it, and start waiting for it to finish. Returns < 0 on
+ * failure.
+ */
+static int v1_open_flash(struct update_sm *sm, uint16_t cmd)
+{
 	/* Poll until flash is opened. This also has to check/erase flash
 	 * which happens while interrupts are disabled for flash safety. Because
 	 * interrupts are disabled, I2C transactions get stalled, and can
-	 * generate errors. Wait a long timeout before trying to talk to the
-	 * uC again.
+	 * generate errors. Those are treated as the micro still being busy.
 	 */
-	if (spoke16(i2cfd, board->i2c_chip, SUPER_FL_FLASH_CMD, SUPER_OPEN_FLASH) < 0)
-		goto err_out;
+	if (spoke16(sm->micro, SUPER_FL_FLASH_CMD, cmd) < 0)
+		return -1;
 
-	sleep(1);
+	if (update_prepare_during_open(sm->micro, sm->img, &sm->open_cfg) < 0)
+		return -1;
 
-	if (speek16(i2cfd, board->i2c_chip, SUPER_FL_FLASH_STS, &status) < 0)
-		goto err_out;
+	poll_begin(&sm->poll, &sm->open_cfg, v1_read_flash_status,
+		   (cmd == SUPER_RESUME_FLASH) ? poll_busy_resuming : poll_busy_opening, NULL);
 
-	if ((status & 0xff) != STATUS_READY) {
-		fprintf(stderr, "Failed to open flash!\n");
-		if (status != STATUS_CLOSED)
-			flash_print_error(status);
-		goto err_out;
+	return 0;
+}
+
+/* Close flash and start waiting for it to be closed. Returns < 0 on failure. */
+static int v1_close_flash(struct update_sm *sm)
+{
+	if (v1_flash_cmd(sm->micro, SUPER_CLOSE_FLASH, &sm->flash_sts) < 0)
+		return -1;
+
+	poll_begin(&sm->poll, &poll_cfg_close, v1_read_flash_status, poll_busy_closing, &sm->flash_sts);
+
+	return 0;
+}
+
+/*
+ * Flash was resumed. Pick up the interrupted update where the micro says it
+ * stopped, with the first block still to be written in sm->start. Returns
+ * < 0 on failure, 1 if what the micro kept does not line up with our blocks,
+ * 0 on success.
+ */
+static int v1_resumed(struct update_sm *sm)
+{
+	struct update_image *img = sm->img;
+	uint32_t kept;
+	uint16_t ofs;
+
+	if (speek16(sm->micro, SUPER_FL_WRITE_OFS, &ofs) < 0)
+		return -1;
+
+	kept = (uint32_t)ofs * UPDATE_BLOCK_SZ;
+	if (kept <= img->bin_size && (kept % img->block_sz == 0 || kept == img->bin_size)) {
+		sm->start = (kept + img->block_sz - 1) / img->block_sz;
+		if (kept)
+			printf("Resuming update at byte %u of %u\n", kept, img->bin_size);
+		return 0;
+	}
+
+	fprintf(stderr, "Micro kept %u bytes, not a whole number of %u byte blocks, starting over\n", kept,
+		img->block_sz);
+	return 1;
+}
+
+/*
+ * The block in sm->blk failed on its way to the micro, or the micro rejected
+ * it, reason says which. Account for the retry and back off before it, see
+ * V1_BACKOFF. A block rejected for its CRC was not taken, but after a failed
+ * transfer only firmware that counts what it finished can say whether it got
+ * the block. Returns UPDATE_SM_WAIT, or < 0 if the block can't or shouldn't
+ * be sent again.
+ */
+static int v1_retry_block(struct update_sm *sm, enum retry_reason reason)
+{
+	int backoff;
+
+	sm->reason = reason;
+
+	if (reason != RETRY_CRC && !(sm->features & (SUPER_FEAT_DBLBUF | SUPER_FEAT_RESUME))) {
+		fprintf(stderr, "\nCan't tell whether the micro took block %u, not retrying\n", sm->blk);
+		return -1;
 	}
 
-	/* Write BIN to MCU via I2C */
-	for (i = bin_size; i; i -= 128) {
-		printf("\r%d/%d", bin_size - i, bin_size);
-		fflush(stdout);
-		ret = read(binfd, buf, 128);
-		if (ret < 0) {
-			perror("Error reading from bin file");
-			goto err_out;
-		} else if (ret < 128) {
-			fprintf(stderr, "Short read from bin, got %d, expected 128\n", ret);
-			goto err_out;
-		} else {
-			crc = (uint16_t)crc8((uint8_t *)buf, 128);
-
-			if (spokestream16(i2cfd, board->i2c_chip, SUPER_FL_BLOCK_DATA, buf, 128) < 0)
+	backoff = update_retry(sm->micro, &retry_policy_block, &sm->tries, reason);
+	if (backoff < 0)
+		return -1;
+
+	sm->state = V1_BACKOFF;
+	return update_sm_wait_us(sm, backoff);
+}
+
+/*
+ * After a failed block, once the micro settled, ask it how far it got, since
+ * sm->start, and send that block next. With two block buffers a rejected
+ * block may not be the block just sent either. Returns < 0 on failure.
+ */
+static int v1_recount(struct update_sm *sm)
+{
+	struct update_image *img = sm->img;
+	uint32_t written;
+	uint16_t count;
+
+	if (sm->features & SUPER_FEAT_DBLBUF) {
+		if (speek16(sm->micro, SUPER_FL_BLOCKS_DONE, &count) < 0)
+			return -1;
+		sm->blk = sm->start + count;
+	} else {
+		if (speek16(sm->micro, SUPER_FL_WRITE_OFS, &count) < 0)
+			return -1;
+		written = (uint32_t)count * UPDATE_BLOCK_SZ;
+		if (written > img->bin_size || (written % img->block_sz && written != img->bin_size))
+			return -1;
+		sm->blk = (written + img->block_sz - 1) / img->block_sz;
+	}
+
+	return (sm->blk <= img->nblocks) ? 0 : -1;
+}
+
+static int v1_update_step(struct update_sm *sm)
+{
+	micro_t *micro = sm->micro;
+	struct update_image *img = sm->img;
+	uint32_t bin_size = img->bin_size;
+	poll_read_fn read_sts;
+	uint16_t status = 0;
+	uint16_t done;
+	unsigned int len;
+	int block_sz;
+	int sampled;
+	int ret;
+
+	for (;;) {
+		switch (sm->state) {
+		case V1_START:
+			if (do_v1_micro_snapshot(sm->board, micro) < 0)
+				goto err_out;
+			sm->features = micro->snap.features;
+
+			if (!(sm->features & SUPER_FEAT_FWUPD)) {
+				fprintf(stderr, "Firmware does not support updates. (0x%X)\n", sm->features);
+				goto err_out;
+			}
+
+			block_sz = v1_negotiate_block_size(micro, sm->features);
+			if (block_sz < 0 || update_image_set_block_size(img, block_sz) < 0)
 				goto err_out;
+			sm->block_sz = block_sz;
+
+			/* A large block takes proportionally longer to decrypt and program */
+			sm->block_cfg = poll_cfg_block;
+			sm->block_cfg.initial_us *= block_sz / UPDATE_BLOCK_SZ;
+			sm->block_cfg.deadline_us *= block_sz / UPDATE_BLOCK_SZ;
+			sm->block_cfg.max_us *= block_sz / UPDATE_BLOCK_SZ;
+			/*
+			 * Firmware with two block buffers takes the next block while
+			 * it programs, only the one at a time kind needs holding off.
+			 */
+			sm->block_holdoff_us = 0;
+			if (!(sm->features & (V1_FEAT_ONE_WRITE | SUPER_FEAT_DBLBUF)))
+				sm->block_holdoff_us = V1_LEGACY_HOLDOFF_US;
+			if (sm->block_cfg.initial_us < sm->block_holdoff_us)
+				sm->block_cfg.initial_us = sm->block_holdoff_us;
+
+			/*
+			 * Firmware that keeps a partial update across an interruption is only
+			 * asked to resume it when the journal says it is this image, written in
+			 * the same size blocks, to this micro.
+			 */
+			if (sm->features & SUPER_FEAT_RESUME)
+				sm->resume = journal_open(&sm->journal, micro->journal_dir, sm->board, img,
+							  &micro->snap) == 1 &&
+					     sm->journal.rec.block_sz == (unsigned int)block_sz;
+
+			fflush(stdout);
+
+			/*
+			 * Let the messages print out. Some of the flash operations will
+			 * cause the micro to drop some chars if they output while we touch 
+			 * flash 
+			 */
+			sm->state = V1_HEADER;
+			return update_sm_wait_us(sm, 1000 * 10);
 
-			if (spoke16(i2cfd, board->i2c_chip, SUPER_FL_BLOCK_CRC, crc) < 0)
+		case V1_HEADER:
+			stats_phase_begin(micro, STATS_PHASE_OPEN);
+
+			/* Whatever the micro reports may change from here on */
+			micro->snap.valid = 0;
+
+			/* Write magic key and length/location information */
+			if (spokestream16(micro, SUPER_FL_MAGIC_KEY0, (uint16_t *)&magic_key, 4) < 0) {
+				fprintf(stderr, "Failed to write magic key");
 				goto err_out;
+			}
 
-			if (spoke16(i2cfd, board->i2c_chip, SUPER_FL_FLASH_CMD, SUPER_WRITE_BLOCK) < 0)
+			if (spokestream16(micro, SUPER_FL_SZ0, (uint16_t *)&bin_size, 4) < 0) {
+				fprintf(stderr, "Failed to write bin length");
 				goto err_out;
+			}
+
+			if (sm->resume) {
+				if (v1_open_flash(sm, SUPER_RESUME_FLASH) < 0)
+					goto err_out;
+				sm->state = V1_RESUMING;
+				break;
+			}
+
+			/* If flash is already opened from a previous action, close it to reset
+			 * the flash state.
+			 */
+			if (speek16(micro, SUPER_FL_FLASH_STS, &status) < 0)
+				goto err_out;
+
+			if ((status & 0xff) != STATUS_CLOSED) {
+				if (v1_close_flash(sm) < 0)
+					goto err_out;
+				sm->state = V1_RECLOSING;
+			} else {
+				sm->state = V1_OPEN;
+			}
+			break;
+
+		case V1_RESUMING:
+			ret = poll_step(&sm->poll, micro, &sm->flash_sts);
+			if (ret == POLL_AGAIN)
+				return update_sm_wait_poll(sm);
+			if (ret < 0 || (sm->flash_sts != STATUS_READY && sm->flash_sts != STATUS_IN_PROC &&
+					sm->flash_sts != STATUS_DONE)) {
+				fprintf(stderr, "Failed to resume flash! (%u ms)\n", sm->poll.res.elapsed_us / 1000);
+				if (sm->flash_sts != STATUS_CLOSED)
+					flash_print_error(sm->flash_sts);
+				goto err_out;
+			}
+			stats_open_wait(micro, &sm->poll.res);
+
+			ret = v1_resumed(sm);
+			if (ret < 0)
+				goto err_out;
+			if (ret == 0) {
+				sm->state = V1_OPENED;
+				break;
+			}
+
+			/* Closed again to start over */
+			if (v1_close_flash(sm) < 0)
+				goto err_out;
+			sm->state = V1_RECLOSING;
+			break;
+
+		case V1_RECLOSING:
+			ret = poll_step(&sm->poll, micro, &sm->flash_sts);
+			if (ret == POLL_AGAIN)
+				return update_sm_wait_poll(sm);
+			if (ret < 0) {
+				fprintf(stderr, "Couldn't re-close flash! (%u ms)\n", sm->poll.res.elapsed_us / 1000);
+				goto err_out;
+			}
+			sm->state = V1_OPEN;
+			break;
+
+		case V1_OPEN:
+			if (v1_open_flash(sm, SUPER_OPEN_FLASH) < 0)
+				goto err_out;
+			sm->state = V1_OPENING;
+			break;
+
+		case V1_OPENING:
+			ret = poll_step(&sm->poll, micro, &sm->flash_sts);
+			if (ret == POLL_AGAIN)
+				return update_sm_wait_poll(sm);
+			if (ret < 0 || sm->flash_sts != STATUS_READY) {
+				fprintf(stderr, "Failed to open flash! (%u ms)\n", sm->poll.res.elapsed_us / 1000);
+				if (sm->flash_sts != STATUS_CLOSED)
+					flash_print_error(sm->flash_sts);
+				goto err_out;
+			}
+			stats_open_wait(micro, &sm->poll.res);
+			sm->state = V1_OPENED;
+			break;
+
+		case V1_OPENED:
+			journal_begin(&sm->journal, sm->block_sz);
+			stats_resume(micro, sm->start);
+
+			stats_phase_end(micro, STATS_PHASE_OPEN);
+			stats_phase_begin(micro, STATS_PHASE_BLOCKS);
+
+			/* Write BIN to MCU via I2C */
+			sm->blk = sm->start;
+			sm->state = V1_BLOCK;
+			break;
+
+		case V1_BLOCK:
+			if (sm->blk >= img->nblocks) {
+				stats_phase_end(micro, STATS_PHASE_BLOCKS);
+				sm->state = V1_FINISH;
+				break;
+			}
+
+			len = update_image_block_len(img, sm->blk);
+
+			sm->block_start = micro_now_ns();
+
+			/* Straight from the image into the transfer buffer, behind the address */
+			memcpy(micro_xfer_payload(micro), &img->bin[sm->blk * sm->block_sz], len);
+			sampled = (sm->features & V1_FEAT_ONE_WRITE) != 0;
+			if (v1_write_block(micro, sm->features, sm->block_sz, len, img->block_crc[sm->blk],
+					   sampled ? &status : NULL) < 0) {
+				if (!update_err_is_transient(errno))
+					goto err_out;
+				ret = v1_retry_block(sm, RETRY_BUS);
+				if (ret < 0)
+					goto err_retry;
+				return ret;
+			}
+			sm->block_xfer = micro_now_ns() - sm->block_start;
 
 			/* There is some unknown amount of time for a write to
 			 * complete, its based on the current uC and flash controller
-			 * clocks, but 2 milliseconds should be enough in most cases.
-			 * Most of the time is taken up by the decryption of the
-			 * data block. However, the actual flash write is a non-zero
-			 * time too. During which interrupts are disabled for flash
-			 * safety. The timeout helps ensure the process completes
-			 * before we start polling for state.
+			 * clocks. Most of the time is taken up by the decryption of
+			 * the data block. However, the actual flash write is a
+			 * non-zero time too. During which interrupts are disabled
+			 * for flash safety, and the micro may NAK.
+			 *
+			 * Firmware with two block buffers takes the next block while
+			 * this one is still in progress, so only wait for the spare
+			 * buffer. The last block waits for everything to finish.
+			 */
+			read_sts = v1_read_flash_status;
+			sm->flash_sts = status & 0xff;
+			if ((sm->features & SUPER_FEAT_DBLBUF) && sm->blk + 1 < img->nblocks) {
+				read_sts = v1_read_spare_status;
+				sm->flash_sts = v1_spare_status(status);
+			}
+
+			/* Unsampled, the first sample is a transaction of its own where a NAK only counts as busy */
+			poll_begin(&sm->poll, &sm->block_cfg, read_sts, poll_busy_writing,
+				   sampled ? &sm->flash_sts : NULL);
+			sm->state = V1_BLOCK_WAIT;
+			break;
+
+		case V1_BLOCK_WAIT:
+			ret = poll_step(&sm->poll, micro, &sm->flash_sts);
+			if (ret == POLL_AGAIN)
+				return update_sm_wait_poll(sm);
+			if (ret < 0) {
+				/* A slow block is still a block in progress, give it longer */
+				if (errno == ETIMEDOUT) {
+					ret = update_retry(micro, &retry_policy_block, &sm->tries, RETRY_TIMEOUT);
+					if (ret >= 0) {
+						sm->state = V1_BLOCK_EXTEND;
+						return update_sm_wait_us(sm, ret);
+					}
+				}
+				fprintf(stderr, "\nTimed out waiting for block write (%u ms)\n",
+					sm->poll.res.elapsed_us / 1000);
+				goto err_out;
+			}
+
+			if (sm->flash_sts == STATUS_CRC_ERR) {
+				ret = v1_retry_block(sm, RETRY_CRC);
+				if (ret < 0)
+					goto err_retry;
+				return ret;
+			}
+
+			if (sm->flash_sts != STATUS_IN_PROC && sm->flash_sts != STATUS_DONE) {
+				flash_print_error(sm->flash_sts);
+				goto err_out;
+			}
+
+			len = update_image_block_len(img, sm->blk);
+			stats_block(micro, sm->blk, sm->block_start, sm->block_xfer, &sm->poll.res);
+			if (!sm->tries)
+				poll_cfg_block_learn(&sm->block_cfg, &sm->poll.res, sm->block_holdoff_us);
+			update_progress(micro, sm->blk * sm->block_sz + len, bin_size);
+			sm->blk++;
+			sm->tries = 0;
+			sm->state = V1_BLOCK;
+			break;
+
+		case V1_BLOCK_EXTEND:
+			poll_begin(&sm->poll, &sm->block_cfg, sm->poll.read_status, poll_busy_writing, NULL);
+			sm->state = V1_BLOCK_WAIT;
+			break;
+
+		case V1_BACKOFF:
+			if (sm->reason == RETRY_CRC && !(sm->features & SUPER_FEAT_DBLBUF)) {
+				sm->state = V1_BLOCK;
+				break;
+			}
+
+			/* Let the micro finish whatever it did take, then ask how far it got */
+			poll_begin(&sm->poll, &sm->block_cfg, v1_read_flash_status, poll_busy_writing, NULL);
+			sm->state = V1_SETTLE;
+			break;
+
+		case V1_SETTLE:
+			ret = poll_step(&sm->poll, micro, &sm->flash_sts);
+			if (ret == POLL_AGAIN)
+				return update_sm_wait_poll(sm);
+			if (ret < 0 || v1_recount(sm) < 0)
+				goto err_retry;
+			sm->state = V1_BLOCK;
+			break;
+
+		case V1_FINISH:
+			/* Blocks were in flight two at a time, make sure none went missing */
+			if ((sm->features & SUPER_FEAT_DBLBUF) && sm->flash_sts == STATUS_DONE) {
+				if (speek16(micro, SUPER_FL_BLOCKS_DONE, &done) < 0)
+					goto err_out;
+				if (done != img->nblocks - sm->start) {
+					fprintf(stderr, "\nMicro finished %u of %u blocks\n", done,
+						img->nblocks - sm->start);
+					goto err_out;
+				}
+			}
+
+			/* Do a DONE check to make sure both sides moved as much data as they
+			 * both expected. If uC is still IN_PROC then the full amount of data
+			 * was not received.
 			 */
-			usleep(2000);
-			retry_count = 100;
-			do {
-				usleep(10);
-				speek16(i2cfd, board->i2c_chip, SUPER_FL_FLASH_STS, &status);
-				status &= 0xff;
-				if (!retry_count--)
-					break;
-			} while (status == STATUS_WAIT);
-
-			if (status != STATUS_IN_PROC && status != STATUS_DONE) {
-				flash_print_error(status);
+			if (sm->flash_sts != STATUS_DONE) {
+				printf("\r                            ");
+				fprintf(stderr, "\rError: Updated failed\n");
 				goto err_out;
+			} else {
+				printf("\r                            ");
+				printf("\rWrote %d byte supervisor update\n", bin_size);
 			}
+
+			stats_phase_begin(micro, STATS_PHASE_CLOSE);
+
+			/* Poll until flash is closed */
+			if (v1_close_flash(sm) < 0)
+				goto err_out;
+			sm->state = V1_CLOSING;
+			break;
+
+		case V1_CLOSING:
+			ret = poll_step(&sm->poll, micro, &sm->flash_sts);
+			if (ret == POLL_AGAIN)
+				return update_sm_wait_poll(sm);
+			if (ret < 0) {
+				fprintf(stderr, "Flash did not close (%u ms)\n", sm->poll.res.elapsed_us / 1000);
+				goto err_out;
+			}
+			journal_finish(&sm->journal);
+
+			/*
+			 * If there is a valid image when the microcontroller starts up, it will
+			 * switch to it on the next startup. However, the microcontroller does not
+			 * normally reboot from the main cpu running a reboot. To apply an update
+			 * in the field, we can tell it for the next linux reboot to cause a full
+			 * reset for the microcontroller as well.
+			 */
+			spoke16(micro, SUPER_FL_FLASH_CMD, SUPER_APPLY_REBOOT);
+			stats_phase_end(micro, STATS_PHASE_CLOSE);
+			printf("Update succeeded. On the next reboot the microcontroller update "
+			       "will be live. This will force the USB console device to "
+			       "disconnect momentarily while the update applies.\n");
+
+			return UPDATE_SM_DONE;
 		}
 	}
 
-	/* Do a DONE check to make sure both sides moved as much data as they
-	 * both expected. If uC is still IN_PROC then the full amount of data
-	 * was not received.
-	 */
-	if (status != STATUS_DONE) {
-		printf("\r                            ");
-		fprintf(stderr, "\rError: Updated failed\n");
-		goto err_out;
-	} else {
-		printf("\r                            ");
-		printf("\rWrote %d byte supervisor update\n", bin_size);
-	}
+err_retry:
+	if (sm->reason == RETRY_CRC)
+		flash_print_error(STATUS_CRC_ERR);
+err_out:
+	journal_close(&sm->journal);
+	return UPDATE_SM_FAILED;
+}
 
-	if (spoke16(i2cfd, board->i2c_chip, SUPER_FL_FLASH_CMD, SUPER_CLOSE_FLASH) < 0)
-		goto err_out;
+/* Set sm up to update micro with img, see update-sm.h */
+void do_v1_micro_update_start(struct update_sm *sm, board_t *board, micro_t *micro, struct update_image *img)
+{
+	update_sm_init(sm, v1_update_step, board, micro, img);
+	sm->state = V1_START;
+}
 
-	/* Poll until flash is closed */
-	retry_count = 100;
-	do {
-		usleep(10);
-		speek16(i2cfd, board->i2c_chip, SUPER_FL_FLASH_STS, &status);
-		status &= 0xff;
-		if (!retry_count--)
-			goto err_out;
-	} while (status != STATUS_CLOSED);
-
-	/*
-	 * If there is a valid image when the microcontroller starts up, it will
-	 * switch to it on the next startup. However, the microcontroller does not
-	 * normally reboot from the main cpu running a reboot. To apply an update
-	 * in the field, we can tell it for the next linux reboot to cause a full
-	 * reset for the microcontroller as well.
-	 */
-	spoke16(i2cfd, board->i2c_chip, SUPER_FL_FLASH_CMD, SUPER_APPLY_REBOOT);
-	printf("Update succeeded. On the next reboot the microcontroller update "
-	       "will be live. This will force the USB console device to "
-	       "disconnect momentarily while the update applies.\n");
+int do_v1_micro_update(board_t *board, micro_t *micro, struct update_image *img)
+{
+	struct update_sm sm;
 
-	close(binfd);
-	return 0;
+	do_v1_micro_update_start(&sm, board, micro, img);
 
-err_out:
-	close(binfd);
-	return -1;
+	return update_sm_run(&sm);
 }
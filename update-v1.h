@@ -1,8 +1,103 @@
 #pragma once
 
+#include "micro.h"
 #include "update-shared.h"
+#include "update-sm.h"
 
-int do_v1_micro_update(board_t *board, int i2cfd, char *update_path);
-int do_v1_micro_get_rev(board_t *board, int i2cfd, int *revision);
-int do_v1_micro_get_file_rev(board_t *board, int *revision, char *update_path);
-int do_v1_micro_print_info(board_t *board, int i2cfd);
+#define SUPER_MODEL 0
+#define SUPER_REV_INFO 1
+#define SUPER_ADC_CHAN_ADV 2
+#define SUPER_FEATURES0 3
+#define SUPER_CMDS 8
+#define SUPER_GEN_FLAGS 16
+#define SUPER_GEN_INPUTS 24
+#define SUPER_ADC_BASE 128
+#define SUPER_TEMPERATURE 159
+
+#define SUPER_FL_MAGIC_KEY0 65024 // 0xFE00
+#define SUPER_FL_MAGIC_KEY1 65025 // 0xFE01
+#define SUPER_FL_SZ0 65030 // 0xFE06
+#define SUPER_FL_SZ1 65031 // 0xFE07
+#define SUPER_FL_BLOCK_DATA 65033 // 0xFE09 /* 128 bytes long, or 64 16-bit registers */
+#define SUPER_FL_BLOCK_CRC 65097 // 0xFE49
+#define SUPER_FL_FLASH_CMD 65098 // 0xFE4A
+#define SUPER_FL_FLASH_STS 65099 // 0xFE4B
+#define SUPER_FL_BLOCK_DATA_LEN 64
+
+/*
+ * Large blocks, with SUPER_FEAT_XBLOCK. XBLOCK_MAX reads back the largest
+ * block, in bytes, the firmware can take. The block length set in XBLOCK_LEN
+ * (a multiple of 128, 128 until set) applies to blocks written through the
+ * XBLOCK_DATA window: len / 2 data registers, then the CRC, then the flash
+ * command, all in one auto-incrementing write.
+ */
+#define SUPER_FL_XBLOCK_MAX 65100 // 0xFE4C
+#define SUPER_FL_XBLOCK_LEN 65101 // 0xFE4D
+#define SUPER_FL_XBLOCK_DATA 61440 // 0xF000
+
+/* Blocks finished since flash was opened, with SUPER_FEAT_DBLBUF */
+#define SUPER_FL_BLOCKS_DONE 65102 // 0xFE4E
+
+/*
+ * With SUPER_FEAT_RESUME, how much of the update is in flash, in 128-byte
+ * units. After SUPER_RESUME_FLASH this is where the next block goes.
+ */
+#define SUPER_FL_WRITE_OFS 65103 // 0xFE4F
+
+enum super_flash_status {
+	SUPER_UPDATE_ON_REBOOT = (1 << 8), /* Set when the APPLY_REBOOT command is issued */
+	SUPER_BLOCK_PENDING = (1 << 9), /* A second block is queued behind the one in progress */
+	/* Bits 7:0 are STATUS_ from flashwrite */
+};
+
+/*
+ * SUPER_RESUME_FLASH opens flash like SUPER_OPEN_FLASH, but keeps whatever an
+ * interrupted update of the same size already wrote instead of erasing it. It
+ * finishes in STATUS_READY if nothing was kept, STATUS_IN_PROC if part of the
+ * update was, or STATUS_DONE if all of it was, with SUPER_FL_WRITE_OFS saying
+ * how much. Only the host can tell whether what was kept is from the same
+ * update file, see update-journal.h.
+ */
+enum super_flash_cmd {
+	SUPER_RESUME_FLASH = (1 << 4),
+	SUPER_APPLY_REBOOT = (1 << 3),
+	SUPER_CLOSE_FLASH = (1 << 2),
+	SUPER_OPEN_FLASH = (1 << 1),
+	SUPER_WRITE_BLOCK = (1 << 0),
+};
+
+/* Some return values of tend() */
+enum i2c_cmds_t {
+	I2C_NOCMD = (0 << 0),
+	I2C_REBOOT = (1 << 0),
+	I2C_HALT = (1 << 1),
+};
+
+enum gen_flags_t {
+	GEN_FLAG_LED_DAT = (1 << 3),
+	GEN_FLAG_OVERRIDE_LED = (1 << 2),
+	GEN_FLAG_WAKE_EN = (1 << 1),
+	GEN_FLAG_ALARM_TYPE = (1 << 0),
+};
+
+enum gen_inputs_t {
+	GEN_INPUTS_USB_VBUS = (1 << 1),
+	GEN_INPUTS_EN_DB9_CONSOLE = (1 << 0),
+};
+
+enum super_features_t {
+	SUPER_FEAT_RESUME = (1 << 6), /* SUPER_RESUME_FLASH and SUPER_FL_WRITE_OFS */
+	SUPER_FEAT_DBLBUF = (1 << 5), /* WRITE_BLOCK may be issued while the previous block is in progress */
+	SUPER_FEAT_XBLOCK = (1 << 4), /* Blocks larger than 128 bytes, see SUPER_FL_XBLOCK_MAX */
+	SUPER_FEAT_BLKCMT = (1 << 3), /* Block data, CRC, and WRITE_BLOCK accepted as one write */
+	SUPER_FEAT_SN = (1 << 2),
+	SUPER_FEAT_FWUPD = (1 << 1),
+	SUPER_FEAT_RSTC = (1 << 0),
+};
+
+int do_v1_micro_update(board_t *board, micro_t *micro, struct update_image *img);
+void do_v1_micro_update_start(struct update_sm *sm, board_t *board, micro_t *micro, struct update_image *img);
+int do_v1_micro_get_rev(board_t *board, micro_t *micro, int *revision);
+int do_v1_micro_open_image(board_t *board, struct update_image *img, char *update_path);
+int do_v1_micro_probe_footer(const uint8_t *tail, size_t tail_len, size_t full_size, struct update_footer_info *info);
+int do_v1_micro_snapshot(board_t *board, micro_t *micro);